@@ -1,66 +1,16 @@
 #include <float.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "collision.h"
 #include "event.h"
 #include "grid.h"
 #include "mpi_vars.h"
+#include "pair_kernel.h"
 #include "simulation.h"
 #include "vector_3.h"
 
-// Adapted from: https://www.gamasutra.com/view/feature/131424/pool_hall_lessons_fast_accurate_.php?page=2
-// Finds the time at which the two spheres will collide.
-// If the spheres will not collide on their current paths then returns DBL_MAX.
-// Note this assumes that the velocity of both particles is constant before the collision.
-// Performs the following tests to see if the spheres will collide.
-// First test:
-//	1) Obtain velocity of s1 relative to s2.
-//	2) Obtain position of s2 relative to s1.
-//	3) If the shortest angle between these two vectors is >= 90 then the 
-//	   spheres will not collide on their current paths so return.
-// Second test:
-//	1) Using relative velocity and position find the shortest distance 
-//	   between the two points along their current paths.
-//	2) If this is larger than the sum of their radii then the spheres will 
-//	   not collide so return.
-// If these tests pass then we know the spheres will collide. 
-// We then have to figure out the actual point of collision, as the shortest
-// distance will very likely be when the spheres pass through one another.
-// Trigonometry is used to figure out where the spheres collide.
-static double find_collision_time_spheres(const struct sphere_s *s1, const struct sphere_s *s2) {
-	union vector_3d rel_vel;
-	rel_vel.x = s1->vel.x - s2->vel.x; 
-	rel_vel.y = s1->vel.y - s2->vel.y; 
-	rel_vel.z = s1->vel.z - s2->vel.z;
-	union vector_3d rel_pos;
-	rel_pos.x = s2->pos.x - s1->pos.x; 
-	rel_pos.y = s2->pos.y - s1->pos.y; 
-	rel_pos.z = s2->pos.z - s1->pos.z;
-	double dp = get_vector_3d_dot_product(&rel_vel, &rel_pos);
-	double vel_vec_mag = get_vector_3d_magnitude(&rel_vel);
-	double pos_vec_mag = get_vector_3d_magnitude(&rel_pos);
-	double angle = get_shortest_angle_between_vector_3d(dp, vel_vec_mag, pos_vec_mag);
-	if (angle >= 3.14159265358979323846 / 2.0) { //check if >= 90 degrees (note angle is in radians)
-		return DBL_MAX;
-	}
-	double r_total = s1->radius + s2->radius;
-	double shortest_dist = sin(angle) * pos_vec_mag;
-	if (shortest_dist > r_total) {
-		return DBL_MAX;
-	}
-	double d = sqrt((pos_vec_mag * pos_vec_mag) - (shortest_dist * shortest_dist));
-	double t = sqrt((r_total * r_total) - (shortest_dist * shortest_dist));
-	double dist_to_col = d - t;
-	// d should always be larger than t, but due to precision issues it may be
-	// very slightly smaller than t causing dist_to_col to be negative.
-	// This can occur when the shortest distance is 0.0.
-	// If this happens (d-t) should be 0.0, so just return 0.0
-	if (dist_to_col < 0.0) {
-		return 0.0;
-	}
-	return  dist_to_col / vel_vec_mag;
-}
-
 // Finds the time taken to cross the boundary on the specified axis in the grid or sector.
 // axis_vel and axis_pos are the velocity/position of the sphere on that axis.
 // If checking against the grid then bound_start will be 0.0, if checking against
@@ -120,7 +70,7 @@ static double find_collision_time_grid(const struct sphere_s *s, enum axis *col_
 	enum axis a;
 	for (a = X_AXIS; a <= Z_AXIS; a++) {
 		if (s->vel.vals[a] != 0) {
-			double temp_time = find_time_to_cross_boundary(0.0, sim_data.grid_size.vals[a], s->vel.vals[a], s->pos.vals[a], s->radius);
+			double temp_time = find_time_to_cross_boundary(0.0, sim_data.grid_size.vals[a], s->vel.vals[a], s->pos.vals[a], get_sphere_radius(s));
 			if (temp_time < time) {
 				time = temp_time;
 				*col_axis = a;
@@ -130,15 +80,151 @@ static double find_collision_time_grid(const struct sphere_s *s, enum axis *col_
 	return time;
 }
 
+// Spheres copied into blocks for find_soonest_collision_in_block and
+// find_soonest_collisions_between_blocks, and the soonest partner and time
+// found for each sphere in block_a.
+static struct sphere_block_s block_a;
+static struct sphere_block_s block_b;
+static int64_t *soonest_indices;
+static double *soonest_times;
+static int64_t max_soonest;
+
+// A sphere heading towards another sector which has to be checked against the
+// spheres in that sector for partial crossings.
+struct partial_crossing_check_s {
+	struct sphere_s *sphere_1;
+	struct sector_s *sector_1;
+	struct sector_s *sector_2;
+	struct sphere_s *sphere_2; // soonest partner found in sector_2, NULL if none
+	double time; // time until the collision with sphere_2, or the cutoff if there is none
+};
+
+static struct partial_crossing_check_s *checks;
+static int64_t num_checks;
+static int64_t max_checks;
+static int64_t *check_order; // checks ordered by sector_2
+static int64_t *checks_per_sector;
+
+static void reserve_soonest_arrays(const int64_t n) {
+	if(n > max_soonest){
+		max_soonest = n;
+		soonest_indices = realloc(soonest_indices, max_soonest * sizeof(int64_t));
+		soonest_times = realloc(soonest_times, max_soonest * sizeof(double));
+	}
+}
+
 // Given a sphere that is known to be heading towards the given sector
-// check if the sphere will collide with spheres in the sector.
+// record that it must be checked against the spheres in the sector.
+// The checks are done together by find_partial_crossing_checks.
+// Only a collision sooner than the local event can replace it, so that is
+// used as the check's cutoff.
 static void find_partial_crossing_events_between_sphere_and_sector(struct sphere_s *sphere_1, struct sector_s *sector_1, struct sector_s *sector_2) {
-	int j;
-	for (j = 0; j < sector_2->num_spheres; j++) {
-		struct sphere_s *sphere_2 = &sector_2->spheres[j];
-		double time = find_collision_time_spheres(sphere_1, sphere_2);
-		set_event_details(time, COL_TWO_SPHERES_PARTIAL_CROSSING, sphere_1, sphere_2, AXIS_NONE, sector_1, sector_2);
+	if(num_checks >= max_checks){
+		max_checks = max_checks == 0 ? 64 : max_checks * 2;
+		checks = realloc(checks, max_checks * sizeof(struct partial_crossing_check_s));
+		check_order = realloc(check_order, max_checks * sizeof(int64_t));
 	}
+	struct partial_crossing_check_s *c = &checks[num_checks];
+	c->sphere_1 = sphere_1;
+	c->sector_1 = sector_1;
+	c->sector_2 = sector_2;
+	c->sphere_2 = NULL;
+	c->time = get_soonest_event_time();
+	num_checks++;
+}
+
+// Checks the spheres in checks[first..last) of check_order against the spheres
+// in sector_2, leaving out its resting spheres if "moving_only" is set.
+// Replicated sectors are brought up to date first, local neighbours are
+// already up to date as they are kept that way by their own process.
+static void check_partial_crossings_against_sector(struct sector_s *sector_2, const int64_t first, const int64_t last, const bool moving_only) {
+	if (first == last) {
+		return;
+	}
+	clear_sphere_block(&block_b);
+	int64_t i;
+	for (i = 0; i < sector_2->num_spheres; i++) {
+		struct sphere_s *sphere_2 = &sector_2->spheres[i];
+		if (moving_only && is_sphere_resting(sphere_2)) {
+			continue;
+		}
+		if(!sector_2->is_local_neighbour){
+			update_sphere_position_to_time(sphere_2, sim_data.elapsed_time);
+		}
+		add_sphere_to_block(&block_b, sphere_2);
+	}
+	clear_sphere_block(&block_a);
+	reserve_soonest_arrays(last - first);
+	for (i = first; i < last; i++) {
+		add_sphere_to_block(&block_a, checks[check_order[i]].sphere_1);
+		soonest_times[i - first] = checks[check_order[i]].time;
+	}
+	stats.num_pair_tests_skipped += find_soonest_collisions_between_blocks(&block_a, &block_b, soonest_indices, soonest_times);
+	for (i = first; i < last; i++) {
+		struct partial_crossing_check_s *c = &checks[check_order[i]];
+		if(soonest_indices[i - first] != -1){
+			c->sphere_2 = block_b.spheres[soonest_indices[i - first]];
+			c->time = soonest_times[i - first];
+		}
+	}
+}
+
+// Checks the spheres in checks[first..last) of check_order, which are all
+// heading towards the same sector, against the spheres in that sector.
+// Resting spheres are moved to the end of the range and only checked against
+// the moving spheres in the sector.
+static void find_partial_crossing_checks_for_sector(const int64_t first, const int64_t last) {
+	struct sector_s *sector_2 = checks[check_order[first]].sector_2;
+	int64_t num_moving = first;
+	int64_t i;
+	for (i = first; i < last; i++) {
+		if (!is_sphere_resting(checks[check_order[i]].sphere_1)) {
+			int64_t temp = check_order[num_moving];
+			check_order[num_moving++] = check_order[i];
+			check_order[i] = temp;
+		}
+	}
+	check_partial_crossings_against_sector(sector_2, first, num_moving, false);
+	check_partial_crossings_against_sector(sector_2, num_moving, last, true);
+}
+
+// Groups the checks by the sector being moved towards so that each sector's
+// spheres are copied once and checked against all of the spheres heading
+// towards it at the same time.
+// The events are then set in the order the checks were found in.
+static void find_partial_crossing_checks() {
+	if(checks_per_sector == NULL){
+		checks_per_sector = malloc((sim_data.num_sectors + 1) * sizeof(int64_t));
+	}
+	int64_t i;
+	for (i = 0; i <= sim_data.num_sectors; i++) {
+		checks_per_sector[i] = 0;
+	}
+	for (i = 0; i < num_checks; i++) {
+		checks_per_sector[checks[i].sector_2->id + 1]++;
+	}
+	for (i = 1; i <= sim_data.num_sectors; i++) {
+		checks_per_sector[i] += checks_per_sector[i - 1];
+	}
+	for (i = 0; i < num_checks; i++) {
+		check_order[checks_per_sector[checks[i].sector_2->id]++] = i;
+	}
+	int64_t first = 0;
+	while (first < num_checks) {
+		int64_t last = first + 1;
+		while (last < num_checks && checks[check_order[last]].sector_2 == checks[check_order[first]].sector_2) {
+			last++;
+		}
+		find_partial_crossing_checks_for_sector(first, last);
+		first = last;
+	}
+	for (i = 0; i < num_checks; i++) {
+		struct partial_crossing_check_s *c = &checks[i];
+		if(c->sphere_2 != NULL){
+			set_event_details(c->time, COL_TWO_SPHERES_PARTIAL_CROSSING, c->sphere_1, c->sphere_2, AXIS_NONE, c->sector_1, c->sector_2);
+		}
+	}
+	num_checks = 0;
 }
 
 // Returns true if the sphere is within the minimum distance from an adjacent
@@ -148,8 +234,8 @@ static bool is_sphere_within_range_of_sector_one_axis(
 		const struct sector_s *dest, const enum axis a, const enum direction dir
 	){
 	return
-		(dir == DIR_POSITIVE && new_pos.vals[a] >= dest->start.vals[a] - sphere->radius - dest->largest_radius) ||
-		(dir == DIR_NEGATIVE && new_pos.vals[a] <= dest->end.vals[a] + sphere->radius + dest->largest_radius);
+		(dir == DIR_POSITIVE && new_pos.vals[a] >= dest->start.vals[a] - get_sphere_radius(sphere) - dest->largest_radius) ||
+		(dir == DIR_NEGATIVE && new_pos.vals[a] <= dest->end.vals[a] + get_sphere_radius(sphere) + dest->largest_radius);
 }
 
 static bool is_sphere_within_range_of_sector_two_axis(
@@ -283,54 +369,293 @@ static void find_partial_crossing_events_for_sector_diagonally_adjacent_three_ax
 // If by the time of the current soonest event it is within a certain distance 
 // of any sector it is travelling towards we must check for partial crossings.
 static void find_partial_crossing_events_for_sector(struct sector_s *sector) {
+	double time = event_details.time - sim_data.elapsed_time;
 	int64_t i;
 	for (i = 0; i < sector->num_spheres; i++) {
 		struct sphere_s *sphere = &sector->spheres[i];
 		union vector_3d new_pos;
-		new_pos.x = sphere->pos.x + (sphere->vel.x * event_details.time);
-		new_pos.y = sphere->pos.y + (sphere->vel.y * event_details.time);
-		new_pos.z = sphere->pos.z + (sphere->vel.z * event_details.time);
+		new_pos.x = sphere->pos.x + (sphere->vel.x * time);
+		new_pos.y = sphere->pos.y + (sphere->vel.y * time);
+		new_pos.z = sphere->pos.z + (sphere->vel.z * time);
 		find_partial_crossing_events_for_sector_directly_adjacent(sphere, sector, new_pos);
 		find_partial_crossing_events_for_sector_diagonally_adjacent(sphere, sector, new_pos);
 		find_partial_crossing_events_for_sector_diagonally_adjacent_three_axes(sphere, sector, new_pos);
 	}
 }
 
-// Finds when all spheres in a given sector will collide with other and returns
-// the soonest time.
+// Offsets to the cells adjacent to a cell that a sphere is checked against.
+// Only half of the 26 adjacent cells are included so that each pair of cells
+// is only checked once.
+static const int CELL_NEIGHBOUR_OFFSETS[13][3] = {
+	{ 1, -1, -1 }, { 1, -1, 0 }, { 1, -1, 1 },
+	{ 1, 0, -1 }, { 1, 0, 0 }, { 1, 0, 1 },
+	{ 1, 1, -1 }, { 1, 1, 0 }, { 1, 1, 1 },
+	{ 0, 1, -1 }, { 0, 1, 0 }, { 0, 1, 1 },
+	{ 0, 0, 1 }
+};
+
+// Finds the time when the center of the sphere will pass into another cell.
+// Cell boundaries that are also the sector's boundaries are skipped as those
+// are covered by sector transfers and grid collisions.
+static double find_collision_time_cell(const struct sector_s *sector, const struct sphere_s *sphere, const union vector_3i cell_pos) {
+	double time = DBL_MAX;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		if ((sphere->vel.vals[a] > 0.0 && cell_pos.vals[a] < sector->cell_dims.vals[a] - 1) || (sphere->vel.vals[a] < 0.0 && cell_pos.vals[a] > 0)) {
+			double cell_start = sector->start.vals[a] + (cell_pos.vals[a] * sector->cell_size.vals[a]);
+			double temp_time = find_time_to_cross_boundary(cell_start, cell_start + sector->cell_size.vals[a], sphere->vel.vals[a], sphere->pos.vals[a], 0.0);
+			if (temp_time < time) {
+				time = temp_time;
+			}
+		}
+	}
+	return time;
+}
+
+// Returns false if no sphere in the cell can reach "s" within "time", going by
+// the sector's largest radius and speed.
+// Spheres can be up to CELL_BOUNDARY_EPS of the cell's width outside of it, so
+// the cell is widened by twice that.
+static bool can_cell_reach_sphere(const struct sector_s *sector, const union vector_3i cell_pos, const struct sphere_s *s, const double speed, const double time) {
+	union vector_3d min, max;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		double margin = 2.0 * CELL_BOUNDARY_EPS * sector->cell_size.vals[a];
+		min.vals[a] = sector->start.vals[a] + (cell_pos.vals[a] * sector->cell_size.vals[a]) - margin;
+		max.vals[a] = min.vals[a] + sector->cell_size.vals[a] + (2.0 * margin);
+	}
+	double dist_squared = get_distance_squared_to_box(&s->pos, &min, &max);
+	return can_collide_within(dist_squared, get_sphere_radius(s) + sector->largest_radius, speed + sector->max_speed, time);
+}
+
+// Resting spheres are left out if "moving_only" is set.
+static void add_cell_to_block(struct sector_s *sector, const struct cell_s *cell, const int64_t start, const bool moving_only) {
+	int64_t j;
+	for (j = start; j < cell->num_spheres; j++) {
+		struct sphere_s *s = &sector->spheres[cell->sphere_ids[j]];
+		if (!moving_only || !is_sphere_resting(s)) {
+			add_sphere_to_block(&block_b, s);
+		}
+	}
+}
+
+// Checks a sphere against the spheres after it in its own cell, the spheres in
+// half of the adjacent cells, and finds when it will leave its cell.
+// The spheres to check against are copied into a block and checked in one go,
+// leaving out resting spheres if this one is resting too.
+// Only a collision sooner than the soonest event found so far is kept, so
+// adjacent cells too far away for any of their spheres to reach the sphere
+// before then are not copied or checked.
+static void find_collision_times_for_sphere_in_cell(struct sector_s *sector, const struct cell_s *cell, const int64_t i, const union vector_3i cell_pos) {
+	struct sphere_s *s1 = &sector->spheres[cell->sphere_ids[i]];
+	double cutoff = get_soonest_event_time();
+	double speed = get_vector_3d_magnitude(&s1->vel);
+	bool moving_only = is_sphere_resting(s1);
+	clear_sphere_block(&block_b);
+	add_cell_to_block(sector, cell, i + 1, moving_only);
+	int n;
+	for (n = 0; n < 13; n++) {
+		union vector_3i pos;
+		pos.x = cell_pos.x + CELL_NEIGHBOUR_OFFSETS[n][X_AXIS];
+		pos.y = cell_pos.y + CELL_NEIGHBOUR_OFFSETS[n][Y_AXIS];
+		pos.z = cell_pos.z + CELL_NEIGHBOUR_OFFSETS[n][Z_AXIS];
+		if (pos.x < 0 || pos.y < 0 || pos.z < 0 || pos.x >= sector->cell_dims.x || pos.y >= sector->cell_dims.y || pos.z >= sector->cell_dims.z) {
+			continue;
+		}
+		const struct cell_s *c = &sector->cells[get_cell_index(sector, pos.x, pos.y, pos.z)];
+		if (!can_cell_reach_sphere(sector, pos, s1, speed, cutoff)) {
+			stats.num_pair_tests_skipped += c->num_spheres;
+			continue;
+		}
+		add_cell_to_block(sector, c, 0, moving_only);
+	}
+	double time;
+	int64_t j = find_soonest_collision_in_block(s1, &block_b, 0, &time);
+	if (j != -1) {
+		set_event_details(time, COL_TWO_SPHERES, s1, block_b.spheres[j], AXIS_NONE, sector, NULL);
+	}
+	time = find_collision_time_cell(sector, s1, cell_pos);
+	set_event_details(time, COL_SPHERE_WITH_CELL, s1, NULL, AXIS_NONE, sector, NULL);
+}
+
+// Finds when the spheres in a given sector will collide with each other.
+// The sector is split into cells at least twice as wide as the largest sphere,
+// so spheres in cells that are not adjacent cannot collide until one of them
+// moves into another cell. Only spheres in the same or adjacent cells are
+// checked against each other, and the soonest time a sphere moves into
+// another cell is included as an event so the cells get rebuilt before then.
+// Work is split between helping processes by the sector id of the first
+// sphere in each pair.
 // If each sector is finding its own times start_offset will be 0 and inc will be 1.
 // If neighbours are helping a sector then start_offset will be >= 0 depending on
 // the neighbour's id and inc will be num_neighbours + 1
 // If all processes are helping one sector then start_offset will be the process'
 // rank in the grid and inc will be NUM_NODES.
 static void find_collision_times_between_spheres_in_sector(struct sector_s *sector, int64_t start_offset, int64_t inc) {
-	int64_t i, j;
-	for (i = 0; i < sector->num_spheres - 1; i++) {
-		struct sphere_s *s1 = &sector->spheres[i];
-		for (j = i + 1 + start_offset; j < sector->num_spheres; j = j + inc) {
-			struct sphere_s *s2 = &sector->spheres[j];
-			double time = find_collision_time_spheres(s1, s2);
-			set_event_details(time, COL_TWO_SPHERES, s1, s2, AXIS_NONE, sector, NULL);
+	build_cells_for_sector(sector);
+	union vector_3i cell_pos;
+	for (cell_pos.x = 0; cell_pos.x < sector->cell_dims.x; cell_pos.x++) {
+		for (cell_pos.y = 0; cell_pos.y < sector->cell_dims.y; cell_pos.y++) {
+			for (cell_pos.z = 0; cell_pos.z < sector->cell_dims.z; cell_pos.z++) {
+				const struct cell_s *cell = &sector->cells[get_cell_index(sector, cell_pos.x, cell_pos.y, cell_pos.z)];
+				int64_t i;
+				for (i = 0; i < cell->num_spheres; i++) {
+					if (cell->sphere_ids[i] % inc == start_offset) {
+						find_collision_times_for_sphere_in_cell(sector, cell, i, cell_pos);
+					}
+				}
+			}
 		}
 	}
 }
 
-// Finds time to both collide with grid and to cross sector boundaries.
-// If each sector is finding its own times start_offset will be 0 and inc will be 1.
-// If neighbours are helping a sector then start_offset will be >= 0 depending on
-// the neighbour's id and inc will be num_neighbours + 1
-// If all processes are helping one sector then start_offset will be the process'
-// rank in the grid and inc will be NUM_NODES.
-static void find_collision_times_grid_boundary_for_sector(struct sector_s *sector, int64_t start_offset, int64_t inc) {
-	enum axis axis = COL_NONE;
+// Soonest grid collision or sector crossing of each sphere in the local
+// sector, indexed by sector id.
+// A sphere's path only changes when its velocity does, so these are found
+// once when the sphere arrives or bounces and are kept with the absolute time
+// they happen at, rather than being found again for every sphere each time
+// the sector's events are invalidated.
+// A heap of sector ids ordered by time keeps the soonest of them on top.
+struct boundary_event_s {
+	double time; // DBL_MAX if the sphere is resting
+	enum collision_type type; // COL_SPHERE_WITH_GRID or COL_SPHERE_WITH_SECTOR
+	enum axis grid_axis;
+	struct sector_s *dest_sector;
+	int64_t heap_index;
+};
+
+static struct boundary_event_s *boundary_events;
+static int64_t *boundary_heap;
+static int64_t num_boundary_events;
+static int64_t max_boundary_events;
+
+// Ties go to the lower sector id, which is the order the spheres used to be
+// checked in.
+static bool is_boundary_event_sooner(const int64_t a, const int64_t b) {
+	if (boundary_events[a].time != boundary_events[b].time) {
+		return boundary_events[a].time < boundary_events[b].time;
+	}
+	return a < b;
+}
+
+static void set_boundary_heap_entry(const int64_t heap_index, const int64_t id) {
+	boundary_heap[heap_index] = id;
+	boundary_events[id].heap_index = heap_index;
+}
+
+static void sift_boundary_event(int64_t heap_index) {
+	const int64_t id = boundary_heap[heap_index];
+	while (heap_index > 0) {
+		int64_t parent = (heap_index - 1) / 2;
+		if (!is_boundary_event_sooner(id, boundary_heap[parent])) {
+			break;
+		}
+		set_boundary_heap_entry(heap_index, boundary_heap[parent]);
+		heap_index = parent;
+	}
+	while (true) {
+		int64_t child = 2 * heap_index + 1;
+		if (child >= num_boundary_events) {
+			break;
+		}
+		if (child + 1 < num_boundary_events && is_boundary_event_sooner(boundary_heap[child + 1], boundary_heap[child])) {
+			child++;
+		}
+		if (!is_boundary_event_sooner(boundary_heap[child], id)) {
+			break;
+		}
+		set_boundary_heap_entry(heap_index, boundary_heap[child]);
+		heap_index = child;
+	}
+	set_boundary_heap_entry(heap_index, id);
+}
+
+// The sphere's position is for sphere->time, so the times found from it are
+// added to that rather than to the simulation time.
+// The grid collision is kept if both happen at the same time.
+static void find_boundary_event(const int64_t id) {
+	const struct sphere_s *sphere = &SECTOR->spheres[id];
+	struct boundary_event_s *e = &boundary_events[id];
+	enum axis axis = AXIS_NONE;
+	struct sector_s *dest = NULL;
+	double grid_time = find_collision_time_grid(sphere, &axis);
+	double sector_time = find_collision_time_sector(SECTOR, sphere, &dest);
+	if (grid_time == DBL_MAX && sector_time == DBL_MAX) {
+		e->time = DBL_MAX;
+		e->type = COL_NONE;
+	} else if (sector_time < grid_time) {
+		e->time = sphere->time + sector_time;
+		e->type = COL_SPHERE_WITH_SECTOR;
+	} else {
+		e->time = sphere->time + grid_time;
+		e->type = COL_SPHERE_WITH_GRID;
+	}
+	e->grid_axis = axis;
+	e->dest_sector = dest;
+}
+
+// Finds the event for a sphere that has just been added to the end of the
+// local sector's sphere array.
+void add_boundary_event(const int64_t id) {
+	if (id != num_boundary_events) {
+		printf("Error: boundary events are out of step with the local sector's spheres\n");
+		exit(1);
+	}
+	if (num_boundary_events >= max_boundary_events) {
+		max_boundary_events = max_boundary_events == 0 ? SECTOR_DEFAULT_MAX_SPHERES : max_boundary_events * 2;
+		boundary_events = realloc(boundary_events, max_boundary_events * sizeof(struct boundary_event_s));
+		boundary_heap = realloc(boundary_heap, max_boundary_events * sizeof(int64_t));
+	}
+	num_boundary_events++;
+	find_boundary_event(id);
+	set_boundary_heap_entry(num_boundary_events - 1, id);
+	sift_boundary_event(num_boundary_events - 1);
+}
+
+// Finds the event again for a sphere in the local sector whose velocity has changed.
+void update_boundary_event(const int64_t id) {
+	find_boundary_event(id);
+	sift_boundary_event(boundary_events[id].heap_index);
+}
+
+// Mirrors remove_sphere_from_sector(), so must be called along with it:
+// the last sphere's event is moved into the removed sphere's place.
+void remove_boundary_event(const int64_t id) {
+	num_boundary_events--;
+	const int64_t heap_index = boundary_events[id].heap_index;
+	if (heap_index != num_boundary_events) {
+		set_boundary_heap_entry(heap_index, boundary_heap[num_boundary_events]);
+		sift_boundary_event(heap_index);
+	}
+	if (id != num_boundary_events) {
+		boundary_events[id] = boundary_events[num_boundary_events];
+		boundary_heap[boundary_events[id].heap_index] = id;
+	}
+}
+
+void init_boundary_events() {
+	num_boundary_events = 0;
 	int64_t i;
-	for (i = start_offset; i < sector->num_spheres; i = i + inc) {
-		struct sphere_s *sphere = &sector->spheres[i];
-		double time = find_collision_time_grid(sphere, &axis);
-		set_event_details(time, COL_SPHERE_WITH_GRID, sphere, NULL, axis, sector, NULL);
-		struct sector_s *temp_dest = NULL;
-		time = find_collision_time_sector(sector, sphere, &temp_dest);
-		set_event_details(time, COL_SPHERE_WITH_SECTOR, sphere, NULL, AXIS_NONE, sector, temp_dest);
+	for (i = 0; i < SECTOR->num_spheres; i++) {
+		add_boundary_event(i);
+	}
+}
+
+// Only the process responsible for a sector holds its boundary events, so
+// helping processes leave these out.
+static void find_collision_times_grid_boundary_for_sector() {
+	if (num_boundary_events == 0) {
+		return;
+	}
+	const int64_t id = boundary_heap[0];
+	const struct boundary_event_s *e = &boundary_events[id];
+	if (e->type == COL_NONE) {
+		return;
+	}
+	if (e->type == COL_SPHERE_WITH_GRID) {
+		set_event_details(e->time - sim_data.elapsed_time, COL_SPHERE_WITH_GRID, &SECTOR->spheres[id], NULL, e->grid_axis, SECTOR, NULL);
+	} else {
+		set_event_details(e->time - sim_data.elapsed_time, COL_SPHERE_WITH_SECTOR, &SECTOR->spheres[id], NULL, AXIS_NONE, SECTOR, e->dest_sector);
 	}
 }
 
@@ -341,8 +666,11 @@ static void find_event_times_all_help(struct sector_s *sector_to_help){
 	} else {
 		reset_event_details();
 	}
+	update_replicated_spheres(sector_to_help);
 	find_collision_times_between_spheres_in_sector(sector_to_help, GRID_RANK, NUM_NODES);
-	find_collision_times_grid_boundary_for_sector(sector_to_help, GRID_RANK, NUM_NODES);
+	if(SECTOR->id == sector_to_help->id){
+		find_collision_times_grid_boundary_for_sector();
+	}
 	reduce_help_events(sector_to_help);
 	helping = false;
 }
@@ -361,8 +689,11 @@ static void find_event_times_neighbours_help(struct sector_s *sector_to_help){
 		} else {
 			start = sector_to_help->my_id_index + 1;
 		}
+		update_replicated_spheres(sector_to_help);
 		find_collision_times_between_spheres_in_sector(sector_to_help, start, sector_to_help->num_neighbours + 1);
-		find_collision_times_grid_boundary_for_sector(sector_to_help, start, sector_to_help->num_neighbours + 1);
+		if(SECTOR->id == sector_to_help->id){
+			find_collision_times_grid_boundary_for_sector();
+		}
 	}
 	reduce_help_events(sector_to_help);
 	helping = false;
@@ -372,7 +703,7 @@ static void find_event_times_normal(struct sector_s *sector){
 	if(PRIOR_TIME_VALID == false){
 		reset_event_details();
 		find_collision_times_between_spheres_in_sector(sector, 0, 1);
-		find_collision_times_grid_boundary_for_sector(sector, 0, 1);
+		find_collision_times_grid_boundary_for_sector();
 	}
 }
 
@@ -398,5 +729,18 @@ void find_event_times() {
 		find_event_times_normal(SECTOR);
 	}
 	find_partial_crossing_events_for_sector(SECTOR);
+	find_partial_crossing_checks();
+
+}
 
+void free_collision_blocks() {
+	free_sphere_block(&block_a);
+	free_sphere_block(&block_b);
+	free(soonest_indices);
+	free(soonest_times);
+	free(checks);
+	free(check_order);
+	free(checks_per_sector);
+	free(boundary_events);
+	free(boundary_heap);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "sector.h"
 #include "sphere.h"
@@ -10,7 +11,13 @@ enum collision_type {
 	COL_SPHERE_WITH_GRID = 1,
 	COL_SPHERE_WITH_SECTOR = 2,
 	COL_TWO_SPHERES_PARTIAL_CROSSING = 3,
+	COL_SPHERE_WITH_CELL = 4, // Sphere moves into another cell in its sector, nothing about it changes
 	COL_NONE = -1
 };
 
+void init_boundary_events();
+void add_boundary_event(const int64_t id);
+void update_boundary_event(const int64_t id);
+void remove_boundary_event(const int64_t id);
 void find_event_times();
+void free_collision_blocks();
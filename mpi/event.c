@@ -13,8 +13,10 @@ struct transmit_event_s *help_event_buffer; // if node is helped this stores tim
 struct transmit_event_s help_event_to_send;
 struct transmit_event_s *event_buffer; // receive buffer 
 
+// Events are held locally with the absolute simulation time they happen at, but
+// are sent with the time until they happen.
 static void prepare_event_to_send(){
-	event_to_send.time = event_details.time;
+	event_to_send.time = event_details.time - sim_data.elapsed_time;
 	event_to_send.type = event_details.type;
 	if(event_details.sphere_1 != NULL){
 		event_to_send.sphere_1 = *event_details.sphere_1;
@@ -40,7 +42,7 @@ static void prepare_event_to_send(){
 }
 
 static void prepare_help_event_to_send(){
-	help_event_to_send.time = helping_event_details.time;
+	help_event_to_send.time = helping_event_details.time - sim_data.elapsed_time;
 	help_event_to_send.type = helping_event_details.type;
 	if(helping_event_details.sphere_1 != NULL){
 		help_event_to_send.sphere_1 = *helping_event_details.sphere_1;
@@ -79,11 +81,11 @@ static void copy_received_help_to_event_details(){
 	printf("Soonest is as follows:\n");
 	printf("Time: %.17g\n", e->time);
 	printf("Type: %d\n", e->type);
-	printf("Sphere one id: %ld and sector id: %ld\n", e->sphere_1.id, e->sphere_1.sector_id);
-	printf("Sphere two id: %ld and sector id: %ld\n", e->sphere_2.id, e->sphere_2.sector_id);
+	printf("Sphere one id: %d and sector id: %d\n", e->sphere_1.id, e->sphere_1.sector_id);
+	printf("Sphere two id: %d and sector id: %d\n", e->sphere_2.id, e->sphere_2.sector_id);
 	printf("Source sector id: %d\n", e->source_sector_id);
 	printf("Dest sector id: %d\n", e->dest_sector_id);*/
-	event_details.time = e->time;
+	event_details.time = sim_data.elapsed_time + e->time;
 	event_details.type = e->type;
 	event_details.grid_axis = e->grid_axis;
 	event_details.sphere_1 = &SECTOR->spheres[e->sphere_1.sector_id];
@@ -173,14 +175,25 @@ void reset_event_details(){
 	event_details.grid_axis = AXIS_NONE;
 }
 
+// Returns the time until the soonest event found so far, either for the local
+// sector or for the sector being helped.
+double get_soonest_event_time(){
+	double sim_time = helping ? helping_event_details.time : event_details.time;
+	return sim_time - sim_data.elapsed_time;
+}
+
+// "time" is the time until the event happens, but it is stored as the absolute
+// simulation time the event happens at. That way an event that is still valid
+// on the next iteration does not need to be changed.
 void set_event_details(
 	const double time, const enum collision_type type, struct sphere_s *sphere_1, 
 	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
 	struct sector_s *dest_sector
 ){
+	double sim_time = sim_data.elapsed_time + time;
 	if(helping){
-		if(time < helping_event_details.time){
-			helping_event_details.time = time;
+		if(sim_time < helping_event_details.time){
+			helping_event_details.time = sim_time;
 			helping_event_details.type = type;
 			helping_event_details.sphere_1 = sphere_1;
 			helping_event_details.sphere_2 = sphere_2;
@@ -189,8 +202,8 @@ void set_event_details(
 			helping_event_details.dest_sector = dest_sector;
 		}
 	} else {
-		if(time < event_details.time){
-			event_details.time = time;
+		if(sim_time < event_details.time){
+			event_details.time = sim_time;
 			event_details.type = type;
 			event_details.sphere_1 = sphere_1;
 			event_details.sphere_2 = sphere_2;
@@ -201,15 +214,23 @@ void set_event_details(
 	}
 }
 
+// Copies of spheres from other sectors are only moved when they are needed, so
+// they are brought up to the time of the event before it is applied.
+static void update_sphere_to_event_time(struct sphere_s *s){
+	update_sphere_position_to_time(s, sim_data.elapsed_time + next_event->time);
+}
+
 // Sphere bounces off grid boundary.
 static void apply_sphere_with_grid_event(){
 	struct sector_s *source = &sim_data.sectors_flat[next_event->source_sector_id];
 	struct sphere_s *sphere = NULL;
 	if(ALL_HELP && !source->is_local_neighbour){
 		sphere = &source->spheres[next_event->sphere_1.sector_id];
+		update_sphere_to_event_time(sphere);
 		sphere->vel.vals[next_event->grid_axis] *= -1.0;
 	} else if((source->is_neighbour && !source->is_local_neighbour) || source->id == SECTOR->id){
 		sphere = &source->spheres[next_event->sphere_1.sector_id];
+		update_sphere_to_event_time(sphere);
 		sphere->vel.vals[next_event->grid_axis] *= -1.0;
 	}
 	if(source->id != SECTOR->id){
@@ -218,6 +239,18 @@ static void apply_sphere_with_grid_event(){
 		write_iteration_data(sphere, NULL);
 	}
 	if(source->id == SECTOR->id){
+		update_boundary_event(next_event->sphere_1.sector_id);
+		PRIOR_TIME_VALID = false;
+	}
+}
+
+// Sphere moves into another cell within its sector.
+// Nothing about the sphere changes, but the sector's events are found again so
+// that its cells are rebuilt.
+// As no sphere changes nothing is written to the output file, and no node
+// moves its place in the file.
+static void apply_sphere_with_cell_event(){
+	if(next_event->source_sector_id == SECTOR->id){
 		PRIOR_TIME_VALID = false;
 	}
 }
@@ -231,10 +264,14 @@ static void apply_sphere_on_sphere_event(){
 	if(ALL_HELP && !source->is_local_neighbour){
 		s1 = &source->spheres[next_event->sphere_1.sector_id];
 		s2 = &source->spheres[next_event->sphere_2.sector_id];
+		update_sphere_to_event_time(s1);
+		update_sphere_to_event_time(s2);
 		apply_bounce_between_spheres(s1, s2);
 	} else if((source->is_neighbour && !source->is_local_neighbour) || SECTOR->id == next_event->source_sector_id){
 		s1 = &source->spheres[next_event->sphere_1.sector_id];
 		s2 = &source->spheres[next_event->sphere_2.sector_id];
+		update_sphere_to_event_time(s1);
+		update_sphere_to_event_time(s2);
 		apply_bounce_between_spheres(s1, s2);
 	}
 	if(source->id != SECTOR->id){
@@ -243,6 +280,8 @@ static void apply_sphere_on_sphere_event(){
 		write_iteration_data(s1, s2);
 	}
 	if(source->id == SECTOR->id){
+		update_boundary_event(next_event->sphere_1.sector_id);
+		update_boundary_event(next_event->sphere_2.sector_id);
 		PRIOR_TIME_VALID = false;
 	}
 }
@@ -259,6 +298,9 @@ static void apply_sphere_transfer_event(){
 		source->num_spheres--;
 		set_largest_radius_after_removal(source, sphere);
 	} else if(ALL_HELP || source->is_neighbour || SECTOR->id == next_event->source_sector_id){
+		if(SECTOR->id == next_event->source_sector_id){
+			remove_boundary_event(sphere->sector_id);
+		}
 		remove_sphere_from_sector(source, sphere);
 	}
 	if(dest->is_local_neighbour){
@@ -269,6 +311,9 @@ static void apply_sphere_transfer_event(){
 		}
 	} else if(ALL_HELP || dest->is_neighbour || SECTOR->id == next_event->dest_sector_id){
 		add_sphere_to_sector(dest, sphere);
+		if(SECTOR->id == next_event->dest_sector_id){
+			add_boundary_event(dest->num_spheres - 1);
+		}
 	}
 	if(dest->id != SECTOR->id){
 		seek_one_sphere();
@@ -306,38 +351,24 @@ static void apply_partial_crossing_event(){
 	if(use_s2_copy){
 		s2 = &dest->spheres[next_event->sphere_2.sector_id]; // local copy
 	}
+	update_sphere_to_event_time(s1);
+	update_sphere_to_event_time(s2);
 	apply_bounce_between_spheres(s1, s2);
 	if(source->id != SECTOR->id){
 		seek_two_spheres();
 	} else {
 		write_iteration_data(s1, s2);
 	}
+	if(source->id == SECTOR->id){
+		update_boundary_event(next_event->sphere_1.sector_id);
+	} else if(dest->id == SECTOR->id){
+		update_boundary_event(next_event->sphere_2.sector_id);
+	}
 	if(source->id == SECTOR->id || dest->id == SECTOR->id){
 		PRIOR_TIME_VALID = false;
 	}
 }
 
-static double increment_double_by_smallest_amount(double val){
-	void *p = &val;
-	int64_t *i = (int64_t *)p;
-	(*i)++;
-	return val;
-}
-
-static const double eps = 0.0001;
-
-static void set_new_time(){
-	if(event_details.time != 0.0 && next_event->time != 0.0){
-		double t = event_details.time - next_event->time;
-		if(t < eps){
-			event_details.time = increment_double_by_smallest_amount(t);
-		} else {
-			event_details.time = t;
-		}
-	}
-}
-
-
 // Apply events and write changes to file.
 // In each case the source sector is responsible for writing data.
 // Each other sector must update their file pointer however.
@@ -365,9 +396,11 @@ void apply_event(){
 		invalid_2 = &sim_data.sectors_flat[next_event->dest_sector_id];
 		num_invalid = 2;
 		stats.num_partial_crossings++;
-	}
-	if(PRIOR_TIME_VALID){
-		set_new_time(); // still valid from the prior iteration so subtract new time
+	} else if(next_event->type == COL_SPHERE_WITH_CELL){
+		apply_sphere_with_cell_event();
+		invalid_1 = &sim_data.sectors_flat[next_event->source_sector_id];
+		num_invalid = 1;
+		stats.num_cell_crossings++;
 	}
 }
 
@@ -9,7 +9,7 @@
 // Pointers to spheres and sectors are used so that the correct object in 
 // memory can be modified.
 struct event_s {
-	double time; // When the event happens
+	double time; // Absolute simulation time the event happens at
 	enum collision_type type; // What the next event is.
 	struct sphere_s *sphere_1; // Sphere that hits the grid, transfers to another sector, or is the first sphere in a sphere on sphere collision.
 	struct sphere_s *sphere_2; // Second sphere in a sphere on sphere collision, otherwise NULL
@@ -25,7 +25,7 @@ struct event_s {
 // This is because pointers will no longer be valid once sent to another node.
 // The local event_details struct will have its data copied here for sending.
 struct transmit_event_s {
-	double time;
+	double time; // Time until the event happens
 	enum collision_type type;
 	struct sphere_s sphere_1;
 	struct sphere_s sphere_2;
@@ -48,6 +48,7 @@ void reduce_help_events(struct sector_s *sector_to_help);
 void init_events();
 void reset_event_details();
 void reset_event_details_helping();
+double get_soonest_event_time();
 void set_event_details(
 	const double time, const enum collision_type type, struct sphere_s *sphere_1, 
 	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
@@ -40,10 +40,13 @@ void write_sphere_initial_state(const struct sphere_s *sphere){
 	int64_t sphere_offset = base_offset + radius_mass_block_size + iteration_header_size + (sphere_file_size * sphere->id);
 	MPI_File_seek(MPI_OUTPUT_FILE, radius_mass_offset, MPI_SEEK_SET);
 	MPI_Status s;
-	MPI_File_write(MPI_OUTPUT_FILE, &sphere->radius, 1, MPI_DOUBLE, &s);
-	MPI_File_write(MPI_OUTPUT_FILE, &sphere->mass, 1, MPI_DOUBLE, &s);
+	double radius = get_sphere_radius(sphere);
+	double mass = get_sphere_mass(sphere);
+	int64_t id = sphere->id;
+	MPI_File_write(MPI_OUTPUT_FILE, &radius, 1, MPI_DOUBLE, &s);
+	MPI_File_write(MPI_OUTPUT_FILE, &mass, 1, MPI_DOUBLE, &s);
 	MPI_File_seek(MPI_OUTPUT_FILE, sphere_offset, MPI_SEEK_SET);
-	MPI_File_write(MPI_OUTPUT_FILE, &sphere->id, 1, MPI_LONG_LONG, &s);
+	MPI_File_write(MPI_OUTPUT_FILE, &id, 1, MPI_LONG_LONG, &s);
 	MPI_File_write(MPI_OUTPUT_FILE, &sphere->vel, 3, MPI_DOUBLE, &s);
 	MPI_File_write(MPI_OUTPUT_FILE, &sphere->pos, 3, MPI_DOUBLE, &s);
 }
@@ -93,12 +96,14 @@ void write_iteration_data(struct sphere_s *s1, struct sphere_s *s2){
 		n = 1;
 	}
 	MPI_File_write(MPI_OUTPUT_FILE, &n, 1, MPI_LONG_LONG, &s);
-	MPI_File_write(MPI_OUTPUT_FILE, &s1->id, 1, MPI_LONG_LONG, &s);
+	int64_t id = s1->id;
+	MPI_File_write(MPI_OUTPUT_FILE, &id, 1, MPI_LONG_LONG, &s);
 	MPI_File_write(MPI_OUTPUT_FILE, &s1->vel, 3, MPI_DOUBLE, &s);
 	MPI_File_write(MPI_OUTPUT_FILE, &s1->pos, 3, MPI_DOUBLE, &s);
 	cur_file_offset += iteration_header_size + sphere_file_size;
 	if(s2 != NULL){
-		MPI_File_write(MPI_OUTPUT_FILE, &s2->id, 1, MPI_LONG_LONG, &s);
+		id = s2->id;
+		MPI_File_write(MPI_OUTPUT_FILE, &id, 1, MPI_LONG_LONG, &s);
 		MPI_File_write(MPI_OUTPUT_FILE, &s2->vel, 3, MPI_DOUBLE, &s);
 		MPI_File_write(MPI_OUTPUT_FILE, &s2->pos, 3, MPI_DOUBLE, &s);
 		cur_file_offset += sphere_file_size;
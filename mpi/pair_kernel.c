@@ -0,0 +1,455 @@
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "pair_kernel.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PAIR_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// Finds when one sphere will collide with each sphere in a block, and returns
+// the soonest of them.
+// Rather than finding the angle between the relative position and velocity,
+// |rel_pos - rel_vel * t| = r1 + r2 is solved directly. With
+//	pv = rel_pos . rel_vel
+//	vv = rel_vel . rel_vel
+//	c = (rel_pos . rel_pos) - (r1 + r2)^2
+// the spheres collide at t = c / (pv + sqrt(pv^2 - vv * c)), which is the
+// smaller root of the quadratic written so that it does not lose precision
+// when c is small. The spheres will not collide if pv <= 0.0 (they are not
+// moving towards each other) or if pv^2 - vv * c < 0.0 (they miss).
+// Spheres which already overlap give a negative time which is clamped to 0.0,
+// the same as the original trigonometry based solver.
+// Each lane of the vector versions keeps its own soonest time and index, and
+// the lanes are combined at the end, so no branches are needed per pair.
+// The vector versions do the same operations in the same order as the scalar
+// version without fused multiply-adds, so every version gives the same result.
+// When every sphere has the same radius, the uniform versions use the radius
+// of the sphere being checked for both spheres in each pair rather than
+// reading the block's radii. Each version is written once with a constant
+// "uniform" argument and inlined into both, so the check folds away.
+
+typedef int64_t (*pair_kernel_func)(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time);
+
+static inline __attribute__((always_inline)) double find_collision_time_in_block(const struct sphere_s *s, const double s_radius, const struct sphere_block_s *block, const int64_t j, const bool uniform) {
+	double px = block->pos_x[j] - s->pos.x;
+	double py = block->pos_y[j] - s->pos.y;
+	double pz = block->pos_z[j] - s->pos.z;
+	double vx = s->vel.x - block->vel_x[j];
+	double vy = s->vel.y - block->vel_y[j];
+	double vz = s->vel.z - block->vel_z[j];
+	double r = s_radius + (uniform ? s_radius : block->radius[j]);
+	double pv = (px * vx) + (py * vy) + (pz * vz);
+	double vv = (vx * vx) + (vy * vy) + (vz * vz);
+	double c = ((px * px) + (py * py) + (pz * pz)) - (r * r);
+	double disc = (pv * pv) - (vv * c);
+	if (pv <= 0.0 || disc < 0.0) {
+		return DBL_MAX;
+	}
+	double t = c / (pv + sqrt(disc));
+	return t > 0.0 ? t : 0.0;
+}
+
+// Checks spheres from index "start" up to "end", continuing from a soonest time
+// and index already found for the spheres before "start".
+static inline __attribute__((always_inline)) int64_t find_soonest_collision_in_block_from(
+	const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start,
+	const int64_t end, int64_t soonest_index, double *time, const bool uniform
+){
+	const double s_radius = get_sphere_radius(s);
+	int64_t j;
+	for (j = start; j < end; j++) {
+		double t = find_collision_time_in_block(s, s_radius, block, j, uniform);
+		if (t < *time) {
+			*time = t;
+			soonest_index = j;
+		}
+	}
+	return soonest_index;
+}
+
+static int64_t find_soonest_collision_in_block_scalar(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	*time = DBL_MAX;
+	return find_soonest_collision_in_block_from(s, block, start, end, -1, time, false);
+}
+
+static int64_t find_soonest_collision_in_block_scalar_uniform(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	*time = DBL_MAX;
+	return find_soonest_collision_in_block_from(s, block, start, end, -1, time, true);
+}
+
+#ifdef PAIR_KERNEL_X86
+
+// Combines the soonest time and index held by each lane.
+// Where lanes have the same time the lowest index is used, which is the pair
+// that would have been found first by the scalar version.
+static int64_t get_soonest_lane(const double *times, const int64_t *indices, const int num_lanes, double *time) {
+	int64_t soonest_index = -1;
+	*time = DBL_MAX;
+	int i;
+	for (i = 0; i < num_lanes; i++) {
+		if (times[i] < *time || (times[i] == *time && indices[i] != -1 && indices[i] < soonest_index)) {
+			*time = times[i];
+			soonest_index = indices[i];
+		}
+	}
+	return soonest_index;
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off"), always_inline))
+static inline int64_t find_soonest_collision_in_block_avx2_from(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time, const bool uniform) {
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d none = _mm256_set1_pd(DBL_MAX);
+	const __m256d s_pos_x = _mm256_set1_pd(s->pos.x);
+	const __m256d s_pos_y = _mm256_set1_pd(s->pos.y);
+	const __m256d s_pos_z = _mm256_set1_pd(s->pos.z);
+	const __m256d s_vel_x = _mm256_set1_pd(s->vel.x);
+	const __m256d s_vel_y = _mm256_set1_pd(s->vel.y);
+	const __m256d s_vel_z = _mm256_set1_pd(s->vel.z);
+	const __m256d s_radius = _mm256_set1_pd(get_sphere_radius(s));
+	const __m256d uniform_r = _mm256_add_pd(s_radius, s_radius);
+	const __m256i step = _mm256_set1_epi64x(4);
+	__m256i index = _mm256_add_epi64(_mm256_set_epi64x(3, 2, 1, 0), _mm256_set1_epi64x(start));
+	__m256d soonest_time = none;
+	__m256i soonest_index = _mm256_set1_epi64x(-1);
+	int64_t j;
+	for (j = start; j + 4 <= end; j += 4) {
+		__m256d px = _mm256_sub_pd(_mm256_loadu_pd(&block->pos_x[j]), s_pos_x);
+		__m256d py = _mm256_sub_pd(_mm256_loadu_pd(&block->pos_y[j]), s_pos_y);
+		__m256d pz = _mm256_sub_pd(_mm256_loadu_pd(&block->pos_z[j]), s_pos_z);
+		__m256d vx = _mm256_sub_pd(s_vel_x, _mm256_loadu_pd(&block->vel_x[j]));
+		__m256d vy = _mm256_sub_pd(s_vel_y, _mm256_loadu_pd(&block->vel_y[j]));
+		__m256d vz = _mm256_sub_pd(s_vel_z, _mm256_loadu_pd(&block->vel_z[j]));
+		__m256d r = uniform ? uniform_r : _mm256_add_pd(s_radius, _mm256_loadu_pd(&block->radius[j]));
+		__m256d pv = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, vx), _mm256_mul_pd(py, vy)), _mm256_mul_pd(pz, vz));
+		__m256d vv = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(vx, vx), _mm256_mul_pd(vy, vy)), _mm256_mul_pd(vz, vz));
+		__m256d pp = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(px, px), _mm256_mul_pd(py, py)), _mm256_mul_pd(pz, pz));
+		__m256d c = _mm256_sub_pd(pp, _mm256_mul_pd(r, r));
+		__m256d disc = _mm256_sub_pd(_mm256_mul_pd(pv, pv), _mm256_mul_pd(vv, c));
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(pv, zero, _CMP_GT_OQ), _mm256_cmp_pd(disc, zero, _CMP_GE_OQ));
+		__m256d t = _mm256_div_pd(c, _mm256_add_pd(pv, _mm256_sqrt_pd(disc)));
+		t = _mm256_blendv_pd(none, _mm256_max_pd(t, zero), hit);
+		__m256d sooner = _mm256_cmp_pd(t, soonest_time, _CMP_LT_OQ);
+		soonest_time = _mm256_blendv_pd(soonest_time, t, sooner);
+		soonest_index = _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(soonest_index), _mm256_castsi256_pd(index), sooner));
+		index = _mm256_add_epi64(index, step);
+	}
+	double times[4];
+	int64_t indices[4];
+	_mm256_storeu_pd(times, soonest_time);
+	_mm256_storeu_si256((__m256i *)indices, soonest_index);
+	int64_t soonest = get_soonest_lane(times, indices, 4, time);
+	return find_soonest_collision_in_block_from(s, block, j, end, soonest, time, uniform);
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static int64_t find_soonest_collision_in_block_avx2(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	return find_soonest_collision_in_block_avx2_from(s, block, start, end, time, false);
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+static int64_t find_soonest_collision_in_block_avx2_uniform(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	return find_soonest_collision_in_block_avx2_from(s, block, start, end, time, true);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off"), always_inline))
+static inline int64_t find_soonest_collision_in_block_avx512_from(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time, const bool uniform) {
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d none = _mm512_set1_pd(DBL_MAX);
+	const __m512d s_pos_x = _mm512_set1_pd(s->pos.x);
+	const __m512d s_pos_y = _mm512_set1_pd(s->pos.y);
+	const __m512d s_pos_z = _mm512_set1_pd(s->pos.z);
+	const __m512d s_vel_x = _mm512_set1_pd(s->vel.x);
+	const __m512d s_vel_y = _mm512_set1_pd(s->vel.y);
+	const __m512d s_vel_z = _mm512_set1_pd(s->vel.z);
+	const __m512d s_radius = _mm512_set1_pd(get_sphere_radius(s));
+	const __m512d uniform_r = _mm512_add_pd(s_radius, s_radius);
+	const __m512i step = _mm512_set1_epi64(8);
+	__m512i index = _mm512_add_epi64(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0), _mm512_set1_epi64(start));
+	__m512d soonest_time = none;
+	__m512i soonest_index = _mm512_set1_epi64(-1);
+	int64_t j;
+	for (j = start; j + 8 <= end; j += 8) {
+		__m512d px = _mm512_sub_pd(_mm512_loadu_pd(&block->pos_x[j]), s_pos_x);
+		__m512d py = _mm512_sub_pd(_mm512_loadu_pd(&block->pos_y[j]), s_pos_y);
+		__m512d pz = _mm512_sub_pd(_mm512_loadu_pd(&block->pos_z[j]), s_pos_z);
+		__m512d vx = _mm512_sub_pd(s_vel_x, _mm512_loadu_pd(&block->vel_x[j]));
+		__m512d vy = _mm512_sub_pd(s_vel_y, _mm512_loadu_pd(&block->vel_y[j]));
+		__m512d vz = _mm512_sub_pd(s_vel_z, _mm512_loadu_pd(&block->vel_z[j]));
+		__m512d r = uniform ? uniform_r : _mm512_add_pd(s_radius, _mm512_loadu_pd(&block->radius[j]));
+		__m512d pv = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, vx), _mm512_mul_pd(py, vy)), _mm512_mul_pd(pz, vz));
+		__m512d vv = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(vx, vx), _mm512_mul_pd(vy, vy)), _mm512_mul_pd(vz, vz));
+		__m512d pp = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(px, px), _mm512_mul_pd(py, py)), _mm512_mul_pd(pz, pz));
+		__m512d c = _mm512_sub_pd(pp, _mm512_mul_pd(r, r));
+		__m512d disc = _mm512_sub_pd(_mm512_mul_pd(pv, pv), _mm512_mul_pd(vv, c));
+		__mmask8 hit = _mm512_cmp_pd_mask(pv, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(disc, zero, _CMP_GE_OQ);
+		__m512d t = _mm512_div_pd(c, _mm512_add_pd(pv, _mm512_sqrt_pd(disc)));
+		t = _mm512_mask_blend_pd(hit, none, _mm512_max_pd(t, zero));
+		__mmask8 sooner = _mm512_cmp_pd_mask(t, soonest_time, _CMP_LT_OQ);
+		soonest_time = _mm512_mask_blend_pd(sooner, soonest_time, t);
+		soonest_index = _mm512_mask_blend_epi64(sooner, soonest_index, index);
+		index = _mm512_add_epi64(index, step);
+	}
+	double times[8];
+	int64_t indices[8];
+	_mm512_storeu_pd(times, soonest_time);
+	_mm512_storeu_si512(indices, soonest_index);
+	int64_t soonest = get_soonest_lane(times, indices, 8, time);
+	return find_soonest_collision_in_block_from(s, block, j, end, soonest, time, uniform);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static int64_t find_soonest_collision_in_block_avx512(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	return find_soonest_collision_in_block_avx512_from(s, block, start, end, time, false);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+static int64_t find_soonest_collision_in_block_avx512_uniform(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, const int64_t end, double *time) {
+	return find_soonest_collision_in_block_avx512_from(s, block, start, end, time, true);
+}
+
+#endif
+
+static pair_kernel_func pair_kernel = find_soonest_collision_in_block_scalar;
+static const char *pair_kernel_name = "scalar";
+
+// Picks the widest version of the kernel the CPU supports, and the uniform
+// version of it if the spheres loaded so far all have the same radius.
+void init_pair_kernel() {
+	bool uniform = has_uniform_radius();
+#ifdef PAIR_KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		pair_kernel = uniform ? find_soonest_collision_in_block_avx512_uniform : find_soonest_collision_in_block_avx512;
+		pair_kernel_name = uniform ? "avx512 uniform radius" : "avx512";
+		return;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		pair_kernel = uniform ? find_soonest_collision_in_block_avx2_uniform : find_soonest_collision_in_block_avx2;
+		pair_kernel_name = uniform ? "avx2 uniform radius" : "avx2";
+		return;
+	}
+#endif
+	pair_kernel = uniform ? find_soonest_collision_in_block_scalar_uniform : find_soonest_collision_in_block_scalar;
+	pair_kernel_name = uniform ? "scalar uniform radius" : "scalar";
+}
+
+const char *get_pair_kernel_name() {
+	return pair_kernel_name;
+}
+
+void clear_sphere_block(struct sphere_block_s *block) {
+	block->num_spheres = 0;
+}
+
+// Copies the sphere's current position and velocity into the block.
+// Makes room for at least "num" spheres in the block.
+void reserve_sphere_block(struct sphere_block_s *block, const int64_t num) {
+	if (num > block->max_spheres) {
+		block->max_spheres = block->max_spheres == 0 ? 64 : block->max_spheres * 2;
+		if (block->max_spheres < num) {
+			block->max_spheres = num;
+		}
+		block->spheres = realloc(block->spheres, block->max_spheres * sizeof(struct sphere_s *));
+		block->pos_x = realloc(block->pos_x, block->max_spheres * sizeof(double));
+		block->pos_y = realloc(block->pos_y, block->max_spheres * sizeof(double));
+		block->pos_z = realloc(block->pos_z, block->max_spheres * sizeof(double));
+		block->vel_x = realloc(block->vel_x, block->max_spheres * sizeof(double));
+		block->vel_y = realloc(block->vel_y, block->max_spheres * sizeof(double));
+		block->vel_z = realloc(block->vel_z, block->max_spheres * sizeof(double));
+		block->radius = realloc(block->radius, block->max_spheres * sizeof(double));
+	}
+}
+
+void add_sphere_to_block(struct sphere_block_s *block, struct sphere_s *s) {
+	reserve_sphere_block(block, block->num_spheres + 1);
+	int64_t j = block->num_spheres;
+	block->spheres[j] = s;
+	block->pos_x[j] = s->pos.x;
+	block->pos_y[j] = s->pos.y;
+	block->pos_z[j] = s->pos.z;
+	block->vel_x[j] = s->vel.x;
+	block->vel_y[j] = s->vel.y;
+	block->vel_z[j] = s->vel.z;
+	block->radius[j] = get_sphere_radius(s);
+	block->num_spheres++;
+}
+
+void free_sphere_block(struct sphere_block_s *block) {
+	free(block->spheres);
+	free(block->pos_x);
+	free(block->pos_y);
+	free(block->pos_z);
+	free(block->vel_x);
+	free(block->vel_y);
+	free(block->vel_z);
+	free(block->radius);
+	block->spheres = NULL;
+	block->pos_x = NULL;
+	block->pos_y = NULL;
+	block->pos_z = NULL;
+	block->vel_x = NULL;
+	block->vel_y = NULL;
+	block->vel_z = NULL;
+	block->radius = NULL;
+	block->num_spheres = 0;
+	block->max_spheres = 0;
+}
+
+// Returns the index in the block of the sphere "s" will collide with first,
+// with the time until the collision in "time".
+// Only the spheres from index "start" onwards are checked.
+// If it will not collide with any of them then returns -1 and time is DBL_MAX.
+int64_t find_soonest_collision_in_block(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, double *time) {
+	return pair_kernel(s, block, start, block->num_spheres, time);
+}
+
+// Returns false if two spheres can not collide within "time".
+// "dist_squared" is a lower bound on the squared distance between their
+// centres, "radius" an upper bound on the sum of their radii and "speed" an
+// upper bound on the sum of their speeds, so they can get no closer than
+// "radius" until at least (dist - radius) / speed.
+// The reach is widened by PAIR_PRUNE_MARGIN so that rounding in the bounds
+// never rules out a pair the solver would have found.
+bool can_collide_within(const double dist_squared, const double radius, const double speed, const double time) {
+	double reach = radius + (speed * time);
+	return dist_squared <= reach * reach * (1.0 + PAIR_PRUNE_MARGIN);
+}
+
+// Squared distance from a point to the nearest point of a box, 0.0 if inside it.
+double get_distance_squared_to_box(const union vector_3d *pos, const union vector_3d *min, const union vector_3d *max) {
+	double dist_squared = 0.0;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		double d = 0.0;
+		if (pos->vals[a] < min->vals[a]) {
+			d = min->vals[a] - pos->vals[a];
+		} else if (pos->vals[a] > max->vals[a]) {
+			d = pos->vals[a] - max->vals[a];
+		}
+		dist_squared += d * d;
+	}
+	return dist_squared;
+}
+
+// Box around the spheres in one tile of a block, with the largest speed and
+// radius in the tile, so that a whole tile can be ruled out at once.
+struct tile_bounds_s {
+	union vector_3d min;
+	union vector_3d max;
+	double max_speed;
+	double max_radius;
+};
+
+static void find_tile_bounds(const struct sphere_block_s *block, const int64_t start, const int64_t end, double *speeds, struct tile_bounds_s *bounds) {
+	bounds->min.x = bounds->min.y = bounds->min.z = DBL_MAX;
+	bounds->max.x = bounds->max.y = bounds->max.z = -DBL_MAX;
+	bounds->max_speed = 0.0;
+	bounds->max_radius = 0.0;
+	int64_t j;
+	for (j = start; j < end; j++) {
+		bounds->min.x = fmin(bounds->min.x, block->pos_x[j]);
+		bounds->min.y = fmin(bounds->min.y, block->pos_y[j]);
+		bounds->min.z = fmin(bounds->min.z, block->pos_z[j]);
+		bounds->max.x = fmax(bounds->max.x, block->pos_x[j]);
+		bounds->max.y = fmax(bounds->max.y, block->pos_y[j]);
+		bounds->max.z = fmax(bounds->max.z, block->pos_z[j]);
+		double speed = sqrt((block->vel_x[j] * block->vel_x[j]) + (block->vel_y[j] * block->vel_y[j]) + (block->vel_z[j] * block->vel_z[j]));
+		speeds[j - start] = speed;
+		bounds->max_speed = fmax(bounds->max_speed, speed);
+		bounds->max_radius = fmax(bounds->max_radius, block->radius[j]);
+	}
+}
+
+// Squared distance between the nearest points of two tiles' boxes.
+static double get_distance_squared_between_tiles(const struct tile_bounds_s *a, const struct tile_bounds_s *b) {
+	double dist_squared = 0.0;
+	enum axis ax;
+	for (ax = X_AXIS; ax <= Z_AXIS; ax++) {
+		double d = fmax(0.0, fmax(a->min.vals[ax] - b->max.vals[ax], b->min.vals[ax] - a->max.vals[ax]));
+		dist_squared += d * d;
+	}
+	return dist_squared;
+}
+
+// Finds the soonest collision for each sphere in block "a" with the spheres in
+// block "b". The index in "b" of each sphere's partner is stored in "indices",
+// or -1 if it will not collide with any, and the time until the collision in "times".
+// On entry "times" holds a cutoff for each sphere: only collisions sooner than
+// it are looked for, so a sphere with no partner keeps its cutoff. Pass DBL_MAX
+// to find every sphere's soonest collision.
+// If "a" and "b" are the same block then each sphere is only checked against
+// the spheres after it, so each pair is only checked once.
+// Checking each sphere in "a" against the whole of "b" in turn would read all
+// of "b" from memory for every sphere once "b" is larger than the cache.
+// Instead both blocks are split into tiles of PAIR_TILE_SIZE spheres, and each
+// tile of "a" is checked against every tile of "b" while both are in cache.
+// The tiles of "b" are checked in order, so where a sphere has more than one
+// soonest partner the one first in "b" is kept, the same as checking it in one go.
+// A tile of "b" is skipped for a tile of "a", or for a single sphere in it, if
+// the spheres are too far apart to meet at their largest speeds before the
+// cutoff. Returns the number of pair tests skipped this way.
+int64_t find_soonest_collisions_between_blocks(const struct sphere_block_s *a, const struct sphere_block_s *b, int64_t *indices, double *times) {
+	bool same = a == b;
+	int64_t num_skipped = 0;
+	int64_t i;
+	for (i = 0; i < a->num_spheres; i++) {
+		indices[i] = -1;
+	}
+	double a_speeds[PAIR_TILE_SIZE];
+	double b_speeds[PAIR_TILE_SIZE];
+	struct tile_bounds_s a_bounds;
+	struct tile_bounds_s b_bounds;
+	int64_t i_tile, j_tile;
+	for (i_tile = 0; i_tile < a->num_spheres; i_tile += PAIR_TILE_SIZE) {
+		int64_t i_end = i_tile + PAIR_TILE_SIZE < a->num_spheres ? i_tile + PAIR_TILE_SIZE : a->num_spheres;
+		find_tile_bounds(a, i_tile, i_end, a_speeds, &a_bounds);
+		j_tile = same ? i_tile : 0;
+		for (; j_tile < b->num_spheres; j_tile += PAIR_TILE_SIZE) {
+			int64_t j_end = j_tile + PAIR_TILE_SIZE < b->num_spheres ? j_tile + PAIR_TILE_SIZE : b->num_spheres;
+			find_tile_bounds(b, j_tile, j_end, b_speeds, &b_bounds);
+			double max_cutoff = 0.0;
+			for (i = i_tile; i < i_end; i++) {
+				max_cutoff = fmax(max_cutoff, times[i]);
+			}
+			double speed = a_bounds.max_speed + b_bounds.max_speed;
+			double radius = a_bounds.max_radius + b_bounds.max_radius;
+			if (!can_collide_within(get_distance_squared_between_tiles(&a_bounds, &b_bounds), radius, speed, max_cutoff)) {
+				for (i = i_tile; i < i_end; i++) {
+					int64_t j_start = same && i + 1 > j_tile ? i + 1 : j_tile;
+					num_skipped += j_start < j_end ? j_end - j_start : 0;
+				}
+				continue;
+			}
+			for (i = i_tile; i < i_end; i++) {
+				int64_t j_start = same && i + 1 > j_tile ? i + 1 : j_tile;
+				if (j_start >= j_end) {
+					continue;
+				}
+				struct sphere_s s;
+				s.pos.x = a->pos_x[i];
+				s.pos.y = a->pos_y[i];
+				s.pos.z = a->pos_z[i];
+				s.vel.x = a->vel_x[i];
+				s.vel.y = a->vel_y[i];
+				s.vel.z = a->vel_z[i];
+				s.species = a->spheres[i]->species;
+				double dist_squared = get_distance_squared_to_box(&s.pos, &b_bounds.min, &b_bounds.max);
+				if (!can_collide_within(dist_squared, a->radius[i] + b_bounds.max_radius, a_speeds[i - i_tile] + b_bounds.max_speed, times[i])) {
+					num_skipped += j_end - j_start;
+					continue;
+				}
+				double time;
+				int64_t j = pair_kernel(&s, b, j_start, j_end, &time);
+				if (time < times[i]) {
+					times[i] = time;
+					indices[i] = j;
+				}
+			}
+		}
+	}
+	return num_skipped;
+}
@@ -1,6 +1,7 @@
 #include "wrapper.h" // first due to include order requirement
 
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -70,13 +71,130 @@ void check_for_resizing_after_sphere_loading(){
 	}
 }
 
+// The sector keeps a count of how many spheres have each distinct radius, so
+// the largest radius is still known exactly after the largest sphere leaves.
+// The counts form a max-heap ordered by radius, so the largest radius is always
+// the first entry, and an open addressing table maps each radius to its entry.
+// Adding or removing a sphere whose radius is already in the sector only
+// changes a count. A radius appearing in or disappearing from the sector moves
+// O(log k) entries for k distinct radii, so inputs where nearly every sphere
+// has its own radius cost no more than the heap's depth.
+
+static uint64_t hash_radius(const double radius) {
+	uint64_t h;
+	memcpy(&h, &radius, sizeof(uint64_t));
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int64_t get_radius_home_slot(const struct sector_s *sector, const double radius) {
+	return (int64_t)(hash_radius(radius) & (uint64_t)(sector->num_radius_slots - 1));
+}
+
+// Finds the slot holding the radius, or the empty slot where it would go.
+static int64_t find_radius_slot(const struct sector_s *sector, const double radius) {
+	int64_t mask = sector->num_radius_slots - 1;
+	int64_t slot = get_radius_home_slot(sector, radius);
+	while (sector->radius_slots[slot] != -1 && sector->radii[sector->radius_slots[slot]].radius != radius) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Slots are kept at twice the capacity of the heap so the table is at most half full.
+static void resize_radii(struct sector_s *sector, const int64_t max_radii) {
+	sector->radii = realloc(sector->radii, max_radii * sizeof(struct radius_count_s));
+	sector->max_radii = max_radii;
+	sector->num_radius_slots = max_radii * 2;
+	free(sector->radius_slots);
+	sector->radius_slots = malloc(sector->num_radius_slots * sizeof(int64_t));
+	memset(sector->radius_slots, -1, sector->num_radius_slots * sizeof(int64_t));
+	int64_t i;
+	for (i = 0; i < sector->num_radii; i++) {
+		int64_t slot = find_radius_slot(sector, sector->radii[i].radius);
+		sector->radius_slots[slot] = i;
+		sector->radii[i].slot = slot;
+	}
+}
+
+static void set_radius_entry(struct sector_s *sector, const int64_t i, const struct radius_count_s *entry) {
+	sector->radii[i] = *entry;
+	sector->radius_slots[entry->slot] = i;
+}
+
+static void sift_radius_up(struct sector_s *sector, int64_t i) {
+	struct radius_count_s entry = sector->radii[i];
+	while (i > 0 && sector->radii[(i - 1) / 2].radius < entry.radius) {
+		set_radius_entry(sector, i, &sector->radii[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	set_radius_entry(sector, i, &entry);
+}
+
+static void sift_radius_down(struct sector_s *sector, int64_t i) {
+	struct radius_count_s entry = sector->radii[i];
+	while (1) {
+		int64_t child = (2 * i) + 1;
+		if (child >= sector->num_radii) {
+			break;
+		}
+		if (child + 1 < sector->num_radii && sector->radii[child + 1].radius > sector->radii[child].radius) {
+			child++;
+		}
+		if (sector->radii[child].radius <= entry.radius) {
+			break;
+		}
+		set_radius_entry(sector, i, &sector->radii[child]);
+		i = child;
+	}
+	set_radius_entry(sector, i, &entry);
+}
+
+// Empties the slot, moving back any later slots in the same run that would no
+// longer be found from their home slot.
+static void remove_radius_slot(struct sector_s *sector, int64_t slot) {
+	int64_t mask = sector->num_radius_slots - 1;
+	int64_t next = slot;
+	while (1) {
+		sector->radius_slots[slot] = -1;
+		while (1) {
+			next = (next + 1) & mask;
+			if (sector->radius_slots[next] == -1) {
+				return;
+			}
+			int64_t home = get_radius_home_slot(sector, sector->radii[sector->radius_slots[next]].radius);
+			// Moves back unless its home lies cyclically between the empty slot and it
+			bool stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+			if (!stays) {
+				break;
+			}
+		}
+		sector->radius_slots[slot] = sector->radius_slots[next];
+		sector->radii[sector->radius_slots[slot]].slot = slot;
+		slot = next;
+	}
+}
+
 void set_largest_radius_after_insertion(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sphere->radius == sector->largest_radius) {
-		sector->largest_radius_shared = true; // Quicker to just set it rather than check if already set
-		sector->num_largest_radius_shared++;
-	} else if (sphere->radius > sector->largest_radius) {
-		sector->largest_radius = sphere->radius;
+	double radius = get_sphere_radius(sphere);
+	if (sector->num_radii >= sector->max_radii) {
+		resize_radii(sector, sector->max_radii == 0 ? 4 : sector->max_radii * 2);
 	}
+	int64_t slot = find_radius_slot(sector, radius);
+	if (sector->radius_slots[slot] != -1) {
+		sector->radii[sector->radius_slots[slot]].count++;
+		return;
+	}
+	struct radius_count_s *entry = &sector->radii[sector->num_radii];
+	entry->radius = radius;
+	entry->count = 1;
+	entry->slot = slot;
+	sector->radius_slots[slot] = sector->num_radii;
+	sector->num_radii++;
+	sift_radius_up(sector, sector->num_radii - 1);
+	sector->largest_radius = sector->radii[0].radius;
 }
 
 // Note: if adding sphere to local neighbour then it should be ensured that
@@ -107,45 +225,63 @@ void add_sphere_to_sector(struct sector_s *sector, const struct sphere_s *sphere
 }
 
 void set_largest_radius_after_removal(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sphere->radius == sector->largest_radius && sector->largest_radius_shared == false && sector->num_spheres > 0) {
-		printf("TODO: find new largest radius\n");
+	int64_t slot = sector->num_radius_slots == 0 ? -1 : find_radius_slot(sector, get_sphere_radius(sphere));
+	if (slot == -1 || sector->radius_slots[slot] == -1) {
+		printf("Error: sphere's radius is not tracked by its sector\n");
 		getchar();
 		exit(1);
-	} else if (sphere->radius == sector->largest_radius && sector->largest_radius_shared == true) {
-		sector->num_largest_radius_shared--;
-		if (sector->num_largest_radius_shared == 0) {
-			sector->largest_radius_shared = false;
-		}
-	} else if (sector->num_spheres == 0) {
-		sector->largest_radius = 0.0;
 	}
-}
-
-static void shift(struct sector_s *sector, const struct sphere_s *sphere) {
-	int64_t i;
-	for (i = sphere->sector_id; i < sector->num_spheres - 1; i++) {
-		sector->spheres[i] = sector->spheres[i + 1];
-		sector->spheres[i].sector_id--;
+	int64_t i = sector->radius_slots[slot];
+	sector->radii[i].count--;
+	if (sector->radii[i].count > 0) {
+		return;
+	}
+	remove_radius_slot(sector, slot);
+	sector->num_radii--;
+	if (i < sector->num_radii) {
+		set_radius_entry(sector, i, &sector->radii[sector->num_radii]);
+		if (i > 0 && sector->radii[(i - 1) / 2].radius < sector->radii[i].radius) {
+			sift_radius_up(sector, i);
+		} else {
+			sift_radius_down(sector, i);
+		}
 	}
+	sector->largest_radius = sector->num_radii == 0 ? 0.0 : sector->radii[0].radius;
 }
 
 // Each sphere has a sector id which gives its location in the sector's sphere
 // array.
-// If the sphere to be removed is the only or last it can just be removed normally.
-// Otherwise each sphere after it in the array must be shifted down by one and
-// have its own sector id decremented. 
-// I previously tried doing this without a sector id. A linear search followed 
-// by a memmove was done, but this was not any faster with 4'000 spheres.
-// It may be faster when dealing with a much larger number of spheres however.
+// Order of spheres within a sector does not matter, so the last sphere in the
+// array is copied into the removed sphere's slot and only its sector id needs
+// to be fixed. This keeps transfers constant time and means only one sphere in
+// the shared memory is written rather than the whole tail of the array.
+// Events refer to spheres by sector id, but both sectors involved in a
+// transfer are invalidated afterwards so no stale ids are used, and the cells
+// are rebuilt each time a sector's events are found.
+// The sphere passed in may point into the array itself, so it is finished with
+// before its slot is overwritten.
 void remove_sphere_from_sector(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sector->num_spheres == 1 || sector->num_spheres - 1 == sphere->sector_id) {
-		sector->num_spheres--;
-		set_largest_radius_after_removal(sector, sphere);
-		return;
-	}
-	shift(sector, sphere);
+	const int64_t id = sphere->sector_id;
 	sector->num_spheres--;
 	set_largest_radius_after_removal(sector, sphere);
+	if (id != sector->num_spheres) {
+		sector->spheres[id] = sector->spheres[sector->num_spheres];
+		sector->spheres[id].sector_id = id;
+	}
+}
+
+// Brings this process' copy of another sector's spheres up to the current
+// simulation time before they are used for event prediction.
+// The local sector and local neighbours are skipped as their spheres are in
+// shared memory and are kept up to date by the process responsible for them.
+void update_replicated_spheres(struct sector_s *sector){
+	if(sector == SECTOR || sector->is_local_neighbour){
+		return;
+	}
+	int64_t i;
+	for(i = 0; i < sector->num_spheres; i++){
+		update_sphere_position_to_time(&sector->spheres[i], sim_data.elapsed_time);
+	}
 }
 
 // Helper for add_sphere_to_correct_sector function.
@@ -214,6 +350,102 @@ static void set_local_sector(){
 	init_local_files_for_file_backed_memory();
 }
 
+int64_t get_cell_index(const struct sector_s *sector, const int x, const int y, const int z) {
+	return ((int64_t)x * sector->cell_dims.y * sector->cell_dims.z) + ((int64_t)y * sector->cell_dims.z) + z;
+}
+
+// Chooses how many cells the sector is split into on each axis.
+// Cells are never narrower than CELL_MIN_WIDTH_RADII times the largest radius,
+// and are made wider when the sector holds few spheres so that each cell has
+// around CELL_TARGET_NUM_SPHERES in it. A sector with only a handful of spheres
+// will end up as a single cell.
+static void set_cell_dims(struct sector_s *sector) {
+	union vector_3d size;
+	size.x = sector->end.x - sector->start.x;
+	size.y = sector->end.y - sector->start.y;
+	size.z = sector->end.z - sector->start.z;
+	double width = cbrt((size.x * size.y * size.z * CELL_TARGET_NUM_SPHERES) / sector->num_spheres);
+	if (width < CELL_MIN_WIDTH_RADII * sector->largest_radius) {
+		width = CELL_MIN_WIDTH_RADII * sector->largest_radius;
+	}
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		int dims = (int)(size.vals[a] / width);
+		if (dims < 1) {
+			dims = 1;
+		}
+		sector->cell_dims.vals[a] = dims;
+		sector->cell_size.vals[a] = size.vals[a] / dims;
+	}
+}
+
+static void alloc_cells(struct sector_s *sector, const int64_t num_cells) {
+	if (num_cells <= sector->max_cells) {
+		return;
+	}
+	sector->cells = realloc(sector->cells, num_cells * sizeof(struct cell_s));
+	int64_t i;
+	for (i = sector->max_cells; i < num_cells; i++) {
+		sector->cells[i].sphere_ids = NULL;
+		sector->cells[i].num_spheres = 0;
+		sector->cells[i].max_spheres = 0;
+	}
+	sector->max_cells = num_cells;
+}
+
+static void add_sphere_to_cell(struct cell_s *cell, const int64_t sector_id) {
+	if (cell->num_spheres >= cell->max_spheres) {
+		cell->max_spheres = cell->max_spheres == 0 ? 8 : cell->max_spheres * 2;
+		cell->sphere_ids = realloc(cell->sphere_ids, cell->max_spheres * sizeof(int64_t));
+	}
+	cell->sphere_ids[cell->num_spheres] = sector_id;
+	cell->num_spheres++;
+}
+
+// Finds which cell the sphere is in along one axis.
+// A sphere sitting on the boundary between two cells is put in the cell it is
+// moving towards, otherwise the time until it leaves its cell could be zero
+// and it would never get past the boundary.
+static int find_cell_on_axis(const struct sector_s *sector, const struct sphere_s *sphere, const enum axis a) {
+	double offset = (sphere->pos.vals[a] - sector->start.vals[a]) / sector->cell_size.vals[a];
+	int cell = (int)floor(offset);
+	double frac = offset - cell;
+	if (sphere->vel.vals[a] > 0.0 && frac > 1.0 - CELL_BOUNDARY_EPS) {
+		cell++;
+	} else if (sphere->vel.vals[a] < 0.0 && frac < CELL_BOUNDARY_EPS) {
+		cell--;
+	}
+	// Spheres may be very slightly outside of the sector due to precision issues
+	if (cell < 0) {
+		cell = 0;
+	} else if (cell >= sector->cell_dims.vals[a]) {
+		cell = sector->cell_dims.vals[a] - 1;
+	}
+	return cell;
+}
+
+// Places every sphere in the sector into a cell.
+// The spheres must have been brought up to the current time first.
+void build_cells_for_sector(struct sector_s *sector) {
+	set_cell_dims(sector);
+	int64_t num_cells = (int64_t)sector->cell_dims.x * sector->cell_dims.y * sector->cell_dims.z;
+	alloc_cells(sector, num_cells);
+	int64_t i;
+	for (i = 0; i < num_cells; i++) {
+		sector->cells[i].num_spheres = 0;
+	}
+	sector->max_speed = 0.0;
+	for (i = 0; i < sector->num_spheres; i++) {
+		const struct sphere_s *sphere = &sector->spheres[i];
+		int64_t c = get_cell_index(sector, find_cell_on_axis(sector, sphere, X_AXIS), find_cell_on_axis(sector, sphere, Y_AXIS), find_cell_on_axis(sector, sphere, Z_AXIS));
+		add_sphere_to_cell(&sector->cells[c], i);
+		double speed = get_vector_3d_magnitude(&sphere->vel);
+		if (speed > sector->max_speed) {
+			sector->max_speed = speed;
+		}
+	}
+}
+
 static double x_inc;
 static double y_inc;
 static double z_inc;
@@ -226,6 +458,8 @@ static void set_sector(int i, int j, int k){
 	struct sector_s *s = &sim_data.sectors[i][j][k];
 	s->num_spheres = 0;
 	s->max_spheres = SECTOR_DEFAULT_MAX_SPHERES;
+	s->cells = NULL;
+	s->max_cells = 0;
 	s->start.x = x_inc * i;
 	s->end.x = s->start.x + x_inc;
 	s->start.y = y_inc * j;
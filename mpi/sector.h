@@ -21,6 +21,32 @@ enum direction {
 
 #define MAX_NUM_NEIGHBOURS 26
 
+// Cells must be at least this many times the largest radius in the sector wide,
+// so that spheres in cells that are not adjacent cannot collide before one of
+// them leaves its cell. Must be at least 2.0, anything above that is a margin
+// that makes spheres cross between cells less often.
+#define CELL_MIN_WIDTH_RADII 3.0
+// Average number of spheres wanted in each cell. Cells are made wider than the
+// minimum when a sector holds few spheres for its size.
+#define CELL_TARGET_NUM_SPHERES 4.0
+// Spheres closer than this to the boundary between two cells, as a fraction
+// of the cell's width, are placed in the cell they are moving towards.
+#define CELL_BOUNDARY_EPS 1e-9
+
+// Cell within a sector. Holds the sector ids of the spheres inside it.
+struct cell_s {
+	int64_t *sphere_ids;
+	int64_t num_spheres;
+	int64_t max_spheres;
+};
+
+// Number of spheres in a sector that have a given radius.
+struct radius_count_s {
+	double radius;
+	int64_t count;
+	int64_t slot; // Where the radius is in the sector's radius_slots
+};
+
 struct sector_s {
 	struct sphere_s *spheres;
 	int64_t num_spheres;
@@ -36,12 +62,27 @@ struct sector_s {
 	// Location in sector array
 	union vector_3i pos;
 	double largest_radius; // Radius of the largest sphere in the sector.
-	bool largest_radius_shared; // If many spheres have the same radius as the largest radius
-	int64_t num_largest_radius_shared; // How many spheres shared the largest radius
+	// Each distinct radius in the sector and how many spheres have it, as a
+	// max-heap by radius so the largest is always the first entry.
+	struct radius_count_s *radii;
+	int64_t num_radii;
+	int64_t max_radii;
+	// Open addressing table from each radius to its entry in radii, -1 if the
+	// slot is empty.
+	int64_t *radius_slots;
+	int64_t num_radius_slots;
+	double max_speed; // Speed of the fastest sphere in the sector when the cells were last built
 	// If sectors are neighbours and the processes responsible for them are
 	// also on the same machine then use file backed shared memory to store spheres.
 	char *spheres_filename;
 	int spheres_fd;
+	// Uniform grid of cells the sector is divided into, so that spheres only
+	// need to be checked against spheres in the same or adjacent cells.
+	// Each process rebuilds its own copy whenever it finds events for the sector.
+	struct cell_s *cells;
+	int64_t max_cells; // Number of cells allocated
+	union vector_3i cell_dims; // Number of cells on each axis
+	union vector_3d cell_size;
 };
 
 // Used when iterating over axes and need to access sector adjacent on the current axis.
@@ -56,5 +97,8 @@ bool does_sphere_belong_to_sector(const struct sphere_s *sphere, const struct se
 struct sector_s *find_sector_that_sphere_belongs_to(struct sphere_s *sphere);
 void add_sphere_to_sector(struct sector_s *sector, const struct sphere_s *sphere);
 void remove_sphere_from_sector(struct sector_s *sector, const struct sphere_s *sphere);
+void update_replicated_spheres(struct sector_s *sector);
+int64_t get_cell_index(const struct sector_s *sector, const int x, const int y, const int z);
+void build_cells_for_sector(struct sector_s *sector);
 void add_sphere_to_sector(struct sector_s *sector, const struct sphere_s *sphere);
 void init_sectors();
@@ -4,10 +4,12 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "collision.h"
 #include "event.h"
 #include "grid.h"
 #include "io.h"
 #include "mpi_vars.h"
+#include "pair_kernel.h"
 #include "params.h"
 #include "simulation.h"
 #include "vector_3.h"
@@ -38,7 +40,7 @@ void sanity_check() {
 				}
 			}
 			if (error) {
-				printf("Sector at %d, %d, %d with pos %f, %f, %f, incorrectly has sphere %ld with pos %f, %f, %f\n", s->pos.x, s->pos.y, s->pos.z, s->start.x, s->start.y, s->start.z, sphere->id, sphere->pos.x, sphere->pos.y, sphere->pos.z);
+				printf("Sector at %d, %d, %d with pos %f, %f, %f, incorrectly has sphere %d with pos %f, %f, %f\n", s->pos.x, s->pos.y, s->pos.z, s->start.x, s->start.y, s->start.z, sphere->id, sphere->pos.x, sphere->pos.y, sphere->pos.z);
 				exit(1);
 			}
 		}
@@ -64,6 +66,8 @@ static void init_stats(){
 	stats.num_grid_collisions = 0;
 	stats.num_sector_transfers = 0;
 	stats.num_partial_crossings = 0;
+	stats.num_cell_crossings = 0;
+	stats.num_pair_tests_skipped = 0;
 }
 
 static void parse_args_and_init_mpi(int argc, char *argv[]){
@@ -88,9 +92,11 @@ void simulation_init(int argc, char *argv[]) {
 	init_sectors();
 	load_spheres(initial_state_fp);
 	fclose(initial_state_fp);
+	init_pair_kernel();
 	MPI_Barrier(MPI_COMM_WORLD); // barrier to ensure ftruncate has been called before next step
 	check_for_resizing_after_sphere_loading();
 	init_events();
+	init_boundary_events();
 
 }
 
@@ -115,7 +121,10 @@ static void do_grid_iteration(){
 	sim_data.elapsed_time += next_event->time;
 }
 
+// Each process counts the pair tests it skipped itself, so these are summed.
 static void print_stats(){
+	int64_t num_pair_tests_skipped = 0;
+	MPI_Reduce(&stats.num_pair_tests_skipped, &num_pair_tests_skipped, 1, MPI_INT64_T, MPI_SUM, 0, GRID_COMM);
 	if(GRID_RANK != 0){
 		return;
 	}
@@ -123,6 +132,9 @@ static void print_stats(){
 	printf("Number of collisions with grid boundary: %d\n", stats.num_grid_collisions);
 	printf("Number of transfers between sectors: %d\n", stats.num_sector_transfers);
 	printf("Number of partial crossings: %d\n", stats.num_partial_crossings);
+	printf("Number of cell crossings: %d\n", stats.num_cell_crossings);
+	printf("Number of pair tests skipped: %ld\n", num_pair_tests_skipped);
+	printf("Pair kernel used: %s\n", get_pair_kernel_name());
 }
 
 static bool is_simulation_finished(){
@@ -144,7 +156,10 @@ void simulation_run() {
 	while (is_simulation_finished() == false) {
 		do_grid_iteration();
 		MPI_Barrier(GRID_COMM);
-		sim_data.iteration_number++;
+		// Cell crossings are not written to the output file, see apply_sphere_with_cell_event()
+		if(next_event->type != COL_SPHERE_WITH_CELL){
+			sim_data.iteration_number++;
+		}
 	}
 	save_final_state_file();
 	print_stats();
@@ -172,6 +187,8 @@ void simulation_cleanup() {
 		free(sim_data.sectors[i]);
 	}
 	free(sim_data.sectors);
+	free_collision_blocks();
+	free_species();
 	MPI_File_close(&MPI_OUTPUT_FILE);
 	MPI_Comm_free(&GRID_COMM);
 }
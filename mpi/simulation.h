@@ -36,6 +36,8 @@ struct stats_s {
 	int num_grid_collisions;
 	int num_sector_transfers;
 	int num_partial_crossings;
+	int num_cell_crossings;
+	int64_t num_pair_tests_skipped; // Pairs ruled out by distance without finding when they collide
 };
 
 struct stats_s stats;
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "species.h"
+
+#define SPECIES_DEFAULT_MAX 16
+
+// Species are numbered in the order they are first seen in the initial state
+// file, so every process that reads the same file gives them the same index.
+
+static uint64_t hash_species(const double radius, const double mass) {
+	uint64_t r, m;
+	memcpy(&r, &radius, sizeof(uint64_t));
+	memcpy(&m, &mass, sizeof(uint64_t));
+	uint64_t h = (r * 0x9E3779B97F4A7C15ULL) ^ (m + 0x632BE59BD9B4E019ULL + (r << 6) + (r >> 2));
+	h ^= h >> 31;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+// Compares the bits, so every radius/mass the file can hold is its own species.
+static bool species_matches(const struct species_s *s, const double radius, const double mass) {
+	return memcmp(&s->radius, &radius, sizeof(double)) == 0 && memcmp(&s->mass, &mass, sizeof(double)) == 0;
+}
+
+static int32_t find_slot(const double radius, const double mass) {
+	int32_t mask = species_table.num_slots - 1;
+	int32_t slot = (int32_t)(hash_species(radius, mass) & (uint64_t)mask);
+	while (species_table.slots[slot] != -1 && !species_matches(&species_table.species[species_table.slots[slot]], radius, mass)) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Slots are kept at twice the species capacity so the table is at most half full.
+static void resize_species_table(const int32_t max_species) {
+	species_table.species = realloc(species_table.species, max_species * sizeof(struct species_s));
+	species_table.max_species = max_species;
+	species_table.num_slots = max_species * 2;
+	free(species_table.slots);
+	species_table.slots = malloc(species_table.num_slots * sizeof(int32_t));
+	memset(species_table.slots, -1, species_table.num_slots * sizeof(int32_t));
+	int32_t i;
+	for (i = 0; i < species_table.num_species; i++) {
+		const struct species_s *s = &species_table.species[i];
+		species_table.slots[find_slot(s->radius, s->mass)] = i;
+	}
+}
+
+int32_t find_or_add_species(const double radius, const double mass) {
+	if (species_table.max_species == 0) {
+		resize_species_table(SPECIES_DEFAULT_MAX);
+	}
+	int32_t slot = find_slot(radius, mass);
+	if (species_table.slots[slot] != -1) {
+		return species_table.slots[slot];
+	}
+	if (species_table.num_species == species_table.max_species) {
+		if (species_table.max_species > INT32_MAX / 4) {
+			printf("Error: too many distinct sphere radius and mass pairs\n");
+			exit(1);
+		}
+		resize_species_table(species_table.max_species * 2);
+		slot = find_slot(radius, mass);
+	}
+	int32_t i = species_table.num_species++;
+	species_table.species[i].radius = radius;
+	species_table.species[i].mass = mass;
+	if (i == 0) {
+		species_table.uniform_radius = true;
+		species_table.uniform_mass = true;
+	} else {
+		species_table.uniform_radius = species_table.uniform_radius && radius == species_table.species[0].radius;
+		species_table.uniform_mass = species_table.uniform_mass && mass == species_table.species[0].mass;
+	}
+	species_table.slots[slot] = i;
+	return i;
+}
+
+void free_species() {
+	free(species_table.species);
+	free(species_table.slots);
+	memset(&species_table, 0, sizeof(struct species_table_s));
+}
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "io.h"
 #include "mpi_vars.h"
 #include "sector.h"
@@ -16,24 +18,50 @@ void update_sphere_position(struct sphere_s *s, const double t) {
 	s->pos.z = s->pos.z + (s->vel.z * t);
 }
 
+// Brings the sphere's position forward to the given simulation time.
+// Only spheres in the local sector are moved after every event. Copies of
+// spheres in other sectors are moved when they are needed by an event or by
+// event prediction, so each sphere records the time its position is for.
+void update_sphere_position_to_time(struct sphere_s *s, const double t) {
+	if (s->time != t) {
+		update_sphere_position(s, t - s->time);
+		s->time = t;
+	}
+}
+
 // Loads spheres from the specified inital state file
 // This file contains every sphere, and we need to check if the sphere belongs
 // to the sector the current MPI node is responsible for.
 void load_spheres(FILE *initial_state_fp) {
 	fread_wrapper(&sim_data.total_num_spheres, sizeof(int64_t), 1, initial_state_fp);
 	write_num_spheres();
+	if (sim_data.total_num_spheres > INT32_MAX) {
+		printf("Error: at most %d spheres are supported\n", INT32_MAX);
+		exit(1);
+	}
 	struct sphere_s in;
 	int64_t i;
 	for(i = 0; i < sim_data.total_num_spheres; i++){
-		fread_wrapper(&in.id, sizeof(int64_t), 1, initial_state_fp);
+		int64_t id;
+		double mass, radius;
+		fread_wrapper(&id, sizeof(int64_t), 1, initial_state_fp);
 		fread_wrapper(&in.pos.x, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&in.pos.y, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&in.pos.z, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&in.vel.x, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&in.vel.y, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&in.vel.z, sizeof(double), 1, initial_state_fp);
-		fread_wrapper(&in.mass, sizeof(double), 1, initial_state_fp);
-		fread_wrapper(&in.radius, sizeof(double), 1, initial_state_fp);
+		fread_wrapper(&mass, sizeof(double), 1, initial_state_fp);
+		fread_wrapper(&radius, sizeof(double), 1, initial_state_fp);
+		if (id < 0 || id >= sim_data.total_num_spheres) {
+			printf("Error: sphere ids must be between 0 and the number of spheres\n");
+			exit(1);
+		}
+		in.id = (int32_t)id;
+		// Every process sees every sphere in the same order, so they all give
+		// each species the same index.
+		in.species = find_or_add_species(radius, mass);
+		in.time = 0.0;
 		write_sphere_initial_state(&in);
 		struct sector_s *temp = find_sector_that_sphere_belongs_to(&in);
 		if(temp->is_local_neighbour){
@@ -58,69 +86,48 @@ void apply_bounce_between_spheres(struct sphere_s *s1, struct sphere_s *s2) {
 	normalise_vector_3d(&rel_pos);
 	double dp1 = get_vector_3d_dot_product(&rel_pos, &s1->vel);
 	double dp2 = get_vector_3d_dot_product(&rel_pos, &s2->vel);
-	double p = (2.0 * (dp1 - dp2)) / (s1->mass + s2->mass);
+	// Change in velocity along rel_pos for each sphere.
+	// When every sphere has the same mass the masses cancel out.
+	double p1, p2;
+	if (has_uniform_mass()) {
+		p1 = dp1 - dp2;
+		p2 = p1;
+	} else {
+		double m1 = get_sphere_mass(s1);
+		double m2 = get_sphere_mass(s2);
+		double p = (2.0 * (dp1 - dp2)) / (m1 + m2);
+		p1 = p * m2;
+		p2 = p * m1;
+	}
 	// Sphere one first
-	s1->vel.x = s1->vel.x - (p * s2->mass * rel_pos.x);
-	s1->vel.y = s1->vel.y - (p * s2->mass * rel_pos.y);
-	s1->vel.z = s1->vel.z - (p * s2->mass * rel_pos.z);
+	s1->vel.x = s1->vel.x - (p1 * rel_pos.x);
+	s1->vel.y = s1->vel.y - (p1 * rel_pos.y);
+	s1->vel.z = s1->vel.z - (p1 * rel_pos.z);
 	// Now sphere two
-	s2->vel.x = s2->vel.x + (p * s1->mass * rel_pos.x);
-	s2->vel.y = s2->vel.y + (p * s1->mass * rel_pos.y);
-	s2->vel.z = s2->vel.z + (p * s1->mass * rel_pos.z);
-}
-
-static void update_neighbour_spheres(){
-	int i, j;
-	for(i = 0; i < SECTOR->num_neighbours; i++){
-		int id = SECTOR->neighbour_ids[i];
-		struct sector_s *sector = &sim_data.sectors_flat[id];
-		if(sector->is_local_neighbour){
-			continue;
-		}
-		for(j = 0; j < sector->num_spheres; j++){
-			struct sphere_s *s = &(sector->spheres[j]);
-			update_sphere_position(s, next_event->time);
-		}
-	}
+	s2->vel.x = s2->vel.x + (p2 * rel_pos.x);
+	s2->vel.y = s2->vel.y + (p2 * rel_pos.y);
+	s2->vel.z = s2->vel.z + (p2 * rel_pos.z);
 }
 
 void update_my_spheres(){
+	double t = sim_data.elapsed_time + next_event->time;
 	int i;
 	for (i = 0; i < SECTOR->num_spheres; i++) {
 		struct sphere_s *s = &(SECTOR->spheres[i]);
-		update_sphere_position(s, next_event->time);
+		update_sphere_position_to_time(s, t);
 	}
 }
 
-// Updates spheres belonging to sectors that aren't local neighbours, 
-// including the local sector.
-// Used when ALL_HELP is true
-static void update_all_spheres(){
-	int i, j;
-	for(i = 0; i < sim_data.num_sectors; i++){
-		struct sector_s *sector = &sim_data.sectors_flat[i];
-		if(sector->is_local_neighbour){
-			continue;
-		}
-		for(j = 0; j < sector->num_spheres; j++){
-			struct sphere_s *s = &(sector->spheres[j]);
-			update_sphere_position(s, next_event->time);
-		}
-	}
-}
-// This updates the positions and velocities of each sphere once the next
+// This updates the positions of spheres in the local sector once the next
 // event and the time it occurs are known.
-// If ALL_HELP is enabled then update all spheres except those that belong to 
-// local neighbours.
-// Otherwise update own spheres and those of non-local neighbours
+// These are kept up to date after every event as local neighbours read them
+// directly from shared memory.
+// Copies of spheres belonging to other sectors are only brought up to date when
+// they are needed, which avoids moving every replicated sphere after every event.
 // Finally update dummy copies of spheres involved in the event.
 void update_spheres() {
-	if(ALL_HELP){
-		update_all_spheres();
-	} else {
-		update_my_spheres();
-		update_neighbour_spheres();
-	}
-	update_sphere_position(&next_event->sphere_1, next_event->time);
-	update_sphere_position(&next_event->sphere_2, next_event->time);
+	double t = sim_data.elapsed_time + next_event->time;
+	update_my_spheres();
+	update_sphere_position_to_time(&next_event->sphere_1, t);
+	update_sphere_position_to_time(&next_event->sphere_2, t);
 }
@@ -1,23 +1,42 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
+#include "species.h"
 #include "vector_3.h"
 
 // Velocity is given as metres per second
 // Position is given in metres and is the center of the sphere.
-// For now assuming all spheres have the same radius
+// Radius and mass come from the sphere's species, see species.h.
+// Ids are 32 bit to keep the record small, as spheres are sent whole in every
+// event, which limits a run to INT32_MAX spheres.
 struct sphere_s {
-	int64_t id; // global id
-	int64_t sector_id; // id within the current sector's array of spheres
 	union vector_3d vel;
 	union vector_3d pos;
-	double radius;
-	double mass;
+	double time; // Simulation time the position was last brought up to date at
+	int32_t species; // index into species_table
+	int32_t sector_id; // id within the current sector's array of spheres
+	int32_t id; // global id
 };
 
+static inline double get_sphere_radius(const struct sphere_s *s) {
+	return get_species_radius(s->species);
+}
+
+static inline double get_sphere_mass(const struct sphere_s *s) {
+	return get_species_mass(s->species);
+}
+
+// Spheres with no velocity cannot collide with each other, so they only need
+// to be checked against moving spheres.
+static inline bool is_sphere_resting(const struct sphere_s *s) {
+	return s->vel.x == 0.0 && s->vel.y == 0.0 && s->vel.z == 0.0;
+}
+
 void update_sphere_position(struct sphere_s *s, const double t);
+void update_sphere_position_to_time(struct sphere_s *s, const double t);
 void load_spheres(FILE *initial_state_fp);
 void apply_bounce_between_spheres(struct sphere_s *s1, struct sphere_s *s2);
 void update_spheres();
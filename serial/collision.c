@@ -1,11 +1,16 @@
 #include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "collision.h"
 #include "event.h"
+#include "pair_kernel.h"
 #include "simulation.h"
 #include "sphere.h"
+#include "sphere_events.h"
+#include "tasks.h"
+#include "threads.h"
 #include "vector_3.h"
 
 // Adapted from: https://www.gamasutra.com/view/feature/131424/pool_hall_lessons_fast_accurate_.php?page=2
@@ -27,23 +32,17 @@
 // We then have to figure out the actual point of collision, as the shortest
 // distance will very likely be when the spheres pass through one another.
 // Trigonometry is used to figure out where the spheres collide.
-double find_collision_time_spheres(const struct sphere_s *s1, const struct sphere_s *s2) {
-	union vector_3d rel_vel; 
-	rel_vel.x = s1->vel.x - s2->vel.x; 
-	rel_vel.y = s1->vel.y - s2->vel.y; 
-	rel_vel.z = s1->vel.z - s2->vel.z;
-	union vector_3d rel_pos;
-	rel_pos.x = s2->pos.x - s1->pos.x; 
-	rel_pos.y = s2->pos.y - s1->pos.y; 
-	rel_pos.z = s2->pos.z - s1->pos.z;
-	double dp = get_vector_3d_dot_product(&rel_vel, &rel_pos);
-	double vel_vec_mag = get_vector_3d_magnitude(&rel_vel);
-	double pos_vec_mag = get_vector_3d_magnitude(&rel_pos);
+// rel_pos is the second sphere's position relative to the first, rel_vel the
+// first sphere's velocity relative to the second and r_total the sum of their
+// radii, so the pair kernel can call this with values read from a block.
+double find_collision_time_trig(const union vector_3d *rel_pos, const union vector_3d *rel_vel, const double r_total) {
+	double dp = get_vector_3d_dot_product(rel_vel, rel_pos);
+	double vel_vec_mag = get_vector_3d_magnitude(rel_vel);
+	double pos_vec_mag = get_vector_3d_magnitude(rel_pos);
 	double angle = get_shortest_angle_between_vector_3d(dp, vel_vec_mag, pos_vec_mag);
 	if (angle >= 3.14159265358979323846 / 2.0) { //check if >= 90 degrees (note angle is in radians)
 		return DBL_MAX;
 	}
-	double r_total = s1->radius + s2->radius;
 	double shortest_dist = sin(angle) * pos_vec_mag;
 	if (shortest_dist > r_total) {
 		return DBL_MAX;
@@ -61,6 +60,59 @@ double find_collision_time_spheres(const struct sphere_s *s1, const struct spher
 	return  dist_to_col / vel_vec_mag;
 }
 
+double find_collision_time_spheres_trig(const struct sphere_s *s1, const struct sphere_s *s2) {
+	union vector_3d rel_vel; 
+	rel_vel.x = s1->vel.x - s2->vel.x; 
+	rel_vel.y = s1->vel.y - s2->vel.y; 
+	rel_vel.z = s1->vel.z - s2->vel.z;
+	union vector_3d rel_pos;
+	rel_pos.x = s2->pos.x - s1->pos.x; 
+	rel_pos.y = s2->pos.y - s1->pos.y; 
+	rel_pos.z = s2->pos.z - s1->pos.z;
+	return find_collision_time_trig(&rel_pos, &rel_vel, get_sphere_radius(s1) + get_sphere_radius(s2));
+}
+
+// Finds the same time as find_collision_time_spheres_trig without any trigonometry,
+// by solving |rel_pos - rel_vel * t| = r1 + r2 for t.
+// With pv = rel_pos . rel_vel, vv = rel_vel . rel_vel and
+// c = (rel_pos . rel_pos) - (r1 + r2)^2 the spheres collide at the smaller root
+//	t = (pv - sqrt(pv^2 - vv * c)) / vv
+// which is rearranged to t = c / (pv + sqrt(pv^2 - vv * c)) so that it does not
+// lose precision when c is small compared to pv^2.
+// The spheres will not collide if pv <= 0.0 (they are not moving towards each
+// other) or if pv^2 - vv * c < 0.0 (their paths never come within r1 + r2).
+// This is the same calculation, in the same order, as the pair kernel.
+double find_collision_time_spheres_quadratic(const struct sphere_s *s1, const struct sphere_s *s2) {
+	union vector_3d rel_vel;
+	rel_vel.x = s1->vel.x - s2->vel.x;
+	rel_vel.y = s1->vel.y - s2->vel.y;
+	rel_vel.z = s1->vel.z - s2->vel.z;
+	union vector_3d rel_pos;
+	rel_pos.x = s2->pos.x - s1->pos.x;
+	rel_pos.y = s2->pos.y - s1->pos.y;
+	rel_pos.z = s2->pos.z - s1->pos.z;
+	double r_total = get_sphere_radius(s1) + get_sphere_radius(s2);
+	double pv = get_vector_3d_dot_product(&rel_pos, &rel_vel);
+	double vv = get_vector_3d_dot_product(&rel_vel, &rel_vel);
+	double c = get_vector_3d_dot_product(&rel_pos, &rel_pos) - (r_total * r_total);
+	double disc = (pv * pv) - (vv * c);
+	if (pv <= 0.0 || disc < 0.0) {
+		return DBL_MAX;
+	}
+	double t = c / (pv + sqrt(disc));
+	// Spheres which already overlap give a negative time, treat this as colliding now
+	return t > 0.0 ? t : 0.0;
+}
+
+// The solver used is picked at build time, see the Makefile.
+double find_collision_time_spheres(const struct sphere_s *s1, const struct sphere_s *s2) {
+#ifdef TRIG_COLLISION_TIME
+	return find_collision_time_spheres_trig(s1, s2);
+#else
+	return find_collision_time_spheres_quadratic(s1, s2);
+#endif
+}
+
 // Finds the time taken to cross the boundary on the specified axis in the grid or sector.
 // axis_vel and axis_pos are the velocity/position of the sphere on that axis.
 // If checking against the grid then bound_start will be 0.0, if checking against
@@ -75,19 +127,6 @@ static double find_time_to_cross_boundary(const double bound_start, const double
 	return dist / axis_vel;
 }
 
-// Note: a2, a3 may be AXIS_NONE and dir_2, dir_3 may be DIR_NONE.
-// In those cases the modifier will be 0 so the position on those axes won't change.
-static struct sector_s *get_sector_adjacent_on_axes(
-		const struct sector_s *s, 
-		const enum axis a1, const enum axis a2, const enum axis a3,
-		const enum direction dir_1, const enum direction dir_2, const enum direction dir_3
-	){
-	int x = s->pos.x + SECTOR_MODIFIERS[dir_1][a1][X_AXIS] + SECTOR_MODIFIERS[dir_2][a2][X_AXIS] + SECTOR_MODIFIERS[dir_3][a3][X_AXIS];
-	int y = s->pos.y + SECTOR_MODIFIERS[dir_1][a1][Y_AXIS] + SECTOR_MODIFIERS[dir_2][a2][Y_AXIS] + SECTOR_MODIFIERS[dir_3][a3][Y_AXIS];
-	int z = s->pos.z + SECTOR_MODIFIERS[dir_1][a1][Z_AXIS] + SECTOR_MODIFIERS[dir_2][a2][Z_AXIS] + SECTOR_MODIFIERS[dir_3][a3][Z_AXIS];
-	return &sim_data.sectors[x][y][z];
-}
-
 // Finds the time when the sphere will pass into another sector
 // Note: we want to know when the center of the sphere crosses the sector boundary so we set
 // radius to 0 when calling find_time_to_cross_boundary().
@@ -100,9 +139,9 @@ double find_collision_time_sector(const struct sector_s *sector, const struct sp
 			if (temp_time < time) {
 				time = temp_time;
 				if (sphere->vel.vals[a] > 0.0) {
-					*dest = get_sector_adjacent_on_axes(sector, a, AXIS_NONE, AXIS_NONE, DIR_POSITIVE, DIR_NONE, DIR_NONE);
+					*dest = sector->neighbours[get_face_neighbour_index(a, DIR_POSITIVE)];
 				} else {
-					*dest = get_sector_adjacent_on_axes(sector, a, AXIS_NONE, AXIS_NONE, DIR_NEGATIVE, DIR_NONE, DIR_NONE);
+					*dest = sector->neighbours[get_face_neighbour_index(a, DIR_NEGATIVE)];
 				}
 			}
 		}
@@ -120,7 +159,7 @@ double find_collision_time_grid(const struct sphere_s *s, enum axis *col_axis) {
 	enum axis a;
 	for (a = X_AXIS; a <= Z_AXIS; a++) {
 		if (s->vel.vals[a] != 0) {
-			double temp_time = find_time_to_cross_boundary(0.0, sim_data.grid_size.vals[a], s->vel.vals[a], s->pos.vals[a], s->radius);
+			double temp_time = find_time_to_cross_boundary(0.0, sim_data.grid_size.vals[a], s->vel.vals[a], s->pos.vals[a], get_sphere_radius(s));
 			if (temp_time < time) {
 				time = temp_time;
 				*col_axis = a;
@@ -140,253 +179,460 @@ void apply_bounce_between_spheres(struct sphere_s *s1, struct sphere_s *s2) {
 	normalise_vector_3d(&rel_pos);
 	double dp1 = get_vector_3d_dot_product(&rel_pos, &s1->vel);
 	double dp2 = get_vector_3d_dot_product(&rel_pos, &s2->vel);
-	double p = (2.0 * (dp1 - dp2)) / (s1->mass + s2->mass);
+	// Change in velocity along rel_pos for each sphere.
+	// When every sphere has the same mass the masses cancel out.
+	double p1, p2;
+	if (has_uniform_mass()) {
+		p1 = dp1 - dp2;
+		p2 = p1;
+	} else {
+		double m1 = get_sphere_mass(s1);
+		double m2 = get_sphere_mass(s2);
+		double p = (2.0 * (dp1 - dp2)) / (m1 + m2);
+		p1 = p * m2;
+		p2 = p * m1;
+	}
 	// Sphere one first
-	s1->vel.x = s1->vel.x - (p * s2->mass * rel_pos.x);
-	s1->vel.y = s1->vel.y - (p * s2->mass * rel_pos.y);
-	s1->vel.z = s1->vel.z - (p * s2->mass * rel_pos.z);
+	s1->vel.x = s1->vel.x - (p1 * rel_pos.x);
+	s1->vel.y = s1->vel.y - (p1 * rel_pos.y);
+	s1->vel.z = s1->vel.z - (p1 * rel_pos.z);
 	// Now sphere two
-	s2->vel.x = s2->vel.x + (p * s1->mass * rel_pos.x);
-	s2->vel.y = s2->vel.y + (p * s1->mass * rel_pos.y);
-	s2->vel.z = s2->vel.z + (p * s1->mass * rel_pos.z);
+	s2->vel.x = s2->vel.x + (p2 * rel_pos.x);
+	s2->vel.y = s2->vel.y + (p2 * rel_pos.y);
+	s2->vel.z = s2->vel.z + (p2 * rel_pos.z);
+}
+
+// Spheres copied into blocks for find_soonest_collisions_between_blocks, and
+// the soonest partner and time found for each sphere in block_a.
+// Each thread has its own.
+struct block_scratch_s {
+	struct sphere_block_s block_a;
+	struct sphere_block_s block_b;
+	int64_t *soonest_indices;
+	double *soonest_times;
+	int64_t max_soonest;
+};
+
+static struct block_scratch_s *scratch;
+static int num_scratch;
+
+// A sphere heading towards another sector which has to be checked against the
+// spheres in that sector for partial crossings.
+struct partial_crossing_check_s {
+	struct sector_s *sector_1;
+	struct sphere_s *sphere_1;
+	struct sector_s *sector_2;
+	struct sphere_s *sphere_2; // soonest partner found in sector_2, NULL if none
+	double time; // time until the collision with sphere_2, or the cutoff if there is none
+};
+
+// Checks found for the spheres in one sector.
+// Sectors can be searched for checks on different threads at once, so each
+// keeps its own until they are gathered together in order of sector id.
+struct sector_checks_s {
+	struct partial_crossing_check_s *checks;
+	int64_t num_checks;
+	int64_t max_checks;
+};
+
+static struct sector_checks_s *sector_checks; // indexed by sector_1's id
+static struct partial_crossing_check_s *checks;
+static int64_t num_checks;
+static int64_t max_checks;
+static int64_t *check_order; // checks ordered by sector_2
+static int64_t *checks_per_sector;
+
+static void reserve_soonest_arrays(struct block_scratch_s *b, const int64_t n) {
+	if (n > b->max_soonest) {
+		b->max_soonest = n;
+		b->soonest_indices = realloc(b->soonest_indices, b->max_soonest * sizeof(int64_t));
+		b->soonest_times = realloc(b->soonest_times, b->max_soonest * sizeof(double));
+	}
 }
 
 // Given a sphere that is known to be heading towards the given sector
-// check if the sphere will collide with spheres in the sector.
+// record that it must be checked against the spheres in the sector.
+// The checks are done together by find_partial_crossing_checks.
+// Only a collision sooner than sector_1's current event can change either it or
+// the overall soonest event, so that is used as the check's cutoff.
 static void find_partial_crossing_events_between_sphere_and_sector(struct sector_s *sector_1, struct sphere_s *sphere_1, struct sector_s *sector_2) {
-	int j;
-	for (j = 0; j < sector_2->num_spheres; j++) {
-		struct sphere_s *sphere_2 = sector_2->spheres[j];
-		double time = find_collision_time_spheres(sphere_1, sphere_2);
-		set_event_details(time, COL_TWO_SPHERES_PARTIAL_CROSSING, sphere_1, sphere_2, AXIS_NONE, sector_1, sector_2);
+	struct sector_checks_s *l = &sector_checks[sector_1->id];
+	if (l->num_checks >= l->max_checks) {
+		l->max_checks = l->max_checks == 0 ? 16 : l->max_checks * 2;
+		l->checks = realloc(l->checks, l->max_checks * sizeof(struct partial_crossing_check_s));
 	}
+	struct partial_crossing_check_s *c = &l->checks[l->num_checks];
+	c->sector_1 = sector_1;
+	c->sphere_1 = sphere_1;
+	c->sector_2 = sector_2;
+	c->sphere_2 = NULL;
+	c->time = sector_events[sector_1->id].time - sim_data.elapsed_time;
+	l->num_checks++;
 }
 
-// Returns true if the sphere is within the minimum distance from an adjacent
-// sector to need partial crossing checks.
-static bool is_sphere_within_range_of_sector_one_axis(
-		const struct sphere_s *sphere, const union vector_3d new_pos, 
-		const struct sector_s *dest, const enum axis a, const enum direction dir
-	){
-	return
-		(dir == DIR_POSITIVE && new_pos.vals[a] >= dest->start.vals[a] - sphere->radius - dest->largest_radius) ||
-		(dir == DIR_NEGATIVE && new_pos.vals[a] <= dest->end.vals[a] + sphere->radius + dest->largest_radius);
+// Puts the checks found for each sector into one array, in order of sector id.
+static void gather_partial_crossing_checks() {
+	num_checks = 0;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		num_checks += sector_checks[i].num_checks;
+	}
+	if (num_checks > max_checks) {
+		max_checks = num_checks;
+		checks = realloc(checks, max_checks * sizeof(struct partial_crossing_check_s));
+		check_order = realloc(check_order, max_checks * sizeof(int64_t));
+	}
+	int64_t n = 0;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		struct sector_checks_s *l = &sector_checks[i];
+		memcpy(&checks[n], l->checks, l->num_checks * sizeof(struct partial_crossing_check_s));
+		n += l->num_checks;
+		l->num_checks = 0;
+	}
 }
 
-static bool is_sphere_within_range_of_sector_two_axis(
-		const struct sphere_s *sphere, const union vector_3d new_pos, 
-		const struct sector_s *dest, const enum axis a1, const enum axis a2,
-		const enum direction dir_1, const enum direction dir_2
-	){
-		return
-			is_sphere_within_range_of_sector_one_axis(sphere, new_pos, dest, a1, dir_1) &&
-			is_sphere_within_range_of_sector_one_axis(sphere, new_pos, dest, a2, dir_2);
+// Checks the spheres in checks[first..last) of check_order against the spheres
+// in sector_2, leaving out its resting spheres if "moving_only" is set.
+static void check_partial_crossings_against_sector(struct sector_s *sector_2, const int64_t first, const int64_t last, const bool moving_only) {
+	if (first == last) {
+		return;
+	}
+	struct block_scratch_s *b = &scratch[get_thread_num()];
+	clear_sphere_block(&b->block_b);
+	add_sector_spheres_to_block(&b->block_b, sector_2, sim_data.elapsed_time, moving_only);
+	clear_sphere_block(&b->block_a);
+	reserve_soonest_arrays(b, last - first);
+	int64_t i;
+	for (i = first; i < last; i++) {
+		add_sphere_to_block(&b->block_a, checks[check_order[i]].sphere_1);
+		b->soonest_times[i - first] = checks[check_order[i]].time;
+	}
+	int64_t num_skipped = find_soonest_collisions_between_blocks(&b->block_a, &b->block_b, b->soonest_indices, b->soonest_times);
+	#pragma omp atomic
+	stats.num_pair_tests_skipped += num_skipped;
+	for (i = first; i < last; i++) {
+		struct partial_crossing_check_s *c = &checks[check_order[i]];
+		if (b->soonest_indices[i - first] != -1) {
+			c->sphere_2 = b->block_b.spheres[b->soonest_indices[i - first]];
+			c->time = b->soonest_times[i - first];
+		}
+	}
 }
 
-static bool is_sphere_within_range_of_sector_three_axis(
-		const struct sphere_s *sphere, const union vector_3d new_pos, 
-		const struct sector_s *dest, const enum axis a1, const enum axis a2, const enum axis a3,
-		const enum direction dir_1, const enum direction dir_2, const enum direction dir_3
-	){
-		return
-			is_sphere_within_range_of_sector_one_axis(sphere, new_pos, dest, a1, dir_1) &&
-			is_sphere_within_range_of_sector_one_axis(sphere, new_pos, dest, a2, dir_2) &&
-			is_sphere_within_range_of_sector_one_axis(sphere, new_pos, dest, a3, dir_3);
+// Checks the spheres in checks[first..last) of check_order, which are all
+// heading towards the same sector, against the spheres in that sector.
+// Resting spheres are moved to the end of the range and only checked against
+// the moving spheres in the sector, if there are any.
+static void find_partial_crossing_checks_for_sector(const int64_t first, const int64_t last) {
+	struct sector_s *sector_2 = checks[check_order[first]].sector_2;
+	int64_t num_moving = first;
+	int64_t i;
+	for (i = first; i < last; i++) {
+		if (!is_sphere_resting(checks[check_order[i]].sphere_1)) {
+			int64_t temp = check_order[num_moving];
+			check_order[num_moving++] = check_order[i];
+			check_order[i] = temp;
+		}
+	}
+	check_partial_crossings_against_sector(sector_2, first, num_moving, false);
+	if (sector_2->num_resting < sector_2->num_spheres) {
+		check_partial_crossings_against_sector(sector_2, num_moving, last, true);
+	}
 }
 
-// Returns true if the sphere is heading towards the containing sector's 
-// boundary along the specified axis in the specified direction.
-static bool is_sphere_heading_towards_sector_one_axis(
-		const struct sphere_s *sphere, const struct sector_s *sector, 
-		const enum axis a, const enum direction dir
-	){
-	return
-		(dir == DIR_POSITIVE && sphere->vel.vals[a] >= 0.0 && sector->pos.vals[a] != sim_data.sector_dims[a] - 1) ||
-		(dir == DIR_NEGATIVE && sphere->vel.vals[a] <= 0.0 && sector->pos.vals[a] != 0);
+// Task for the checks heading towards the sector with id "index".
+// checks_per_sector holds the end of each sector's checks in check_order, and
+// so the start of the next sector's.
+static void run_partial_crossing_checks_task(void *arg, const int64_t index) {
+	(void)arg;
+	int64_t first = index == 0 ? 0 : checks_per_sector[index - 1];
+	if (first < checks_per_sector[index]) {
+		find_partial_crossing_checks_for_sector(first, checks_per_sector[index]);
+	}
 }
 
-static bool is_sphere_heading_towards_sector_two_axis(
-		const struct sphere_s *sphere, const struct sector_s *sector, 
-		const enum axis a1, const enum axis a2,
-		const enum direction dir_1, const enum direction dir_2
-	){
+// Groups the checks by the sector being moved towards so that each sector's
+// spheres are copied once and checked against all of the spheres heading
+// towards it at the same time.
+// Each group only changes its own checks, so each is a task. The events are
+// then set in the order the checks were found in.
+static void find_partial_crossing_checks() {
+	gather_partial_crossing_checks();
+	int64_t i;
+	for (i = 0; i <= sim_data.num_sectors; i++) {
+		checks_per_sector[i] = 0;
+	}
+	for (i = 0; i < num_checks; i++) {
+		checks_per_sector[checks[i].sector_2->id + 1]++;
+	}
+	for (i = 1; i <= sim_data.num_sectors; i++) {
+		checks_per_sector[i] += checks_per_sector[i - 1];
+	}
+	for (i = 0; i < num_checks; i++) {
+		check_order[checks_per_sector[checks[i].sector_2->id]++] = i;
+	}
+	run_tasks(run_partial_crossing_checks_task, NULL, sim_data.num_sectors);
+	for (i = 0; i < num_checks; i++) {
+		struct partial_crossing_check_s *c = &checks[i];
+		if (c->sphere_2 != NULL) {
+			set_event_details(c->time, COL_TWO_SPHERES_PARTIAL_CROSSING, c->sphere_1, c->sphere_2, AXIS_NONE, c->sector_1, c->sector_2);
+		}
+	}
+	num_checks = 0;
+}
+
+// Bit recording that a sphere could reach the sector beyond one side of its own.
+#define SIDE_BIT(a, dir) (1 << (((a) * 2) + (dir)))
+
+// Returns true if the sphere is heading towards the sector's boundary along the
+// specified axis in the specified direction, and there is a sector beyond it.
+static bool is_sphere_heading_towards_side(const struct sphere_s *sphere, const struct sector_s *sector, const enum axis a, const enum direction dir) {
 	return
-		is_sphere_heading_towards_sector_one_axis(sphere, sector, a1, dir_1) &&
-		is_sphere_heading_towards_sector_one_axis(sphere, sector, a2, dir_2);
+		(dir == DIR_POSITIVE && sphere->vel.vals[a] >= 0.0 && sector->neighbours[get_face_neighbour_index(a, dir)] != NULL) ||
+		(dir == DIR_NEGATIVE && sphere->vel.vals[a] <= 0.0 && sector->neighbours[get_face_neighbour_index(a, dir)] != NULL);
 }
 
-static bool is_sphere_heading_towards_sector_three_axis(
-		const struct sphere_s *sphere, const struct sector_s *sector, 
-		const enum axis a1, const enum axis a2, const enum axis a3,
-		const enum direction dir_1, const enum direction dir_2, const enum direction dir_3
+// Returns true if the sphere's projected position is close enough to a
+// sector beyond the given side, with the given largest radius, to need
+// partial crossing checks.
+static bool is_sphere_within_range_of_side(
+		const struct sphere_s *sphere, const union vector_3d new_pos, const struct sector_s *sector,
+		const enum axis a, const enum direction dir, const double largest_radius
 	){
 	return
-		is_sphere_heading_towards_sector_one_axis(sphere, sector, a1, dir_1) &&
-		is_sphere_heading_towards_sector_one_axis(sphere, sector, a2, dir_2) &&
-		is_sphere_heading_towards_sector_one_axis(sphere, sector, a3, dir_3);
+		(dir == DIR_POSITIVE && new_pos.vals[a] >= sector->neighbour_start.vals[a] - get_sphere_radius(sphere) - largest_radius) ||
+		(dir == DIR_NEGATIVE && new_pos.vals[a] <= sector->neighbour_end.vals[a] + get_sphere_radius(sphere) + largest_radius);
 }
 
-// Checks for partial crossings with sectors that are immediately adjacent to 
-// the left/right, top/bottom or front/back.
-static void find_partial_crossing_events_for_sector_directly_adjacent(struct sphere_s *sphere, struct sector_s *sector, const union vector_3d new_pos) {
+// Check which sectors the sphere is going towards.
+// If by the time of the current soonest event it is within a certain distance 
+// of any sector it is travelling towards we must check for partial crossings.
+// The sides of the sector the sphere could reach are found in one pass over its
+// axes, using "largest_radius" which is at least the largest radius of any
+// adjacent sector. Most spheres reach none and are done with. Otherwise each
+// adjacent sector beyond only sides it can reach is checked again exactly with
+// that sector's own largest radius, in the order of SECTOR_NEIGHBOUR_OFFSETS.
+static void find_partial_crossing_events_for_sphere(struct sector_s *sector, struct sphere_s *sphere, const double largest_radius) {
+	update_sphere_position_to_time(sphere, sim_data.elapsed_time);
+	union vector_3d new_pos;
+	new_pos.x = sphere->pos.x + (sphere->vel.x * event_details.time);
+	new_pos.y = sphere->pos.y + (sphere->vel.y * event_details.time);
+	new_pos.z = sphere->pos.z + (sphere->vel.z * event_details.time);
+	int sides = 0;
 	enum axis a;
 	enum direction dir;
-	for(dir = DIR_POSITIVE; dir <= DIR_NEGATIVE; dir++){
-		for (a = X_AXIS; a <= Z_AXIS; a++) {
-			if (is_sphere_heading_towards_sector_one_axis(sphere, sector, a, dir)) {
-				struct sector_s *sector_2 = get_sector_adjacent_on_axes(sector, a, AXIS_NONE, AXIS_NONE, dir, DIR_NONE, DIR_NONE);
-				if (is_sphere_within_range_of_sector_one_axis(sphere, new_pos, sector_2, a, dir)) {
-					find_partial_crossing_events_between_sphere_and_sector(sector, sphere, sector_2);
-				}
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		for (dir = DIR_POSITIVE; dir <= DIR_NEGATIVE; dir++) {
+			if (is_sphere_heading_towards_side(sphere, sector, a, dir) && is_sphere_within_range_of_side(sphere, new_pos, sector, a, dir, largest_radius)) {
+				sides |= SIDE_BIT(a, dir);
 			}
 		}
 	}
-}
-
-static void find_partial_crossing_events_for_sector_diagonally_adjacent_helper(
-		struct sphere_s *sphere, struct sector_s *sector, const union vector_3d new_pos, 
-		const enum axis a1, const enum axis a2, const enum direction dir_1, const enum direction dir_2
-	){
-	if(is_sphere_heading_towards_sector_two_axis(sphere, sector, a1, a2, dir_1, dir_2)){
-		struct sector_s *sector_2 = get_sector_adjacent_on_axes(sector, a1, a2, AXIS_NONE, dir_1, dir_2, DIR_NONE);
-		if(is_sphere_within_range_of_sector_two_axis(sphere, new_pos, sector_2, a1, a2, dir_1, dir_2)){
+	if (sides == 0) {
+		return;
+	}
+	int n;
+	for (n = 0; n < NUM_SECTOR_NEIGHBOURS; n++) {
+		struct sector_s *sector_2 = sector->neighbours[n];
+		if (sector_2 == NULL) {
+			continue;
+		}
+		bool in_range = true;
+		for (a = X_AXIS; a <= Z_AXIS && in_range; a++) {
+			int offset = SECTOR_NEIGHBOUR_OFFSETS[n][a];
+			if (offset != 0) {
+				dir = offset > 0 ? DIR_POSITIVE : DIR_NEGATIVE;
+				in_range = (sides & SIDE_BIT(a, dir)) && is_sphere_within_range_of_side(sphere, new_pos, sector, a, dir, sector_2->largest_radius);
+			}
+		}
+		if (in_range) {
 			find_partial_crossing_events_between_sphere_and_sector(sector, sphere, sector_2);
 		}
-	}	
+	}
 }
 
-// Checks for partial crossings with sectors that are diagonally adjacent along two axes.
-static void find_partial_crossing_events_for_sector_diagonally_adjacent(struct sphere_s *sphere, struct sector_s *sector, const union vector_3d new_pos) {
-	// x/y combinations
-	if (sim_data.xy_check_needed) {
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Y_AXIS, DIR_POSITIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Y_AXIS, DIR_POSITIVE, DIR_NEGATIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Y_AXIS, DIR_NEGATIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Y_AXIS, DIR_NEGATIVE, DIR_NEGATIVE);
-	}
-	// x/z combinations
-	if (sim_data.xz_check_needed) {
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Z_AXIS, DIR_POSITIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Z_AXIS, DIR_POSITIVE, DIR_NEGATIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Z_AXIS, DIR_NEGATIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, X_AXIS, Z_AXIS, DIR_NEGATIVE, DIR_NEGATIVE);
-	}
-	// y/z combinations
-	if (sim_data.yz_check_needed) {
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, Y_AXIS, Z_AXIS, DIR_POSITIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, Y_AXIS, Z_AXIS, DIR_POSITIVE, DIR_NEGATIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, Y_AXIS, Z_AXIS, DIR_NEGATIVE, DIR_POSITIVE);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_helper(sphere, sector, new_pos, Y_AXIS, Z_AXIS, DIR_NEGATIVE, DIR_NEGATIVE);
-	}
+// Number of layers of cells along a face of the sector that spheres within
+// "band_width" of the face can be in.
+// Spheres can be up to CELL_BOUNDARY_EPS of a cell's width outside of it, so
+// the band is widened by twice that.
+static int get_num_band_cells(const struct sector_s *sector, const enum axis a, const double band_width) {
+	int n = (int)ceil((band_width / sector->cell_size.vals[a]) + (2.0 * CELL_BOUNDARY_EPS));
+	return n < sector->cell_dims.vals[a] ? n : sector->cell_dims.vals[a];
 }
 
-// Checks for partial crossings with sectors that are diagonally adjacent along three axes.
-// Ex: if passed sector at [0][0][0] it will check [1][1][1].
-static void find_partial_crossing_events_for_sector_diagonally_adjacent_three_axes(struct sphere_s *sphere, struct sector_s *sector, const union vector_3d new_pos) {
-	if(!sim_data.xyz_check_needed){
+static bool is_cell_in_band(const int i, const int num_start, const int num_end, const int dims) {
+	return i < num_start || i >= dims - num_end;
+}
+
+// A sphere can only be in range of an adjacent sector when it is within its
+// own radius plus that sector's largest radius of the boundary between them.
+// Every sphere's event is no later than when it leaves its cell, so by the
+// time of the soonest event each sphere is still in the same cell.
+// The spheres that can be in range are therefore those in the layers of cells
+// along each face, edge and corner of the sector that borders another sector,
+// and only those cells are checked. Cells are kept up to date as spheres move
+// between them, so this is proportional to the number of spheres near the
+// sector's boundary rather than all of them.
+// "largest_radius" is the largest radius of any sector, so the band is that
+// plus the sector's own largest radius.
+// If the sector's cells need to be built again every sphere is checked.
+static void find_partial_crossing_events_for_sector(struct sector_s *sector, const double largest_radius) {
+	if (!sector->cells_valid) {
+		int64_t i;
+		for (i = 0; i < sector->num_spheres; i++) {
+			find_partial_crossing_events_for_sphere(sector, sector->spheres[i], largest_radius);
+		}
 		return;
 	}
-	enum direction dir_1, dir_2, dir_3;
-	for(dir_1 = DIR_POSITIVE; dir_1 <= DIR_NEGATIVE; dir_1++){
-		for(dir_2 = DIR_POSITIVE; dir_2 <= DIR_NEGATIVE; dir_2++){
-			for(dir_3 = DIR_POSITIVE; dir_3 <= DIR_NEGATIVE; dir_3++){
-				if (is_sphere_heading_towards_sector_three_axis(sphere, sector, X_AXIS, Y_AXIS, Z_AXIS, dir_1, dir_2, dir_3)) {
-					struct sector_s *sector_2 = get_sector_adjacent_on_axes(sector, X_AXIS, Y_AXIS, Z_AXIS, dir_1, dir_2, dir_3);
-					if (is_sphere_within_range_of_sector_three_axis(sphere, new_pos, sector_2, X_AXIS, Y_AXIS, Z_AXIS, dir_1, dir_2, dir_3)) {
-						find_partial_crossing_events_between_sphere_and_sector(sector, sphere, sector_2);
-					}
+	double band_width = sector->largest_radius + largest_radius;
+	int num_start[3];
+	int num_end[3];
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		int n = get_num_band_cells(sector, a, band_width);
+		num_start[a] = sector->pos.vals[a] > 0 ? n : 0;
+		num_end[a] = sector->pos.vals[a] < sim_data.sector_dims[a] - 1 ? n : 0;
+	}
+	int x, y, z;
+	for (x = 0; x < sector->cell_dims.x; x++) {
+		bool x_in_band = is_cell_in_band(x, num_start[X_AXIS], num_end[X_AXIS], sector->cell_dims.x);
+		for (y = 0; y < sector->cell_dims.y; y++) {
+			bool y_in_band = is_cell_in_band(y, num_start[Y_AXIS], num_end[Y_AXIS], sector->cell_dims.y);
+			for (z = 0; z < sector->cell_dims.z; z++) {
+				if (!x_in_band && !y_in_band && !is_cell_in_band(z, num_start[Z_AXIS], num_end[Z_AXIS], sector->cell_dims.z)) {
+					z = sector->cell_dims.z - num_end[Z_AXIS] - 1; // skip to the band on the far side
+					continue;
+				}
+				const struct cell_s *cell = &sector->cells[get_cell_index(sector, x, y, z)];
+				int64_t i;
+				for (i = 0; i < cell->num_spheres; i++) {
+					find_partial_crossing_events_for_sphere(sector, sector->spheres[cell->sphere_ids[i]], largest_radius);
 				}
 			}
 		}
 	}
 }
 
-// For each sphere check which sectors it is going towards.
-// If by the time of the current soonest event it is within a certain distance 
-// of any sector it is travelling towards we must check for partial crossings.
-static void find_partial_crossing_events_for_sector(struct sector_s *sector) {
-	int i;
-	for (i = 0; i < sector->num_spheres; i++) {
-		struct sphere_s *sphere = sector->spheres[i];
-		union vector_3d new_pos;
-		new_pos.x = sphere->pos.x + (sphere->vel.x * event_details.time);
-		new_pos.y = sphere->pos.y + (sphere->vel.y * event_details.time);
-		new_pos.z = sphere->pos.z + (sphere->vel.z * event_details.time);
-		find_partial_crossing_events_for_sector_directly_adjacent(sphere, sector, new_pos);
-		find_partial_crossing_events_for_sector_diagonally_adjacent(sphere, sector, new_pos);
-		find_partial_crossing_events_for_sector_diagonally_adjacent_three_axes(sphere, sector, new_pos);
-	}
-}
-
-// Finds when all spheres in a given sector will collide with other and returns
-// the soonest time.
-static void find_collision_times_between_spheres_in_sector(struct sector_s *sector) {
-	int i, j;
-	for (i = 0; i < sector->num_spheres - 1; i++) {
-		struct sphere_s *s1 = sector->spheres[i];
-		for (j = i + 1; j < sector->num_spheres; j++) {
-			struct sphere_s *s2 = sector->spheres[j];
-			double time = find_collision_time_spheres(s1, s2);
-			set_event_details(time, COL_TWO_SPHERES, s1, s2, AXIS_NONE, sector, NULL);
+// Finds the time when the center of the sphere will pass into another cell.
+// Cell boundaries that are also the sector's boundaries are skipped as those
+// are covered by sector transfers and grid collisions.
+double find_collision_time_cell(const struct sector_s *sector, const struct sphere_s *sphere) {
+	double time = DBL_MAX;
+	union vector_3i cell_pos = get_cell_pos(sector, sphere->cell_id);
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		if ((sphere->vel.vals[a] > 0.0 && cell_pos.vals[a] < sector->cell_dims.vals[a] - 1) || (sphere->vel.vals[a] < 0.0 && cell_pos.vals[a] > 0)) {
+			double cell_start = sector->start.vals[a] + (cell_pos.vals[a] * sector->cell_size.vals[a]);
+			double temp_time = find_time_to_cross_boundary(cell_start, cell_start + sector->cell_size.vals[a], sphere->vel.vals[a], sphere->pos.vals[a], 0.0);
+			if (temp_time < time) {
+				time = temp_time;
+			}
 		}
 	}
+	return time;
 }
 
-// Finds time to both collide with grid and to cross sector boundaries.
-// Can optimise further so that grid boundaries are not checked if another
-// sector will be entered first.
-static void find_collision_times_grid_boundary_for_sector(struct sector_s *sector) {
-	enum axis a = AXIS_NONE;
-	int i;
-	for (i = 0; i < sector->num_spheres; i++) {
-		struct sphere_s *sphere = sector->spheres[i];
-		double time = find_collision_time_grid(sphere, &a);
-		set_event_details(time, COL_SPHERE_WITH_GRID, sphere, NULL, a, sector, NULL);
-		struct sector_s *temp_dest = NULL;
-		time = find_collision_time_sector(sector, sphere, &temp_dest);
-		set_event_details(time, COL_SPHERE_WITH_SECTOR, sphere, NULL, AXIS_NONE, sector, temp_dest);
-	}
+// Task for the invalid sector at "index" in invalid_sector_ids.
+static void run_sector_event_task(void *arg, const int64_t index) {
+	(void)arg;
+	struct sector_s *s = &sim_data.sectors_flat[invalid_sector_ids[index]];
+	reset_sector_event(s->id);
+	find_event_times_from_sphere_events(s);
+	s->prior_time_valid = true;
 }
 
-// Given a sector finds the soonest occuring event.
-// The event will be either two spheres colliding, a sphere colliding with a grid
-// boundary, or a sphere passing into another sector.
-// Any partial crossings will be handled once this function has been called for each sector.
-static void find_event_times_for_sector(struct sector_s *sector) {
-	if (sector->num_spheres == 0) {
-		return;
-	}
-	find_collision_times_between_spheres_in_sector(sector);
-	find_collision_times_grid_boundary_for_sector(sector);
+static void run_partial_crossing_events_task(void *arg, const int64_t index) {
+	find_partial_crossing_events_for_sector(&sim_data.sectors_flat[index], *(double *)arg);
 }
 
-// Finds event times for each sector, excluding partial crossings
+// Finds event times for the sectors whose events are no longer valid, then
+// takes the soonest event out of all sectors from the tournament tree.
+// Partial crossings are then checked for every sector.
+// Sectors only change their own spheres and records while their events and
+// checks are found, so each sector is a task. Their events are merged in the
+// same order whatever the number of threads, so the event chosen does not
+// depend on it.
 void find_event_times_for_all_sectors() {
 	int i;
+	for(i = 0; i < num_invalid_sectors; i++){
+		struct sector_s *s = &sim_data.sectors_flat[invalid_sector_ids[i]];
+		s->time = sim_data.elapsed_time;
+		prepare_sphere_events(s);
+	}
+	run_tasks(run_sector_event_task, NULL, num_invalid_sectors);
+	for(i = 0; i < num_invalid_sectors; i++){
+		merge_sector_event(invalid_sector_ids[i]);
+	}
+	num_invalid_sectors = 0;
+	set_event_details_from_sector(get_soonest_sector_id());
+	double largest_radius = 0.0;
 	for(i = 0; i < sim_data.num_sectors; i++){
-		struct sector_s *s = &sim_data.sectors_flat[i];
-		if(s->prior_time_valid == false){
-			reset_sector_event(s->id);
-			find_event_times_for_sector(s);
-		} else {
-			set_event_details_from_sector(s->id);
-		}
-		find_partial_crossing_events_for_sector(s);
+		largest_radius = fmax(largest_radius, sim_data.sectors_flat[i].largest_radius);
 	}
+	run_tasks(run_partial_crossing_events_task, &largest_radius, sim_data.num_sectors);
+	find_partial_crossing_checks();
 }
 
 // Used to find the next event when domain decomposition is not used.
+// Every pair is checked so every sphere is brought up to date first.
+// The soonest collision with the grid is found first and used as the cutoff
+// for the pairs, so pairs too far apart to collide before it are skipped.
+// The cutoff is the next double after it so that a pair colliding at exactly
+// the same time is still found, and the event chosen is the same as without it.
 void find_event_times_no_dd() {
-	int i, j;
+	update_spheres();
+	struct block_scratch_s *b = &scratch[0];
+	double grid_time = DBL_MAX;
+	clear_sphere_block(&b->block_a);
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		enum axis a;
+		grid_time = fmin(grid_time, find_collision_time_grid(&sim_data.spheres[i], &a));
+		add_sphere_to_block(&b->block_a, &sim_data.spheres[i]);
+	}
+	reserve_soonest_arrays(b, b->block_a.num_spheres);
+	double cutoff = grid_time == DBL_MAX ? DBL_MAX : nextafter(grid_time, DBL_MAX);
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		b->soonest_times[i] = cutoff;
+	}
+	stats.num_pair_tests_skipped += find_soonest_collisions_between_blocks(&b->block_a, &b->block_a, b->soonest_indices, b->soonest_times);
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
 		struct sphere_s *s1 = &(sim_data.spheres[i]);
 		enum axis a;
 		double time = find_collision_time_grid(s1, &a);
 		set_event_details(time, COL_SPHERE_WITH_GRID, s1, NULL, a, NULL, NULL);
-		for (j = i + 1; j < sim_data.total_num_spheres; j++) {
-			struct sphere_s *s2 = &(sim_data.spheres[j]);
-			time = find_collision_time_spheres(s1, s2);
-			set_event_details(time, COL_TWO_SPHERES, s1, s2, AXIS_NONE, NULL, NULL);
+		if (b->soonest_indices[i] != -1) {
+			set_event_details(b->soonest_times[i], COL_TWO_SPHERES, s1, b->block_a.spheres[b->soonest_indices[i]], AXIS_NONE, NULL, NULL);
 		}
 	}
 }
+
+// Must be called after the number of threads and sectors are known.
+void init_collision_blocks() {
+	num_scratch = get_max_threads();
+	scratch = calloc(num_scratch, sizeof(struct block_scratch_s));
+	sector_checks = calloc(sim_data.num_sectors, sizeof(struct sector_checks_s));
+	checks_per_sector = malloc((sim_data.num_sectors + 1) * sizeof(int64_t));
+}
+
+void free_collision_blocks() {
+	int i;
+	for (i = 0; i < num_scratch; i++) {
+		free_sphere_block(&scratch[i].block_a);
+		free_sphere_block(&scratch[i].block_b);
+		free(scratch[i].soonest_indices);
+		free(scratch[i].soonest_times);
+	}
+	free(scratch);
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		free(sector_checks[i].checks);
+	}
+	free(sector_checks);
+	free(checks);
+	free(check_order);
+	free(checks_per_sector);
+	// So that the blocks can be set up again, as the tests do
+	checks = NULL;
+	check_order = NULL;
+	max_checks = 0;
+}
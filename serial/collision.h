@@ -4,10 +4,16 @@
 
 #include "sector.h"
 
+double find_collision_time_trig(const union vector_3d *rel_pos, const union vector_3d *rel_vel, const double r_total);
+double find_collision_time_spheres_trig(const struct sphere_s *s1, const struct sphere_s *s2);
+double find_collision_time_spheres_quadratic(const struct sphere_s *s1, const struct sphere_s *s2);
 double find_collision_time_spheres(const struct sphere_s *s1, const struct sphere_s *s2);
 double find_collision_time_grid(const struct sphere_s *s, enum axis *col_axis);
+double find_collision_time_cell(const struct sector_s *sector, const struct sphere_s *sphere);
 double find_collision_time_sector(const struct sector_s *sector, const struct sphere_s *sphere, struct sector_s **dest);
 void apply_bounce_between_spheres(struct sphere_s *s1, struct sphere_s *s2);
 void find_event_times_for_all_sectors();
 void find_partial_crossing_events_for_all_sectors();
 void find_event_times_no_dd();
+void init_collision_blocks();
+void free_collision_blocks();
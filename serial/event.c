@@ -6,75 +6,159 @@
 #include "sector.h"
 #include "simulation.h"
 #include "sphere.h"
+#include "sphere_events.h"
 
-static double increment_double_by_smallest_amount(double val){
-	void *p = &val;
-	int64_t *i = (int64_t *)p;
-	(*i)++;
-	return val;
-}
+// Tournament tree over sector_events.
+// Leaves are sector ids, and each internal node holds whichever of its two
+// children has the sooner event, so the root is the sector with the soonest
+// event. Changing a sector's event only replays the nodes on the path from its
+// leaf to the root. Node 1 is the root, and the children of node n are 2n and
+// 2n + 1. Leaves past the last sector hold -1.
+static int *sector_event_tree;
+static int num_tree_leaves; // smallest power of two >= number of sectors
 
-static const double eps = 0.0001;
+// Soonest event found for each sector while its event is being found again,
+// with the time until it happens as in event_details. See
+// set_event_details_for_sector().
+static struct event_s *sector_soonest_events;
 
-static void set_new_time(const int i){
-	if(sector_events[i].time != 0.0){
-		double t = sector_events[i].time - event_details.time;
-		if(t < eps){
-			sector_events[i].time = increment_double_by_smallest_amount(t);
-		} else {
-			sector_events[i].time = t;
-		}
+static int get_sooner_sector(const int a, const int b){
+	if(b == -1){
+		return a;
 	}
+	if(a == -1){
+		return b;
+	}
+	return sector_events[b].time < sector_events[a].time ? b : a;
 }
 
-static void set_valid_time_for_all_but_source(){
-	int i;
-	for(i = 0; i < sim_data.num_sectors; i++){
-		struct sector_s *s = &sim_data.sectors_flat[i];
-		if(event_details.source_sector->id == s->id){
-			s->prior_time_valid = false;
-		} else {
-			s->prior_time_valid = true;
-			set_new_time(i);
-		}
+static void update_sector_event_tree(const int id){
+	int node = (num_tree_leaves + id) / 2;
+	while(node >= 1){
+		sector_event_tree[node] = get_sooner_sector(sector_event_tree[2 * node], sector_event_tree[(2 * node) + 1]);
+		node = node / 2;
 	}
 }
 
-static void set_valid_time_for_all_but_source_and_dest(){
+void init_sector_event_tree(){
+	num_tree_leaves = 1;
+	while(num_tree_leaves < sim_data.num_sectors){
+		num_tree_leaves = num_tree_leaves * 2;
+	}
+	sector_event_tree = malloc(2 * num_tree_leaves * sizeof(int));
 	int i;
-	for(i = 0; i < sim_data.num_sectors; i++){
-		struct sector_s *s = &sim_data.sectors_flat[i];
-		if(event_details.source_sector->id == s->id || event_details.dest_sector->id == s->id){
-			s->prior_time_valid = false;
-		} else {
-			s->prior_time_valid = true;
-			set_new_time(i);
-		}
+	for(i = 0; i < num_tree_leaves; i++){
+		sector_event_tree[num_tree_leaves + i] = i < sim_data.num_sectors ? i : -1;
+	}
+	for(i = num_tree_leaves - 1; i >= 1; i--){
+		sector_event_tree[i] = get_sooner_sector(sector_event_tree[2 * i], sector_event_tree[(2 * i) + 1]);
+	}
+	sector_soonest_events = malloc(sim_data.num_sectors * sizeof(struct event_s));
+}
+
+void free_sector_event_tree(){
+	free(sector_event_tree);
+	free(sector_soonest_events);
+}
+
+int get_soonest_sector_id(){
+	return sector_event_tree[1];
+}
+
+// Cached sector events hold absolute simulation times, so the events of the
+// sectors not involved are still correct and need no changes.
+// A sector is only added once however many times it is invalidated.
+void invalidate_sector(struct sector_s *s){
+	if(!s->prior_time_valid){
+		return;
+	}
+	s->prior_time_valid = false;
+	invalid_sector_ids[num_invalid_sectors] = s->id;
+	num_invalid_sectors++;
+}
+
+static void invalidate_source_sector(){
+	invalidate_sector(event_details.source_sector);
+}
+
+static void invalidate_source_and_dest_sectors(){
+	invalidate_sector(event_details.source_sector);
+	invalidate_sector(event_details.dest_sector);
+}
+
+// Spheres are only moved when needed, so bring the spheres involved in the
+// event up to the time it happens at before applying it.
+static void update_event_spheres(){
+	if(event_details.sphere_1 == NULL){
+		return;
+	}
+	double t = sim_data.elapsed_time + event_details.time;
+	update_sphere_position_to_time(event_details.sphere_1, t);
+	if(event_details.sphere_2 != NULL){
+		update_sphere_position_to_time(event_details.sphere_2, t);
+	}
+}
+
+// Applies an event that only changes spheres in its source sector: a collision
+// with the grid, a collision between two of its spheres or a sphere crossing
+// into another cell. The spheres must have been brought up to the time it
+// happens at. Used for the sectors' own events in a lookahead window too, see
+// window.c, so nothing outside the sector is changed.
+void apply_sector_event(const struct event_s *e){
+	if (e->type == COL_SPHERE_WITH_GRID) {
+		e->sphere_1->vel.vals[e->grid_axis] *= -1.0;
+		set_sector_sphere_data(e->source_sector, e->sphere_1);
+		invalidate_events_involving_sphere(e->sphere_1);
+	} else if (e->type == COL_TWO_SPHERES) {
+		apply_bounce_between_spheres(e->sphere_1, e->sphere_2);
+		set_sector_sphere_data(e->source_sector, e->sphere_1);
+		set_sector_sphere_data(e->source_sector, e->sphere_2);
+		update_max_speed(e->source_sector, e->sphere_1);
+		update_max_speed(e->source_sector, e->sphere_2);
+		invalidate_events_involving_sphere(e->sphere_1);
+		invalidate_events_involving_sphere(e->sphere_2);
+	} else if (e->type == COL_SPHERE_WITH_CELL) {
+		// The sphere is unchanged, but it now has different neighbours.
+		move_sphere_to_correct_cell(e->source_sector, e->sphere_1);
+		invalidate_sphere_event(e->sphere_1);
 	}
 }
 
 void apply_event_dd(){
+	update_event_spheres();
 	if (event_details.type == COL_SPHERE_WITH_GRID) {
-		event_details.sphere_1->vel.vals[event_details.grid_axis] *= -1.0;
+		apply_sector_event(&event_details);
 		stats.num_grid_collisions++;
-		set_valid_time_for_all_but_source();
+		invalidate_source_sector();
 	} else if (event_details.type == COL_TWO_SPHERES) {
-		apply_bounce_between_spheres(event_details.sphere_1, event_details.sphere_2);
+		apply_sector_event(&event_details);
 		stats.num_two_sphere_collisions++;
-		set_valid_time_for_all_but_source();
+		invalidate_source_sector();
 	} else if (event_details.type == COL_SPHERE_WITH_SECTOR) {
 		remove_sphere_from_sector(event_details.source_sector, event_details.sphere_1);
 		add_sphere_to_sector(event_details.dest_sector, event_details.sphere_1);
+		invalidate_events_involving_sphere(event_details.sphere_1);
 		stats.num_sector_transfers++;
-		set_valid_time_for_all_but_source_and_dest();
+		invalidate_source_and_dest_sectors();
 	} else if(event_details.type == COL_TWO_SPHERES_PARTIAL_CROSSING){
 		apply_bounce_between_spheres(event_details.sphere_1, event_details.sphere_2);
+		set_sector_sphere_data(event_details.source_sector, event_details.sphere_1);
+		set_sector_sphere_data(event_details.dest_sector, event_details.sphere_2);
+		update_max_speed(event_details.source_sector, event_details.sphere_1);
+		update_max_speed(event_details.dest_sector, event_details.sphere_2);
+		invalidate_events_involving_sphere(event_details.sphere_1);
+		invalidate_events_involving_sphere(event_details.sphere_2);
 		stats.num_partial_crossings++;
-		set_valid_time_for_all_but_source_and_dest();
+		invalidate_source_and_dest_sectors();
+	} else if (event_details.type == COL_SPHERE_WITH_CELL) {
+		apply_sector_event(&event_details);
+		stats.num_cell_crossings++;
+		invalidate_source_sector();
 	}
 }
 
 void apply_event_no_dd(){
+	update_event_spheres();
 	if (event_details.type == COL_SPHERE_WITH_GRID) {
 		event_details.sphere_1->vel.vals[event_details.grid_axis] *= -1.0;
 		stats.num_grid_collisions++;
@@ -85,24 +169,40 @@ void apply_event_no_dd(){
 }
 
 
+static void clear_event(struct event_s *e){
+	e->time = DBL_MAX;
+	e->sphere_1 = NULL;
+	e->sphere_2 = NULL;
+	e->source_sector = NULL;
+	e->dest_sector = NULL;
+	e->type = COL_NONE;
+	e->grid_axis = AXIS_NONE;
+}
+
 void reset_event(){
-	event_details.time = DBL_MAX;
-	event_details.sphere_1 = NULL;
-	event_details.sphere_2 = NULL;
-	event_details.source_sector = NULL;
-	event_details.dest_sector = NULL;
-	event_details.type = COL_NONE;
-	event_details.grid_axis = AXIS_NONE;
+	clear_event(&event_details);
 }
 
+// Clears the sector's event before it is found again with
+// set_event_details_for_sector(). The tournament tree is left until
+// merge_sector_event() so that different sectors can be reset at once.
 void reset_sector_event(int i){
-	sector_events[i].time = DBL_MAX;
-	sector_events[i].sphere_1 = NULL;
-	sector_events[i].sphere_2 = NULL;
-	sector_events[i].source_sector = NULL;
-	sector_events[i].dest_sector = NULL;
-	sector_events[i].type = COL_NONE;
-	sector_events[i].grid_axis = AXIS_NONE;
+	clear_event(&sector_events[i]);
+	clear_event(&sector_soonest_events[i]);
+}
+
+static void write_event(
+	struct event_s *e, const double time, const enum event_type type, struct sphere_s *sphere_1,
+	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
+	struct sector_s *dest_sector
+){
+	e->time = time;
+	e->type = type;
+	e->sphere_1 = sphere_1;
+	e->sphere_2 = sphere_2;
+	e->grid_axis = grid_axis;
+	e->source_sector = source_sector;
+	e->dest_sector = dest_sector;
 }
 
 static void set_event_details_normal(
@@ -110,13 +210,7 @@ static void set_event_details_normal(
 	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
 	struct sector_s *dest_sector
 ){
-	event_details.time = time;
-	event_details.type = type;
-	event_details.sphere_1 = sphere_1;
-	event_details.sphere_2 = sphere_2;
-	event_details.grid_axis = grid_axis;
-	event_details.source_sector = source_sector;
-	event_details.dest_sector = dest_sector;
+	write_event(&event_details, time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
 }
 
 static void set_sector_event_details(
@@ -125,23 +219,21 @@ static void set_sector_event_details(
 	struct sector_s *dest_sector
 ){
 	int i = source_sector->id;
-	sector_events[i].time = time;
-	sector_events[i].type = type;
-	sector_events[i].sphere_1 = sphere_1;
-	sector_events[i].sphere_2 = sphere_2;
-	sector_events[i].grid_axis = grid_axis;
-	sector_events[i].source_sector = source_sector;
-	sector_events[i].dest_sector = dest_sector;
+	write_event(&sector_events[i], time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
+	update_sector_event_tree(i);
 }
 
 void set_event_details_from_sector(int id){
 	struct event_s *e = &sector_events[id];
-	if(e->time < event_details.time){
-		set_event_details_normal(e->time, e->type, e->sphere_1, e->sphere_2, e->grid_axis, e->source_sector, e->dest_sector);
+	double time = e->time - sim_data.elapsed_time;
+	if(time < event_details.time){
+		set_event_details_normal(time, e->type, e->sphere_1, e->sphere_2, e->grid_axis, e->source_sector, e->dest_sector);
 	}
 }
 // Set overall soonest time if needed.
 // Also set soonest time for the specific sector.
+// "time" is the time until the event happens, but the sector's event is stored
+// with the absolute simulation time it happens at.
 void set_event_details(
 	const double time, const enum event_type type, struct sphere_s *sphere_1, 
 	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
@@ -150,12 +242,45 @@ void set_event_details(
 	if(time < event_details.time){
 		set_event_details_normal(time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
 	}
-	if(sim_data.num_sectors > 1){
+	if(sim_data.uses_sectors){
 		int i = source_sector->id;
-		if(time < sector_events[i].time){
-			set_sector_event_details(time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
+		double sim_time = sim_data.elapsed_time + time;
+		if(sim_time < sector_events[i].time){
+			set_sector_event_details(sim_time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
 		}
 	}
 
 }
 
+// Same as set_event_details() but only the source sector's own records are
+// changed, so this can be used for different sectors on different threads at
+// once. The soonest event found for the sector is kept with the time until it
+// happens, and is only compared with event_details by merge_sector_event().
+// "time" is from the sector's own time, which is the same as the simulation's
+// apart from in a lookahead window.
+void set_event_details_for_sector(
+	const double time, const enum event_type type, struct sphere_s *sphere_1,
+	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
+	struct sector_s *dest_sector
+){
+	int i = source_sector->id;
+	if(time < sector_soonest_events[i].time){
+		write_event(&sector_soonest_events[i], time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
+	}
+	double sim_time = source_sector->time + time;
+	if(sim_time < sector_events[i].time){
+		write_event(&sector_events[i], sim_time, type, sphere_1, sphere_2, grid_axis, source_sector, dest_sector);
+	}
+}
+
+// Brings the tournament tree and event_details up to date with a sector's
+// event found by set_event_details_for_sector().
+// If this is done for the sectors in the order they were found in then
+// event_details ends up the same as if set_event_details() had been used.
+void merge_sector_event(int i){
+	update_sector_event_tree(i);
+	struct event_s *e = &sector_soonest_events[i];
+	if(e->time < event_details.time){
+		set_event_details_normal(e->time, e->type, e->sphere_1, e->sphere_2, e->grid_axis, e->source_sector, e->dest_sector);
+	}
+}
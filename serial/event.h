@@ -4,7 +4,7 @@
 #include "vector_3.h"
 
 struct event_s {
-	double time; // When the event happens
+	double time; // Time until the event happens. Cached sector events hold the absolute simulation time instead.
 	enum event_type type; // What the next event is.
 	struct sphere_s *sphere_1; // Sphere that hits the grid, transfers to another sector, or is the first sphere in a sphere on sphere collision.
 	struct sphere_s *sphere_2; // Second sphere in a sphere on sphere collision, otherwise NULL
@@ -16,14 +16,25 @@ struct event_s {
 
 struct event_s event_details;
 
+void invalidate_sector(struct sector_s *s);
+void apply_sector_event(const struct event_s *e);
 void apply_event_dd();
 void apply_event_no_dd();
 void reset_event();
 void reset_sector_event(int i);
+void init_sector_event_tree();
+void free_sector_event_tree();
+int get_soonest_sector_id();
 void set_event_details_from_sector(int id);
 void set_event_details(
 	const double time, const enum event_type type, struct sphere_s *sphere_1, 
 	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
 	struct sector_s *dest_sector
 );
+void set_event_details_for_sector(
+	const double time, const enum event_type type, struct sphere_s *sphere_1,
+	struct sphere_s *sphere_2, const enum axis grid_axis, struct sector_s *source_sector,
+	struct sector_s *dest_sector
+);
+void merge_sector_event(int i);
 
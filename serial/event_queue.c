@@ -0,0 +1,191 @@
+#include <float.h>
+#include <stdlib.h>
+
+#include "collision.h"
+#include "event.h"
+#include "event_queue.h"
+#include "pair_kernel.h"
+#include "simulation.h"
+#include "sphere.h"
+
+// Priority queue used to schedule events when domain decomposition is not used.
+// Each sphere has one entry holding its soonest predicted event, and the
+// entries are kept in a binary min heap ordered by the time of that event.
+// Times in the queue are absolute simulation times rather than the time until
+// the event, so entries do not need to be changed as the simulation advances.
+// An entry becomes stale if its partner takes part in a later event, as the
+// partner's velocity will have changed. This is detected by recording the
+// partner's collision count when the event is predicted.
+struct queue_entry_s {
+	double time; // Simulation time the event happens at
+	enum event_type type;
+	struct sphere_s *sphere_1; // Sphere the entry belongs to
+	struct sphere_s *sphere_2; // Partner in a sphere on sphere collision, otherwise NULL
+	uint32_t sphere_2_count; // Partner's collision count when the event was predicted
+	enum axis grid_axis;
+};
+
+static struct queue_entry_s *entries; // indexed the same as sim_data.spheres
+static int64_t *heap; // entry indices ordered as a binary heap
+static int64_t *heap_pos; // position of each entry in the heap
+static struct sphere_block_s block; // every sphere but the one being predicted
+
+static void swap_heap_nodes(const int64_t a, const int64_t b) {
+	int64_t temp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = temp;
+	heap_pos[heap[a]] = a;
+	heap_pos[heap[b]] = b;
+}
+
+static void sift_up(int64_t pos) {
+	while (pos > 0) {
+		int64_t parent = (pos - 1) / 2;
+		if (entries[heap[pos]].time >= entries[heap[parent]].time) {
+			return;
+		}
+		swap_heap_nodes(pos, parent);
+		pos = parent;
+	}
+}
+
+static void sift_down(int64_t pos) {
+	while (1) {
+		int64_t left = (2 * pos) + 1;
+		int64_t right = left + 1;
+		int64_t smallest = pos;
+		if (left < sim_data.total_num_spheres && entries[heap[left]].time < entries[heap[smallest]].time) {
+			smallest = left;
+		}
+		if (right < sim_data.total_num_spheres && entries[heap[right]].time < entries[heap[smallest]].time) {
+			smallest = right;
+		}
+		if (smallest == pos) {
+			return;
+		}
+		swap_heap_nodes(pos, smallest);
+		pos = smallest;
+	}
+}
+
+// Finds the soonest event for a single sphere by checking it against the grid
+// and every other sphere, or only the moving ones if it is resting.
+// "time" is the current simulation time, and each sphere is brought up to it
+// before being checked.
+static void predict_event_for_sphere(const int64_t i, const double time) {
+	struct queue_entry_s *e = &entries[i];
+	struct sphere_s *s1 = &sim_data.spheres[i];
+	update_sphere_position_to_time(s1, time);
+	enum axis a;
+	double soonest = find_collision_time_grid(s1, &a);
+	e->type = COL_SPHERE_WITH_GRID;
+	e->sphere_2 = NULL;
+	e->grid_axis = a;
+	clear_sphere_block(&block);
+	bool moving_only = is_sphere_resting(s1);
+	int64_t j;
+	for (j = 0; j < sim_data.total_num_spheres; j++) {
+		struct sphere_s *s2 = &sim_data.spheres[j];
+		if (j == i || (moving_only && is_sphere_resting(s2))) {
+			continue;
+		}
+		update_sphere_position_to_time(s2, time);
+		add_sphere_to_block(&block, s2);
+	}
+	double t;
+	j = find_soonest_collision_in_block(s1, &block, 0, &t);
+	if (t < soonest) {
+		soonest = t;
+		e->type = COL_TWO_SPHERES;
+		e->sphere_2 = block.spheres[j];
+		e->sphere_2_count = e->sphere_2->collision_count;
+		e->grid_axis = AXIS_NONE;
+	}
+	if (soonest == DBL_MAX) {
+		e->time = DBL_MAX;
+		e->type = COL_NONE;
+	} else {
+		e->time = time + soonest;
+	}
+}
+
+static void reschedule_sphere(const struct sphere_s *s, const double time) {
+	int64_t i = s - sim_data.spheres;
+	predict_event_for_sphere(i, time);
+	sift_up(heap_pos[i]);
+	sift_down(heap_pos[i]);
+}
+
+// Predicts the first event for every sphere and builds the heap.
+// This is O(N^2) but only happens once.
+void init_event_queue() {
+	entries = calloc(sim_data.total_num_spheres, sizeof(struct queue_entry_s));
+	heap = calloc(sim_data.total_num_spheres, sizeof(int64_t));
+	heap_pos = calloc(sim_data.total_num_spheres, sizeof(int64_t));
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		entries[i].sphere_1 = &sim_data.spheres[i];
+		predict_event_for_sphere(i, sim_data.elapsed_time);
+		heap[i] = i;
+		heap_pos[i] = i;
+	}
+	for (i = (sim_data.total_num_spheres / 2) - 1; i >= 0; i--) {
+		sift_down(i);
+	}
+}
+
+void free_event_queue() {
+	free(entries);
+	free(heap);
+	free(heap_pos);
+	free_sphere_block(&block);
+}
+
+// Sets event_details to the soonest event that is still valid.
+// Any stale entries found at the top of the heap are predicted again from the
+// current time, which may move them further down the heap.
+void find_event_time_from_queue() {
+	struct queue_entry_s *e = &entries[heap[0]];
+	while (e->sphere_2 != NULL && e->sphere_2->collision_count != e->sphere_2_count) {
+		reschedule_sphere(e->sphere_1, sim_data.elapsed_time);
+		e = &entries[heap[0]];
+	}
+	if (e->time == DBL_MAX) {
+		return; // nothing will happen, so leave event_details reset
+	}
+	set_event_details(e->time - sim_data.elapsed_time, e->type, e->sphere_1, e->sphere_2, e->grid_axis, NULL, NULL);
+}
+
+// Should be called once the event in event_details has been applied.
+// "time" is the simulation time the event happened at.
+// The spheres involved have new velocities so their collision counts are
+// incremented, which marks any entries that predicted an event with them as stale.
+// Only the entries of the spheres involved are then predicted again.
+void update_event_queue(const double time) {
+	if (event_details.sphere_1 == NULL) {
+		return;
+	}
+	event_details.sphere_1->collision_count++;
+	if (event_details.sphere_2 != NULL) {
+		event_details.sphere_2->collision_count++;
+	}
+	reschedule_sphere(event_details.sphere_1, time);
+	if (event_details.sphere_2 != NULL) {
+		reschedule_sphere(event_details.sphere_2, time);
+	}
+}
+
+// Checks every entry is no sooner than its parent in the heap and is where
+// heap_pos says it is. Used by the tests.
+bool is_event_queue_ordered() {
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		if (heap_pos[heap[i]] != i) {
+			return false;
+		}
+		if (i > 0 && entries[heap[i]].time < entries[heap[(i - 1) / 2]].time) {
+			return false;
+		}
+	}
+	return true;
+}
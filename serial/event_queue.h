@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+void init_event_queue();
+void free_event_queue();
+void find_event_time_from_queue();
+void update_event_queue(const double time);
+bool is_event_queue_ordered();
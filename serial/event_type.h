@@ -3,6 +3,7 @@ enum event_type {
 	COL_SPHERE_WITH_GRID = 1,
 	COL_SPHERE_WITH_SECTOR = 2,
 	COL_TWO_SPHERES_PARTIAL_CROSSING = 3,
+	COL_SPHERE_WITH_CELL = 4, // Sphere moves into another cell in its sector, nothing about it changes
 	COL_NONE = -1
 };
 
@@ -10,7 +10,8 @@ static FILE *data_file;
 
 // Saves a sphere to the file
 static void save_sphere_to_file(struct sphere_s *s) {
-	fwrite(&s->id, sizeof(int64_t), 1, data_file);
+	int64_t id = s->id;
+	fwrite(&id, sizeof(int64_t), 1, data_file);
 	fwrite(&s->vel.x, sizeof(double), 1, data_file);
 	fwrite(&s->vel.y, sizeof(double), 1, data_file);
 	fwrite(&s->vel.z, sizeof(double), 1, data_file);
@@ -31,10 +32,21 @@ static void save_sphere_initial_state_to_file() {
 	fwrite(&sim_data.total_num_spheres, sizeof(uint64_t), 1, data_file);
 	int i;
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
-		save_sphere_to_file(&sim_data.spheres[i]);
+		save_sphere_to_file(sim_data.spheres_by_id[i]);
 	}
 }
 
+// Writes the event just applied as the next iteration, unless it was a sphere
+// crossing into another cell. That changes no sphere, so it is left out and the
+// output is the same however sectors are divided into cells.
+void save_event_to_file(){
+	if (event_details.type == COL_SPHERE_WITH_CELL) {
+		return;
+	}
+	save_sphere_state_to_file(sim_data.iteration_number, sim_data.elapsed_time);
+	sim_data.iteration_number++;
+}
+
 // First writes the current iteration number as well as the simulation timestamp.
 // Then writes the number of changed spheres to the file, followed by the data for each changed sphere.
 void save_sphere_state_to_file(uint64_t iteration_num, double time_elapsed) {
@@ -64,8 +76,10 @@ void init_binary_file() {
 	fwrite(&sim_data.total_num_spheres, sizeof(int64_t), 1, data_file);
 	int64_t i;
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
-		fwrite(&sim_data.spheres[i].radius, sizeof(double), 1, data_file);
-		fwrite(&sim_data.spheres[i].mass, sizeof(double), 1, data_file);
+		double radius = get_sphere_radius(sim_data.spheres_by_id[i]);
+		double mass = get_sphere_mass(sim_data.spheres_by_id[i]);
+		fwrite(&radius, sizeof(double), 1, data_file);
+		fwrite(&mass, sizeof(double), 1, data_file);
 	}
 	save_sphere_initial_state_to_file();
 }
@@ -80,12 +94,13 @@ void write_final_state(){
 	fwrite(&sim_data.total_num_spheres, sizeof(int64_t), 1, fp);
 	int64_t i;
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
-		fwrite(&sim_data.spheres[i].vel.x, sizeof(double), 1, fp);
-		fwrite(&sim_data.spheres[i].vel.y, sizeof(double), 1, fp);
-		fwrite(&sim_data.spheres[i].vel.z, sizeof(double), 1, fp);
-		fwrite(&sim_data.spheres[i].pos.x, sizeof(double), 1, fp);
-		fwrite(&sim_data.spheres[i].pos.y, sizeof(double), 1, fp);
-		fwrite(&sim_data.spheres[i].pos.z, sizeof(double), 1, fp);
+		struct sphere_s *s = sim_data.spheres_by_id[i];
+		fwrite(&s->vel.x, sizeof(double), 1, fp);
+		fwrite(&s->vel.y, sizeof(double), 1, fp);
+		fwrite(&s->vel.z, sizeof(double), 1, fp);
+		fwrite(&s->pos.x, sizeof(double), 1, fp);
+		fwrite(&s->pos.y, sizeof(double), 1, fp);
+		fwrite(&s->pos.z, sizeof(double), 1, fp);
 	}
 	fclose(fp);
 }
@@ -4,21 +4,35 @@
 #include <string.h>
 #include <time.h>
 
+#include "pair_kernel.h"
 #include "params.h"
 #include "simulation.h"
+#include "tasks.h"
+#include "threads.h"
+#include "window.h"
 
 static void run() {
 	simulation_init();
-	clock_t start = clock();
+	// Wall clock time, as clock() adds up the time of every thread.
+	double start = get_wall_time();
 	simulation_run();
-	clock_t end = clock();
-	float seconds = (float)(end - start) / CLOCKS_PER_SEC;
+	double end = get_wall_time();
+	float seconds = (float)(end - start);
 	printf("Time taken in seconds: %f\n", seconds);
+	printf("Pair kernel used: %s\n", get_pair_kernel_name());
 	printf("Number of sphere on sphere collisions: %d\n", stats.num_two_sphere_collisions);
 	printf("Number of collisions with grid boundary: %d\n", stats.num_grid_collisions);
-	if(sim_data.num_sectors > 1){
+	printf("Number of pair tests skipped: %ld\n", stats.num_pair_tests_skipped);
+	if(sim_data.uses_sectors){
 		printf("Number of transfers between sectors: %d\n", stats.num_sector_transfers);
 		printf("Number of partial crossings: %d\n", stats.num_partial_crossings);
+		printf("Number of cell crossings: %d\n", stats.num_cell_crossings);
+	}
+	if(sim_data.uses_windows){
+		print_window_stats();
+	}
+	if(sim_data.num_threads > 1){
+		print_task_stats();
 	}
 	simulation_cleanup();
 }
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+
+#include "morton.h"
+
+// Morton (Z-order) codes interleave the bits of the x, y and z coordinates.
+// Points that are close together mostly end up with codes that are close
+// together, so storing things in the order of their codes keeps things that
+// are near each other in space near each other in memory.
+
+// Spreads the low MORTON_BITS_PER_AXIS bits of v out so there are two zero
+// bits between each of them.
+static uint64_t spread_bits(uint64_t v) {
+	v &= (1ULL << MORTON_BITS_PER_AXIS) - 1;
+	v = (v | (v << 32)) & 0x1F00000000FFFFULL;
+	v = (v | (v << 16)) & 0x1F0000FF0000FFULL;
+	v = (v | (v << 8)) & 0x100F00F00F00F00FULL;
+	v = (v | (v << 4)) & 0x10C30C30C30C30C3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
+
+uint64_t get_morton_code(const union vector_3i *pos) {
+	return spread_bits((uint32_t)pos->x) | (spread_bits((uint32_t)pos->y) << 1) | (spread_bits((uint32_t)pos->z) << 2);
+}
+
+// Code for a position inside a box running from the origin to "size".
+// Positions are clamped to the box first.
+uint64_t get_morton_code_for_position(const union vector_3d *pos, const union vector_3d *size) {
+	const double max = (double)((1 << MORTON_BITS_PER_AXIS) - 1);
+	union vector_3i scaled;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		double v = (pos->vals[a] / size->vals[a]) * max;
+		if (v < 0.0) {
+			v = 0.0;
+		} else if (v > max) {
+			v = max;
+		}
+		scaled.vals[a] = (int32_t)v;
+	}
+	return get_morton_code(&scaled);
+}
+
+// Ties are broken by index so the order does not depend on the sort used.
+static int compare_morton_keys(const void *a, const void *b) {
+	const struct morton_key_s *ka = a;
+	const struct morton_key_s *kb = b;
+	if (ka->code != kb->code) {
+		return ka->code < kb->code ? -1 : 1;
+	}
+	if (ka->index != kb->index) {
+		return ka->index < kb->index ? -1 : 1;
+	}
+	return 0;
+}
+
+void sort_morton_keys(struct morton_key_s *keys, const int64_t num_keys) {
+	qsort(keys, num_keys, sizeof(struct morton_key_s), compare_morton_keys);
+}
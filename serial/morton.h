@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "vector_3.h"
+
+// Number of bits of each coordinate used in a Morton code, so that the three
+// interleaved coordinates fit in 64 bits.
+#define MORTON_BITS_PER_AXIS 21
+
+// Something to be sorted into Morton order, with "index" used to find it again
+// once the keys are sorted.
+struct morton_key_s {
+	uint64_t code;
+	int64_t index;
+};
+
+uint64_t get_morton_code(const union vector_3i *pos);
+uint64_t get_morton_code_for_position(const union vector_3d *pos, const union vector_3d *size);
+void sort_morton_keys(struct morton_key_s *keys, const int64_t num_keys);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sphere.h"
+#include "vector_3.h"
+
+// Number of spheres in each tile when checking one block against another.
+// A tile of each block takes 56 bytes per sphere, so the two fit in L1 cache.
+#define PAIR_TILE_SIZE 256
+// Relative margin added to the distance spheres could cover before a pair is
+// ruled out without being checked, to cover rounding in the bounds.
+#define PAIR_PRUNE_MARGIN 1e-9
+
+// A block of spheres with their positions, velocities and radii held in
+// separate arrays so that one sphere can be checked against several at once.
+// "spheres" maps each index in the block back to the sphere it was copied from.
+struct sphere_block_s {
+	struct sphere_s **spheres;
+	double *pos_x;
+	double *pos_y;
+	double *pos_z;
+	double *vel_x;
+	double *vel_y;
+	double *vel_z;
+	double *radius;
+	int64_t num_spheres;
+	int64_t max_spheres;
+};
+
+void init_pair_kernel();
+const char *get_pair_kernel_name();
+void clear_sphere_block(struct sphere_block_s *block);
+void reserve_sphere_block(struct sphere_block_s *block, const int64_t num);
+void add_sphere_to_block(struct sphere_block_s *block, struct sphere_s *s);
+void free_sphere_block(struct sphere_block_s *block);
+int64_t find_soonest_collision_in_block(const struct sphere_s *s, const struct sphere_block_s *block, const int64_t start, double *time);
+int64_t find_soonest_collisions_between_blocks(const struct sphere_block_s *a, const struct sphere_block_s *b, int64_t *indices, double *times);
+bool can_collide_within(const double dist_squared, const double radius, const double speed, const double time);
+double get_distance_squared_to_box(const union vector_3d *pos, const union vector_3d *min, const union vector_3d *max);
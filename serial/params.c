@@ -5,6 +5,7 @@
 #include "params.h"
 #include "sector.h"
 #include "simulation.h"
+#include "threads.h"
 
 void run_tests(); // defined in tests.c
 
@@ -17,6 +18,12 @@ static void set_default_params(){
 	sim_data.sector_dims[2] = 1;
 	sim_data.time_limit = 0.0;
 	sim_data.event_limit = 0;
+	sim_data.uses_event_queue = false;
+	sim_data.checks_all_pairs = false;
+	sim_data.uses_morton_order = false;
+	sim_data.uses_windows = false;
+	sim_data.uses_optimistic_windows = false;
+	sim_data.num_threads = 1;
 	initial_state_file = NULL;
 	final_state_file = NULL;
 	compare_file = NULL;
@@ -48,6 +55,24 @@ static void print_config(){
 	} else {
 		printf("Compare file not set\n");
 	}
+	if(sim_data.uses_event_queue){
+		printf("Event queue is set.\nEvents will be scheduled using a priority queue.\n");
+	} else if(sim_data.checks_all_pairs){
+		printf("All pairs is set.\nAll pairs of spheres will be checked after each event.\n");
+	} else {
+		printf("Event queue is NOT set.\nEach sector will only check spheres in neighbouring cells after each event.\n");
+	}
+	if(sim_data.uses_morton_order){
+		printf("Morton order is set.\nSpheres will be stored in Morton order of their positions.\n");
+	} else {
+		printf("Morton order is NOT set.\nSpheres will be stored in the order they are loaded.\n");
+	}
+	if(sim_data.uses_optimistic_windows){
+		printf("Optimistic lookahead windows are set.\nSectors will run through their own events up to a speculative horizon on their own, and roll back those after the first straggler.\n");
+	} else if(sim_data.uses_windows){
+		printf("Lookahead windows are set.\nSectors will run through their own events up to a horizon on their own.\n");
+	}
+	printf("Number of threads: %d\n", sim_data.num_threads);
 }
 
 static void validate_args(){
@@ -74,6 +99,27 @@ static void validate_args(){
 		printf("Error: initial state file (-i) cannot be null\n");
 		exit(1);
 	}
+	int num_sectors = sim_data.sector_dims[X_AXIS] * sim_data.sector_dims[Y_AXIS] * sim_data.sector_dims[Z_AXIS];
+	if(sim_data.uses_event_queue && num_sectors > 1){
+		printf("Error: event queue (-q) can only be used with a single sector\n");
+		exit(1);
+	}
+	if(sim_data.checks_all_pairs && (num_sectors > 1 || sim_data.uses_event_queue)){
+		printf("Error: checking all pairs (-a) can only be used with a single sector and without the event queue (-q)\n");
+		exit(1);
+	}
+	if(sim_data.uses_windows && num_sectors == 1){
+		printf("Error: lookahead windows (-w, -W) need more than one sector\n");
+		exit(1);
+	}
+	if(sim_data.num_threads <= 0){
+		printf("Error: number of threads should be > 0\n");
+		exit(1);
+	}
+	if(sim_data.num_threads > 1 && !has_thread_support()){
+		printf("Error: more than one thread (-n) needs a build with OpenMP\n");
+		exit(1);
+	}
 }
 	
 static void print_help(){
@@ -85,6 +131,12 @@ static void print_help(){
 	printf("-i:\n\tRequired.\n\tSets the initial state file.\n");
 	printf("-l:\n\tOptional, but -e is required if -l is unused.\n\tSets the time limit the simulation will run for.\n");
 	printf("-e:\n\tOptional, but -l is required if -e is unused.\n\tSets the event limit the simulation will run for.\n");
+	printf("-q:\n\tOptional.\n\tSchedules events using a priority queue, so only spheres involved in an event are checked again.\n\tCan only be used with a single sector.\n");
+	printf("-a:\n\tOptional.\n\tChecks every pair of spheres after each event, without sectors or cells, as the original engine did.\n\tWithout it a single sector run is treated as one sector with its own cells, like any other decomposition.\n\tCan only be used with a single sector and without -q.\n");
+	printf("-m:\n\tOptional.\n\tStores spheres in Morton order of their positions, so spheres near each other are near each other in memory.\n\tSectors also sort their cells in Morton order, and sort their spheres again as the spheres move between cells.\n\tOutput is still written in order of sphere id.\n");
+	printf("-n:\n\tOptional.\n\tSets the number of threads used to find events. Defaults to 1.\n\tThe sectors are shared out between the threads, or with -a the pairs of spheres are.\n\tThe events found are the same for any number of threads.\n");
+	printf("-w:\n\tOptional.\n\tRuns sectors ahead on their own in lookahead windows, up to a horizon before which no sphere can reach a sphere in another sector.\n\tThe sectors in a window are shared out between the threads.\n\tEvents are still written out in time order, but as sectors keep their own time the results can differ from running without -w by rounding.\n\tNeeds more than one sector.\n");
+	printf("-W:\n\tOptional.\n\tAs -w, but sectors run ahead speculatively rather than up to a horizon that is certain.\n\tEvents after the first time spheres of different sectors touch, or a sphere that crossed into another sector touches another, are rolled back and found again one at a time.\n\tHow far sectors run ahead grows after a window with nothing rolled back and shrinks after one with.\n\tNeeds more than one sector.\n");
 	printf("-t:\n\tOptional.\n\tRuns some tests which verify the collision system works.\t\nIf set then all other work is skipped and other args are ignored.\n");
 	exit(0);
 }
@@ -92,7 +144,7 @@ static void print_help(){
 void parse_args(int argc, char *argv[]) {
 	set_default_params();
 	int c;
-	while((c = getopt(argc, argv, "i:c:f:ho:x:y:z:l:te:")) != -1) {
+	while((c = getopt(argc, argv, "i:c:f:ho:x:y:z:l:qamn:te:wW")) != -1) {
 		switch(c) {
 		case 'x':
 			sim_data.sector_dims[X_AXIS] = atoi(optarg);
@@ -123,10 +175,29 @@ void parse_args(int argc, char *argv[]) {
 			sim_data.uses_time_limit = true;
 			uses_time = true;
 			break;
+		case 'q':
+			sim_data.uses_event_queue = true;
+			break;
+		case 'a':
+			sim_data.checks_all_pairs = true;
+			break;
+		case 'm':
+			sim_data.uses_morton_order = true;
+			break;
+		case 'n':
+			sim_data.num_threads = atoi(optarg);
+			break;
 		case 't':
 			run_tests();
 			exit(0);
 			break;
+		case 'w':
+			sim_data.uses_windows = true;
+			break;
+		case 'W':
+			sim_data.uses_windows = true;
+			sim_data.uses_optimistic_windows = true;
+			break;
 		case 'e':
 			sim_data.event_limit = atoi(optarg);
 			sim_data.uses_time_limit = false;
@@ -1,92 +1,617 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "morton.h"
 #include "sector.h"
 #include "simulation.h"
 #include "sphere.h"
+#include "threads.h"
+#include "vector_3.h"
 
-// Used when iterating over axes and nned to access sector adjacent on the current axis.
-const int SECTOR_MODIFIERS[3][4][3] = {
-	{ // DIR_POSITIVE
-		{ 1, 0, 0 }, // x
-		{ 0, 1, 0 }, // y
-		{ 0, 0, 1 }, // z
-		{ 0, 0, 0 }, // used for AXIS_NONE, when no change is desired
-	},
-	{ // DIR_NEGATIVE
-		{ -1, 0, 0 }, // x
-		{ 0, -1, 0 }, // y
-		{ 0, 0, -1 }, // z
-		{ 0, 0, 0 }, // used for AXIS_NONE, when no change is desired
-	},
-	{ // DIR_NONE, when no change is desired
-		{ 0, 0, 0 }, // x
-		{ 0, 0, 0 }, // y
-		{ 0, 0, 0 }, // z
-		{ 0, 0, 0 }, // used for AXIS_NONE, when no change is desired
-	}
+// Faces first, then edges along z, y and x, then corners, each with the
+// positive direction before the negative on the first axis that differs.
+const int SECTOR_NEIGHBOUR_OFFSETS[NUM_SECTOR_NEIGHBOURS][3] = {
+	{ 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 },
+	{ -1, 0, 0 }, { 0, -1, 0 }, { 0, 0, -1 },
+	{ 1, 1, 0 }, { 1, -1, 0 }, { -1, 1, 0 }, { -1, -1, 0 },
+	{ 1, 0, 1 }, { 1, 0, -1 }, { -1, 0, 1 }, { -1, 0, -1 },
+	{ 0, 1, 1 }, { 0, 1, -1 }, { 0, -1, 1 }, { 0, -1, -1 },
+	{ 1, 1, 1 }, { 1, 1, -1 }, { 1, -1, 1 }, { 1, -1, -1 },
+	{ -1, 1, 1 }, { -1, 1, -1 }, { -1, -1, 1 }, { -1, -1, -1 }
 };
 
+// The sector keeps a count of how many spheres have each distinct radius, so
+// the largest radius is still known exactly after the largest sphere leaves.
+// The counts form a max-heap ordered by radius, so the largest radius is always
+// the first entry, and an open addressing table maps each radius to its entry.
+// Adding or removing a sphere whose radius is already in the sector only
+// changes a count. A radius appearing in or disappearing from the sector moves
+// O(log k) entries for k distinct radii, so inputs where nearly every sphere
+// has its own radius cost no more than the heap's depth.
+
+static uint64_t hash_radius(const double radius) {
+	uint64_t h;
+	memcpy(&h, &radius, sizeof(uint64_t));
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int64_t get_radius_home_slot(const struct sector_s *sector, const double radius) {
+	return (int64_t)(hash_radius(radius) & (uint64_t)(sector->num_radius_slots - 1));
+}
+
+// Finds the slot holding the radius, or the empty slot where it would go.
+static int64_t find_radius_slot(const struct sector_s *sector, const double radius) {
+	int64_t mask = sector->num_radius_slots - 1;
+	int64_t slot = get_radius_home_slot(sector, radius);
+	while (sector->radius_slots[slot] != -1 && sector->radii[sector->radius_slots[slot]].radius != radius) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Slots are kept at twice the capacity of the heap so the table is at most half full.
+static void resize_radii(struct sector_s *sector, const int64_t max_radii) {
+	sector->radii = realloc(sector->radii, max_radii * sizeof(struct radius_count_s));
+	sector->max_radii = max_radii;
+	sector->num_radius_slots = max_radii * 2;
+	free(sector->radius_slots);
+	sector->radius_slots = malloc(sector->num_radius_slots * sizeof(int64_t));
+	memset(sector->radius_slots, -1, sector->num_radius_slots * sizeof(int64_t));
+	int64_t i;
+	for (i = 0; i < sector->num_radii; i++) {
+		int64_t slot = find_radius_slot(sector, sector->radii[i].radius);
+		sector->radius_slots[slot] = i;
+		sector->radii[i].slot = slot;
+	}
+}
+
+static void set_radius_entry(struct sector_s *sector, const int64_t i, const struct radius_count_s *entry) {
+	sector->radii[i] = *entry;
+	sector->radius_slots[entry->slot] = i;
+}
+
+static void sift_radius_up(struct sector_s *sector, int64_t i) {
+	struct radius_count_s entry = sector->radii[i];
+	while (i > 0 && sector->radii[(i - 1) / 2].radius < entry.radius) {
+		set_radius_entry(sector, i, &sector->radii[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	set_radius_entry(sector, i, &entry);
+}
+
+static void sift_radius_down(struct sector_s *sector, int64_t i) {
+	struct radius_count_s entry = sector->radii[i];
+	while (1) {
+		int64_t child = (2 * i) + 1;
+		if (child >= sector->num_radii) {
+			break;
+		}
+		if (child + 1 < sector->num_radii && sector->radii[child + 1].radius > sector->radii[child].radius) {
+			child++;
+		}
+		if (sector->radii[child].radius <= entry.radius) {
+			break;
+		}
+		set_radius_entry(sector, i, &sector->radii[child]);
+		i = child;
+	}
+	set_radius_entry(sector, i, &entry);
+}
+
+// Empties the slot, moving back any later slots in the same run that would no
+// longer be found from their home slot.
+static void remove_radius_slot(struct sector_s *sector, int64_t slot) {
+	int64_t mask = sector->num_radius_slots - 1;
+	int64_t next = slot;
+	while (1) {
+		sector->radius_slots[slot] = -1;
+		while (1) {
+			next = (next + 1) & mask;
+			if (sector->radius_slots[next] == -1) {
+				return;
+			}
+			int64_t home = get_radius_home_slot(sector, sector->radii[sector->radius_slots[next]].radius);
+			// Moves back unless its home lies cyclically between the empty slot and it
+			bool stays = slot <= next ? (slot < home && home <= next) : (slot < home || home <= next);
+			if (!stays) {
+				break;
+			}
+		}
+		sector->radius_slots[slot] = sector->radius_slots[next];
+		sector->radii[sector->radius_slots[slot]].slot = slot;
+		slot = next;
+	}
+}
+
 static void set_largest_radius_after_insertion(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sphere->radius == sector->largest_radius) {
-		sector->largest_radius_shared = true; // Quicker to just set it rather than check if already set
-		sector->num_largest_radius_shared++;
-	} else if (sphere->radius > sector->largest_radius) {
-		sector->largest_radius = sphere->radius;
+	double radius = get_sphere_radius(sphere);
+	if (sector->num_radii >= sector->max_radii) {
+		resize_radii(sector, sector->max_radii == 0 ? 4 : sector->max_radii * 2);
+	}
+	int64_t slot = find_radius_slot(sector, radius);
+	if (sector->radius_slots[slot] != -1) {
+		sector->radii[sector->radius_slots[slot]].count++;
+		return;
+	}
+	struct radius_count_s *entry = &sector->radii[sector->num_radii];
+	entry->radius = radius;
+	entry->count = 1;
+	entry->slot = slot;
+	sector->radius_slots[slot] = sector->num_radii;
+	sector->num_radii++;
+	sift_radius_up(sector, sector->num_radii - 1);
+	sector->largest_radius = sector->radii[0].radius;
+}
+
+static double get_speed(const struct sphere_s *sphere) {
+	return get_vector_3d_magnitude(&sphere->vel);
+}
+
+// Should be called whenever a sphere's velocity changes.
+void update_max_speed(struct sector_s *sector, const struct sphere_s *sphere) {
+	double speed = get_speed(sphere);
+	if (speed > sector->max_speed) {
+		sector->max_speed = speed;
+	}
+}
+
+// Index in sector_s.neighbours of the sector sharing a face in the given direction.
+int get_face_neighbour_index(const enum axis a, const enum direction dir) {
+	return (dir * 3) + a;
+}
+
+int64_t get_cell_index(const struct sector_s *sector, const int x, const int y, const int z) {
+	return ((int64_t)x * sector->cell_dims.y * sector->cell_dims.z) + ((int64_t)y * sector->cell_dims.z) + z;
+}
+
+// Inverse of get_cell_index().
+union vector_3i get_cell_pos(const struct sector_s *sector, const int64_t cell_id) {
+	union vector_3i pos;
+	pos.x = cell_id / ((int64_t)sector->cell_dims.y * sector->cell_dims.z);
+	pos.y = (cell_id / sector->cell_dims.z) % sector->cell_dims.y;
+	pos.z = cell_id % sector->cell_dims.z;
+	return pos;
+}
+
+// Chooses how many cells the sector is split into on each axis.
+// Cells are never narrower than CELL_MIN_WIDTH_RADII times the largest radius
+// or CELL_MIN_WIDTH_MEAN_FREE_PATHS times the mean free path, and are made wide
+// enough that each has around CELL_TARGET_NUM_SPHERES in it.
+// A sector with only a handful of spheres will end up as a single cell.
+static void set_cell_dims(struct sector_s *sector) {
+	union vector_3d size;
+	size.x = sector->end.x - sector->start.x;
+	size.y = sector->end.y - sector->start.y;
+	size.z = sector->end.z - sector->start.z;
+	double volume = size.x * size.y * size.z;
+	double diameter = 2.0 * sector->largest_radius;
+	double mean_free_path = volume / (sqrt(2.0) * 3.14159265358979323846 * diameter * diameter * sector->num_spheres);
+	double width = cbrt((volume * CELL_TARGET_NUM_SPHERES) / sector->num_spheres);
+	if (width < CELL_MIN_WIDTH_MEAN_FREE_PATHS * mean_free_path) {
+		width = CELL_MIN_WIDTH_MEAN_FREE_PATHS * mean_free_path;
+	}
+	if (width < CELL_MIN_WIDTH_RADII * sector->largest_radius) {
+		width = CELL_MIN_WIDTH_RADII * sector->largest_radius;
+	}
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		int dims = (int)(size.vals[a] / width);
+		if (dims < 1) {
+			dims = 1;
+		}
+		sector->cell_dims.vals[a] = dims;
+		sector->cell_size.vals[a] = size.vals[a] / dims;
+	}
+}
+
+// Spheres in cells that are not adjacent can only be ignored if the cells are
+// at least as wide as the largest sphere's diameter.
+static bool are_cells_wide_enough(const struct sector_s *sector) {
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		if (sector->cell_dims.vals[a] > 1 && sector->cell_size.vals[a] < 2.0 * sector->largest_radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void alloc_cells(struct sector_s *sector, const int64_t num_cells) {
+	if (num_cells <= sector->max_cells) {
+		return;
+	}
+	sector->cells = realloc(sector->cells, num_cells * sizeof(struct cell_s));
+	int64_t i;
+	for (i = sector->max_cells; i < num_cells; i++) {
+		sector->cells[i].sphere_ids = NULL;
+		sector->cells[i].num_spheres = 0;
+		sector->cells[i].max_spheres = 0;
+	}
+	sector->max_cells = num_cells;
+}
+
+static void add_sphere_to_cell(struct sector_s *sector, struct sphere_s *sphere, const int64_t cell_id) {
+	struct cell_s *cell = &sector->cells[cell_id];
+	if (cell->num_spheres >= cell->max_spheres) {
+		cell->max_spheres = cell->max_spheres == 0 ? 8 : cell->max_spheres * 2;
+		cell->sphere_ids = realloc(cell->sphere_ids, cell->max_spheres * sizeof(int64_t));
+	}
+	cell->sphere_ids[cell->num_spheres] = sphere->sector_id;
+	sphere->cell_id = cell_id;
+	sphere->cell_slot = cell->num_spheres;
+	cell->num_spheres++;
+}
+
+// Order of spheres within a cell does not matter, so the last sphere in the
+// cell is moved into the removed sphere's slot.
+static void remove_sphere_from_cell(struct sector_s *sector, const struct sphere_s *sphere) {
+	struct cell_s *cell = &sector->cells[sphere->cell_id];
+	cell->num_spheres--;
+	if (sphere->cell_slot != cell->num_spheres) {
+		cell->sphere_ids[sphere->cell_slot] = cell->sphere_ids[cell->num_spheres];
+		sector->spheres[cell->sphere_ids[sphere->cell_slot]]->cell_slot = sphere->cell_slot;
+	}
+}
+
+// Finds which cell the sphere is in along one axis.
+// A sphere sitting on the boundary between two cells is put in the cell it is
+// moving towards, otherwise the time until it leaves its cell could be zero
+// and it would never get past the boundary.
+static int find_cell_on_axis(const struct sector_s *sector, const struct sphere_s *sphere, const enum axis a) {
+	double offset = (sphere->pos.vals[a] - sector->start.vals[a]) / sector->cell_size.vals[a];
+	int cell = (int)floor(offset);
+	double frac = offset - cell;
+	if (sphere->vel.vals[a] > 0.0 && frac > 1.0 - CELL_BOUNDARY_EPS) {
+		cell++;
+	} else if (sphere->vel.vals[a] < 0.0 && frac < CELL_BOUNDARY_EPS) {
+		cell--;
+	}
+	// Spheres may be very slightly outside of the sector due to precision issues
+	if (cell < 0) {
+		cell = 0;
+	} else if (cell >= sector->cell_dims.vals[a]) {
+		cell = sector->cell_dims.vals[a] - 1;
+	}
+	return cell;
+}
+
+static int64_t find_cell_for_sphere(const struct sector_s *sector, const struct sphere_s *sphere) {
+	return get_cell_index(sector, find_cell_on_axis(sector, sphere, X_AXIS), find_cell_on_axis(sector, sphere, Y_AXIS), find_cell_on_axis(sector, sphere, Z_AXIS));
+}
+
+// Scratch space used to sort a sector's spheres by cell, one for each thread
+// as sectors running ahead in a lookahead window may sort their spheres on
+// different threads at once.
+struct sort_scratch_s {
+	int64_t *sphere_cells;
+	int64_t *sorted_cells;
+	struct sphere_s **sorted_spheres;
+	int64_t max_sorted_spheres;
+	int64_t *cell_starts;
+	int64_t max_cell_starts;
+	struct morton_key_s *cell_keys;
+	int64_t max_cell_keys;
+};
+
+static struct sort_scratch_s *sort_scratch;
+
+static struct sort_scratch_s *get_sort_scratch() {
+	return &sort_scratch[get_thread_num()];
+}
+
+static void reserve_sort_arrays(struct sort_scratch_s *b, const int64_t num_spheres, const int64_t num_cells) {
+	if (num_spheres > b->max_sorted_spheres) {
+		b->max_sorted_spheres = num_spheres;
+		b->sphere_cells = realloc(b->sphere_cells, b->max_sorted_spheres * sizeof(int64_t));
+		b->sorted_cells = realloc(b->sorted_cells, b->max_sorted_spheres * sizeof(int64_t));
+		b->sorted_spheres = realloc(b->sorted_spheres, b->max_sorted_spheres * sizeof(struct sphere_s *));
+	}
+	if (num_cells + 1 > b->max_cell_starts) {
+		b->max_cell_starts = num_cells + 1;
+		b->cell_starts = realloc(b->cell_starts, b->max_cell_starts * sizeof(int64_t));
+	}
+}
+
+// Sets the position of each cell in the order the spheres are sorted into.
+// This is the order of the cell ids, or the Morton order of the cells'
+// positions if that is used so that cells next to each other on any axis are
+// usually close together in the sector's data.
+// Only needs to be done again when the number of cells on an axis changes.
+static void set_cell_order(struct sector_s *sector, const int64_t num_cells) {
+	if (sector->cell_order != NULL && sector->cell_order_dims.x == sector->cell_dims.x
+		&& sector->cell_order_dims.y == sector->cell_dims.y && sector->cell_order_dims.z == sector->cell_dims.z) {
+		return;
+	}
+	sector->cell_order = realloc(sector->cell_order, num_cells * sizeof(int64_t));
+	sector->cell_order_dims = sector->cell_dims;
+	int64_t i;
+	if (!sim_data.uses_morton_order) {
+		for (i = 0; i < num_cells; i++) {
+			sector->cell_order[i] = i;
+		}
+		return;
+	}
+	struct sort_scratch_s *b = get_sort_scratch();
+	if (num_cells > b->max_cell_keys) {
+		b->max_cell_keys = num_cells;
+		b->cell_keys = realloc(b->cell_keys, b->max_cell_keys * sizeof(struct morton_key_s));
+	}
+	for (i = 0; i < num_cells; i++) {
+		union vector_3i cell_pos = get_cell_pos(sector, i);
+		b->cell_keys[i].code = get_morton_code(&cell_pos);
+		b->cell_keys[i].index = i;
+	}
+	sort_morton_keys(b->cell_keys, num_cells);
+	for (i = 0; i < num_cells; i++) {
+		sector->cell_order[b->cell_keys[i].index] = i;
+	}
+}
+
+// Sorts the sector's spheres by cell with a counting sort, given the cell each
+// sphere belongs in, and gives them new sector ids in that order. The cells are
+// then filled in the same order, so the spheres in each cell are next to each
+// other in the sector's data.
+static void sort_spheres_into_cells(struct sort_scratch_s *b, struct sector_s *sector, const int64_t num_cells) {
+	int64_t *cell_starts = b->cell_starts;
+	int64_t i;
+	for (i = 0; i <= num_cells; i++) {
+		cell_starts[i] = 0;
+	}
+	for (i = 0; i < sector->num_spheres; i++) {
+		cell_starts[sector->cell_order[b->sphere_cells[i]] + 1]++;
+	}
+	for (i = 0; i < num_cells; i++) {
+		cell_starts[i + 1] += cell_starts[i];
+		sector->cells[i].num_spheres = 0;
+	}
+	for (i = 0; i < sector->num_spheres; i++) {
+		int64_t j = cell_starts[sector->cell_order[b->sphere_cells[i]]]++;
+		b->sorted_spheres[j] = sector->spheres[i];
+		b->sorted_cells[j] = b->sphere_cells[i];
+	}
+	for (i = 0; i < sector->num_spheres; i++) {
+		struct sphere_s *sphere = b->sorted_spheres[i];
+		sector->spheres[i] = sphere;
+		sphere->sector_id = i;
+		set_sector_sphere_data(sector, sphere);
+		add_sphere_to_cell(sector, sphere, b->sorted_cells[i]);
+	}
+	sector->num_cell_moves = 0;
+}
+
+// Sorts the sector's spheres again without changing which cell they are in.
+// Nothing refers to a sphere by its sector id between events, so this does not
+// change any predictions.
+static void resort_spheres_in_cells(struct sector_s *sector) {
+	int64_t num_cells = (int64_t)sector->cell_dims.x * sector->cell_dims.y * sector->cell_dims.z;
+	struct sort_scratch_s *b = get_sort_scratch();
+	reserve_sort_arrays(b, sector->num_spheres, num_cells);
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		b->sphere_cells[i] = sector->spheres[i]->cell_id;
+	}
+	sort_spheres_into_cells(b, sector, num_cells);
+}
+
+// Called when a sphere crosses into another cell.
+// The sphere must have been brought up to the time it crosses.
+// With Morton order the spheres are sorted again once as many spheres have
+// moved cells as there are in the sector, so they stay close to their
+// neighbours in memory as the simulation goes on.
+void move_sphere_to_correct_cell(struct sector_s *sector, struct sphere_s *sphere) {
+	if (!sector->cells_valid) {
+		return;
+	}
+	remove_sphere_from_cell(sector, sphere);
+	add_sphere_to_cell(sector, sphere, find_cell_for_sphere(sector, sphere));
+	sector->num_cell_moves++;
+	if (sim_data.uses_morton_order && sector->num_cell_moves >= sector->num_spheres) {
+		resort_spheres_in_cells(sector);
+	}
+}
+
+// Places every sphere in the sector into a cell.
+// The spheres are sorted by cell as they are placed, see sort_spheres_into_cells().
+// The spheres must have been brought up to the current time first.
+void build_cells_for_sector(struct sector_s *sector) {
+	set_cell_dims(sector);
+	int64_t num_cells = (int64_t)sector->cell_dims.x * sector->cell_dims.y * sector->cell_dims.z;
+	alloc_cells(sector, num_cells);
+	set_cell_order(sector, num_cells);
+	struct sort_scratch_s *b = get_sort_scratch();
+	reserve_sort_arrays(b, sector->num_spheres, num_cells);
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		b->sphere_cells[i] = find_cell_for_sphere(sector, sector->spheres[i]);
+	}
+	sort_spheres_into_cells(b, sector, num_cells);
+	sector->max_speed = 0.0;
+	for (i = 0; i < sector->num_spheres; i++) {
+		update_max_speed(sector, sector->spheres[i]);
+	}
+	sector->cells_valid = true;
+	sector->cells_num_spheres = sector->num_spheres;
+}
+
+static void resize_sphere_arrays(struct sector_s *sector, const int64_t max_spheres) {
+	struct sector_sphere_data_s *d = &sector->data;
+	sector->max_spheres = max_spheres;
+	sector->spheres = realloc(sector->spheres, max_spheres * sizeof(struct sphere_s *));
+	d->pos_x = realloc(d->pos_x, max_spheres * sizeof(double));
+	d->pos_y = realloc(d->pos_y, max_spheres * sizeof(double));
+	d->pos_z = realloc(d->pos_z, max_spheres * sizeof(double));
+	d->vel_x = realloc(d->vel_x, max_spheres * sizeof(double));
+	d->vel_y = realloc(d->vel_y, max_spheres * sizeof(double));
+	d->vel_z = realloc(d->vel_z, max_spheres * sizeof(double));
+	d->radius = realloc(d->radius, max_spheres * sizeof(double));
+	d->time = realloc(d->time, max_spheres * sizeof(double));
+}
+
+static bool is_sector_sphere_resting(const struct sector_s *sector, const int64_t i) {
+	const struct sector_sphere_data_s *d = &sector->data;
+	return d->vel_x[i] == 0.0 && d->vel_y[i] == 0.0 && d->vel_z[i] == 0.0;
+}
+
+static void write_sector_sphere_data(struct sector_s *sector, const struct sphere_s *sphere) {
+	struct sector_sphere_data_s *d = &sector->data;
+	int64_t i = sphere->sector_id;
+	d->pos_x[i] = sphere->pos.x;
+	d->pos_y[i] = sphere->pos.y;
+	d->pos_z[i] = sphere->pos.z;
+	d->vel_x[i] = sphere->vel.x;
+	d->vel_y[i] = sphere->vel.y;
+	d->vel_z[i] = sphere->vel.z;
+	d->radius[i] = get_sphere_radius(sphere);
+	d->time[i] = sphere->time;
+}
+
+// Copies the sphere into its entry in the sector's data.
+// Must be called whenever the sphere's velocity changes.
+void set_sector_sphere_data(struct sector_s *sector, const struct sphere_s *sphere) {
+	if (is_sector_sphere_resting(sector, sphere->sector_id)) {
+		sector->num_resting--;
+	}
+	write_sector_sphere_data(sector, sphere);
+	if (is_sphere_resting(sphere)) {
+		sector->num_resting++;
+	}
+}
+
+static void move_sphere_data(struct sector_s *sector, const int64_t from, const int64_t to) {
+	struct sector_sphere_data_s *d = &sector->data;
+	d->pos_x[to] = d->pos_x[from];
+	d->pos_y[to] = d->pos_y[from];
+	d->pos_z[to] = d->pos_z[from];
+	d->vel_x[to] = d->vel_x[from];
+	d->vel_y[to] = d->vel_y[from];
+	d->vel_z[to] = d->vel_z[from];
+	d->radius[to] = d->radius[from];
+	d->time[to] = d->time[from];
+}
+
+// Copies a sphere from the sector's data into the block, with its position
+// brought forward to time "t" in the same way as update_sphere_position().
+// The sphere itself is left as it is.
+static void add_sector_sphere_to_block(struct sphere_block_s *block, const struct sector_s *sector, const int64_t i, const double t) {
+	const struct sector_sphere_data_s *d = &sector->data;
+	int64_t j = block->num_spheres;
+	double dt = t - d->time[i];
+	block->spheres[j] = sector->spheres[i];
+	block->pos_x[j] = d->pos_x[i] + (d->vel_x[i] * dt);
+	block->pos_y[j] = d->pos_y[i] + (d->vel_y[i] * dt);
+	block->pos_z[j] = d->pos_z[i] + (d->vel_z[i] * dt);
+	block->vel_x[j] = d->vel_x[i];
+	block->vel_y[j] = d->vel_y[i];
+	block->vel_z[j] = d->vel_z[i];
+	block->radius[j] = d->radius[i];
+	block->num_spheres++;
+}
+
+// Copies every sphere in the sector into the block, at time "t".
+// If "moving_only" is set resting spheres are left out, for when the spheres
+// they will be checked against are resting too.
+void add_sector_spheres_to_block(struct sphere_block_s *block, const struct sector_s *sector, const double t, const bool moving_only) {
+	reserve_sphere_block(block, block->num_spheres + sector->num_spheres);
+	bool skip_resting = moving_only && sector->num_resting > 0;
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		if (!skip_resting || !is_sector_sphere_resting(sector, i)) {
+			add_sector_sphere_to_block(block, sector, i, t);
+		}
+	}
+}
+
+// Copies every sphere in the cell apart from "skip" into the block, at time "t".
+// Resting spheres are left out if "moving_only" is set.
+void add_cell_spheres_to_block(struct sphere_block_s *block, const struct sector_s *sector, const int64_t cell_id, const struct sphere_s *skip, const double t, const bool moving_only) {
+	const struct cell_s *cell = &sector->cells[cell_id];
+	reserve_sphere_block(block, block->num_spheres + cell->num_spheres);
+	bool skip_resting = moving_only && sector->num_resting > 0;
+	int64_t i;
+	for (i = 0; i < cell->num_spheres; i++) {
+		int64_t id = cell->sphere_ids[i];
+		if (sector->spheres[id] != skip && (!skip_resting || !is_sector_sphere_resting(sector, id))) {
+			add_sector_sphere_to_block(block, sector, id, t);
+		}
 	}
 }
 
 void add_sphere_to_sector(struct sector_s *sector, struct sphere_s *sphere) {
 	if (sector->num_spheres >= sector->max_spheres) {
-		sector->max_spheres = sector->max_spheres * 2;
-		sector->spheres = realloc(sector->spheres, sector->max_spheres * sizeof(struct sphere_s *));
+		resize_sphere_arrays(sector, sector->max_spheres == 0 ? 64 : sector->max_spheres * 2);
 	}
 	sector->spheres[sector->num_spheres] = sphere;
 	sector->spheres[sector->num_spheres]->sector_id = sector->num_spheres;
+	write_sector_sphere_data(sector, sphere);
+	if (is_sphere_resting(sphere)) {
+		sector->num_resting++;
+	}
 	sector->num_spheres++;
 	set_largest_radius_after_insertion(sector, sphere);
+	update_max_speed(sector, sphere);
+	if (sector->cells_valid) {
+		if (are_cells_wide_enough(sector) && sector->num_spheres <= 2 * sector->cells_num_spheres) {
+			add_sphere_to_cell(sector, sphere, find_cell_for_sphere(sector, sphere));
+		} else {
+			sector->cells_valid = false;
+		}
+	}
 }
 
 static void set_largest_radius_after_removal(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sphere->radius == sector->largest_radius && sector->largest_radius_shared == false && sector->num_spheres > 0) {
-		printf("TODO: find new largest radius\n");
+	int64_t slot = sector->num_radius_slots == 0 ? -1 : find_radius_slot(sector, get_sphere_radius(sphere));
+	if (slot == -1 || sector->radius_slots[slot] == -1) {
+		printf("Error: sphere's radius is not tracked by its sector\n");
 		getchar();
 		exit(1);
-	} else if (sphere->radius == sector->largest_radius && sector->largest_radius_shared == true) {
-		sector->num_largest_radius_shared--;
-		if (sector->num_largest_radius_shared == 0) {
-			sector->largest_radius_shared = false;
-		}
-	} else if (sector->num_spheres == 0) {
-		sector->largest_radius = 0.0;
 	}
-}
-
-static void shift(struct sector_s *sector, const struct sphere_s *sphere) {
-	int64_t i;
-	for (i = sphere->sector_id; i < sector->num_spheres - 1; i++) {
-		sector->spheres[i] = sector->spheres[i + 1];
-		sector->spheres[i]->sector_id--;
+	int64_t i = sector->radius_slots[slot];
+	sector->radii[i].count--;
+	if (sector->radii[i].count > 0) {
+		return;
+	}
+	remove_radius_slot(sector, slot);
+	sector->num_radii--;
+	if (i < sector->num_radii) {
+		set_radius_entry(sector, i, &sector->radii[sector->num_radii]);
+		if (i > 0 && sector->radii[(i - 1) / 2].radius < sector->radii[i].radius) {
+			sift_radius_up(sector, i);
+		} else {
+			sift_radius_down(sector, i);
+		}
 	}
+	sector->largest_radius = sector->num_radii == 0 ? 0.0 : sector->radii[0].radius;
 }
 
 // Each sphere has a sector id which gives its location in the sector's sphere
-// array.
-// If the sphere to be removed is the only or last it can just be removed normally.
-// Otherwise each sphere after it in the array must be shifted down by one and
-// have its own sector id decremented. 
-// I previously tried doing this without a sector id. A linear search followed 
-// by a memmove was done, but this was not any faster with 4'000 spheres.
-// It may be faster when dealing with a much larger number of spheres however.
+// array and data.
+// Order of spheres within a sector does not matter, so the last sphere in the
+// array is moved into the removed sphere's slot and only its sector id and its
+// entry in its cell need to be fixed. This keeps transfers constant time no
+// matter how many spheres the sector holds. Events and the per sphere event
+// cache refer to spheres by pointer, which the move does not change.
 void remove_sphere_from_sector(struct sector_s *sector, const struct sphere_s *sphere) {
-	if (sector->num_spheres == 1 || sector->num_spheres - 1 == sphere->sector_id) {
-		sector->num_spheres--;
-		set_largest_radius_after_removal(sector, sphere);
-		return;
+	if (sector->cells_valid) {
+		remove_sphere_from_cell(sector, sphere);
+	}
+	if (is_sector_sphere_resting(sector, sphere->sector_id)) {
+		sector->num_resting--;
 	}
-	shift(sector, sphere);
 	sector->num_spheres--;
+	if (sphere->sector_id != sector->num_spheres) {
+		struct sphere_s *moved = sector->spheres[sector->num_spheres];
+		sector->spheres[sphere->sector_id] = moved;
+		moved->sector_id = sphere->sector_id;
+		move_sphere_data(sector, sector->num_spheres, moved->sector_id);
+		if (sector->cells_valid) {
+			sector->cells[moved->cell_id].sphere_ids[moved->cell_slot] = moved->sector_id;
+		}
+	}
 	set_largest_radius_after_removal(sector, sphere);
 }
 
@@ -118,8 +643,16 @@ void add_sphere_to_correct_sector(struct sphere_s *sphere) {
 	exit(1);
 }
 
+// Every sector starts off needing its event found.
 static void alloc_sector_event_details_array(){
-	sector_events = calloc(sim_data.sector_dims[X_AXIS] * sim_data.sector_dims[Y_AXIS] * sim_data.sector_dims[Z_AXIS], sizeof(struct event_s));
+	sector_events = calloc(sim_data.num_sectors, sizeof(struct event_s));
+	init_sector_event_tree();
+	invalid_sector_ids = malloc(sim_data.num_sectors * sizeof(int));
+	int i;
+	for(i = 0; i < sim_data.num_sectors; i++){
+		invalid_sector_ids[i] = i;
+	}
+	num_invalid_sectors = sim_data.num_sectors;
 }
 
 static void alloc_sector_array(){
@@ -135,19 +668,41 @@ static void alloc_sector_array(){
 	}
 }
 
+// Fills in the sector's table of adjacent sectors.
+// Every sector beyond one side shares the same boundary, so it is recorded once
+// per side rather than read from each neighbour.
+static void set_sector_neighbours(struct sector_s *s) {
+	int n;
+	for (n = 0; n < NUM_SECTOR_NEIGHBOURS; n++) {
+		int x = s->pos.x + SECTOR_NEIGHBOUR_OFFSETS[n][X_AXIS];
+		int y = s->pos.y + SECTOR_NEIGHBOUR_OFFSETS[n][Y_AXIS];
+		int z = s->pos.z + SECTOR_NEIGHBOUR_OFFSETS[n][Z_AXIS];
+		if (x < 0 || y < 0 || z < 0 || x >= sim_data.sector_dims[X_AXIS] || y >= sim_data.sector_dims[Y_AXIS] || z >= sim_data.sector_dims[Z_AXIS]) {
+			s->neighbours[n] = NULL;
+		} else {
+			s->neighbours[n] = &sim_data.sectors[x][y][z];
+		}
+	}
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		struct sector_s *after = s->neighbours[get_face_neighbour_index(a, DIR_POSITIVE)];
+		struct sector_s *before = s->neighbours[get_face_neighbour_index(a, DIR_NEGATIVE)];
+		s->neighbour_start.vals[a] = after != NULL ? after->start.vals[a] : s->end.vals[a];
+		s->neighbour_end.vals[a] = before != NULL ? before->end.vals[a] : s->start.vals[a];
+	}
+}
+
 // Note: size of grid in each dimension should be divisible by number of
 // sectors in that dimension.
 void init_sectors() {
 	sim_data.num_sectors = sim_data.sector_dims[X_AXIS] * sim_data.sector_dims[Y_AXIS] * sim_data.sector_dims[Z_AXIS];
-	if(sim_data.num_sectors == 1){
+	sim_data.uses_sectors = sim_data.num_sectors > 1 || (!sim_data.uses_event_queue && !sim_data.checks_all_pairs);
+	if(!sim_data.uses_sectors){
 		return;
 	}
-	sim_data.xy_check_needed = sim_data.sector_dims[X_AXIS] > 1 && sim_data.sector_dims[Y_AXIS] > 1;
-	sim_data.xz_check_needed = sim_data.sector_dims[X_AXIS] > 1 && sim_data.sector_dims[Z_AXIS] > 1;
-	sim_data.yz_check_needed = sim_data.sector_dims[Y_AXIS] > 1 && sim_data.sector_dims[Z_AXIS] > 1;
-	sim_data.xyz_check_needed = sim_data.sector_dims[X_AXIS] > 1 && sim_data.sector_dims[Y_AXIS] > 1 && sim_data.sector_dims[Z_AXIS] > 1;
 	alloc_sector_array();
 	alloc_sector_event_details_array();
+	sort_scratch = calloc(get_max_threads(), sizeof(struct sort_scratch_s));
 	double x_inc = sim_data.grid_size.x / sim_data.sector_dims[X_AXIS];
 	double y_inc = sim_data.grid_size.y / sim_data.sector_dims[Y_AXIS];
 	double z_inc = sim_data.grid_size.z / sim_data.sector_dims[Z_AXIS];
@@ -168,12 +723,20 @@ void init_sectors() {
 				s->pos.z = k;
 				s->id = id;
 				s->prior_time_valid = false;
+				s->time = 0.0;
 				s->num_spheres = 0;
-				s->max_spheres = 2000;
-				s->spheres = calloc(s->max_spheres, sizeof(struct sphere_s *));
+				resize_sphere_arrays(s, 2000);
+				s->cells = NULL;
+				s->cell_order = NULL;
+				s->max_cells = 0;
+				s->cells_valid = false;
+				s->max_speed = 0.0;
 				id++;
 			}
 		}
 	}
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		set_sector_neighbours(&sim_data.sectors_flat[i]);
+	}
 }
 
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 
 #include "event.h"
+#include "pair_kernel.h"
 #include "vector_3.h"
 
 enum direction {
@@ -10,27 +11,131 @@ enum direction {
 	DIR_NEGATIVE = 1,
 	DIR_NONE = 2
 };
+
+// Cells must be at least this many times the largest radius in the sector wide,
+// so that spheres in cells that are not adjacent cannot collide before one of
+// them leaves its cell. Must be at least 2.0, anything above that is a margin
+// that makes spheres cross between cells less often.
+#define CELL_MIN_WIDTH_RADII 3.0
+// Each time a sphere moves into another cell is an event, so cells are made at
+// least this many mean free paths wide so that spheres collide more often than
+// they move between cells.
+#define CELL_MIN_WIDTH_MEAN_FREE_PATHS 3.0
+// Average number of spheres wanted in each cell. Cells are made wider than the
+// minimum when a sector holds few spheres for its size.
+#define CELL_TARGET_NUM_SPHERES 4.0
+// Spheres closer than this to the boundary between two cells, as a fraction
+// of the cell's width, are placed in the cell they are moving towards.
+#define CELL_BOUNDARY_EPS 1e-9
+
+// Number of sectors a sector can be adjacent to: 6 faces, 12 edges and 8 corners.
+#define NUM_SECTOR_NEIGHBOURS 26
+
+// Cell within a sector, holding the sector ids of the spheres in it. Each
+// sphere records its cell and slot in the cell so it can be removed without
+// searching.
+struct cell_s {
+	int64_t *sphere_ids;
+	int64_t num_spheres;
+	int64_t max_spheres;
+};
+
+// The sector's own copy of its spheres, with one array per component, indexed
+// by sector id. Each position is for the time in "time" and, along with the
+// velocity, gives where the sphere is until its velocity next changes. So an
+// entry only has to be written when a sphere arrives or bounces, not whenever
+// the sphere itself is moved forward.
+struct sector_sphere_data_s {
+	double *pos_x;
+	double *pos_y;
+	double *pos_z;
+	double *vel_x;
+	double *vel_y;
+	double *vel_z;
+	double *radius;
+	double *time;
+};
+
+// Number of spheres in a sector that have a given radius.
+struct radius_count_s {
+	double radius;
+	int64_t count;
+	int64_t slot; // Where the radius is in the sector's radius_slots
+};
+
 struct sector_s {
 	union vector_3d start;
 	union vector_3d end;
-	struct sphere_s **spheres;
+	struct sphere_s **spheres; // Maps each sector id back to the sphere
+	struct sector_sphere_data_s data;
 	int64_t num_spheres;
 	int64_t max_spheres;
+	int64_t num_resting; // Spheres with no velocity, see is_sphere_resting()
 	union vector_3i pos; // Location in sector array
+	// Adjacent sectors in the order of SECTOR_NEIGHBOUR_OFFSETS, NULL past the
+	// edge of the grid. The first 6 are the faces, see get_face_neighbour_index().
+	struct sector_s *neighbours[NUM_SECTOR_NEIGHBOURS];
+	union vector_3d neighbour_start; // Where the sectors after this one start on each axis
+	union vector_3d neighbour_end; // Where the sectors before this one end on each axis
 	double largest_radius; // Radius of the largest sphere in the sector.
-	bool largest_radius_shared; // If many spheres have the same radius as the largest radius
-	int64_t num_largest_radius_shared; // How many spheres shared the largest radius
+	// Each distinct radius in the sector and how many spheres have it, as a
+	// max-heap by radius so the largest is always the first entry.
+	struct radius_count_s *radii;
+	int64_t num_radii;
+	int64_t max_radii;
+	// Open addressing table from each radius to its entry in radii, -1 if the
+	// slot is empty.
+	int64_t *radius_slots;
+	int64_t num_radius_slots;
+	// At least the speed of the fastest sphere in the sector. Raised whenever a
+	// sphere arrives or speeds up, and set exactly again when the cells are built.
+	double max_speed;
 	int id;
 	bool prior_time_valid; // If last known event time is valid for the next iteration.
+	// Simulation time the sector's events are predicted from. The same as
+	// sim_data.elapsed_time, apart from while the sector runs ahead on its own
+	// in a lookahead window, see window.c.
+	double time;
+	// Uniform grid of cells the sector is divided into, so that spheres only
+	// need to be checked against spheres in the same or adjacent cells.
+	// Spheres are moved between cells as they cross them. When the cells are
+	// built the spheres are reordered so that each cell's spheres are next to
+	// each other in "data".
+	struct cell_s *cells;
+	int64_t max_cells; // Number of cells allocated
+	union vector_3i cell_dims; // Number of cells on each axis
+	union vector_3d cell_size;
+	// Position of each cell in the order the spheres are sorted into, and the
+	// number of cells on each axis it was worked out for.
+	int64_t *cell_order;
+	union vector_3i cell_order_dims;
+	int64_t num_cell_moves; // Spheres moved between cells since they were last sorted
+	// False if the cells need to be built again. This happens when a sphere too
+	// large for them arrives, or when the number of spheres has doubled since
+	// they were built so that they are too crowded.
+	bool cells_valid;
+	int64_t cells_num_spheres; // Number of spheres in the sector when the cells were built
 };
 
 struct event_s *sector_events;
 
-// Used when iterating over axes and need to access sector adjacent on the current axis.
-// Allows sectors to be found in a generic way. 
-const int SECTOR_MODIFIERS[3][4][3];
+// Sectors whose event must be found again before the next iteration.
+int *invalid_sector_ids;
+int num_invalid_sectors;
+
+// Offset to each adjacent sector, in the order sector_s.neighbours is kept in.
+const int SECTOR_NEIGHBOUR_OFFSETS[NUM_SECTOR_NEIGHBOURS][3];
 
 void add_sphere_to_sector(struct sector_s *sector, struct sphere_s *sphere);
 void remove_sphere_from_sector(struct sector_s *sector, const struct sphere_s *sphere);
+void set_sector_sphere_data(struct sector_s *sector, const struct sphere_s *sphere);
+void add_sector_spheres_to_block(struct sphere_block_s *block, const struct sector_s *sector, const double t, const bool moving_only);
+void add_cell_spheres_to_block(struct sphere_block_s *block, const struct sector_s *sector, const int64_t cell_id, const struct sphere_s *skip, const double t, const bool moving_only);
 void add_sphere_to_correct_sector(struct sphere_s *sphere);
+int get_face_neighbour_index(const enum axis a, const enum direction dir);
+int64_t get_cell_index(const struct sector_s *sector, const int x, const int y, const int z);
+union vector_3i get_cell_pos(const struct sector_s *sector, const int64_t cell_id);
+void move_sphere_to_correct_cell(struct sector_s *sector, struct sphere_s *sphere);
+void update_max_speed(struct sector_s *sector, const struct sphere_s *sphere);
+void build_cells_for_sector(struct sector_s *sector);
 void init_sectors();
@@ -4,12 +4,18 @@
 
 #include "collision.h"
 #include "event.h"
+#include "event_queue.h"
 #include "grid.h"
 #include "io.h"
+#include "pair_kernel.h"
 #include "params.h"
 #include "simulation.h"
+#include "sphere_events.h"
+#include "tasks.h"
+#include "threads.h"
 #include "wrapper.h"
 #include "vector_3.h"
+#include "window.h"
 
 static void compare_results() {
 	if(compare_file == NULL){
@@ -27,7 +33,7 @@ static void compare_results() {
 	double max_vel_err = 0.0;
 	int i;
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
-		struct sphere_s s = sim_data.spheres[i];
+		struct sphere_s s = *sim_data.spheres_by_id[i];
 		union vector_3d vel_comp;
 		union vector_3d pos_comp;
 		fread_wrapper(&vel_comp, sizeof(union vector_3d), 1, fp);
@@ -51,15 +57,27 @@ static void init_stats(){
 	stats.num_grid_collisions = 0;
 	stats.num_sector_transfers = 0;
 	stats.num_partial_crossings = 0;
+	stats.num_cell_crossings = 0;
+	stats.num_pair_tests_skipped = 0;
 }
 
 void simulation_init() {
 	FILE *initial_state_fp = fopen(initial_state_file, "rb");
+	set_num_threads(sim_data.num_threads);
+	init_tasks();
 	sim_data.elapsed_time = 0.0;
 	init_grid(initial_state_fp);
 	init_stats();
 	init_sectors();
 	load_spheres(initial_state_fp);
+	init_pair_kernel();
+	init_collision_blocks();
+	if(sim_data.uses_sectors){
+		init_sphere_events();
+		init_windows();
+	} else if(sim_data.uses_event_queue){
+		init_event_queue();
+	}
 	delete_old_files();
 	init_binary_file();
 }
@@ -68,7 +86,7 @@ void simulation_init() {
 // Ensures each sphere is located within the sector responsible for it.
 // Helps catch any issues with transfering spheres between sectors.
 static void sanity_check() {
-	if (sim_data.num_sectors == 1) {
+	if (!sim_data.uses_sectors) {
 		return;
 	}
 	static const double eps = 10E-13;
@@ -78,6 +96,7 @@ static void sanity_check() {
 		int j;
 		for (j = 0; j < s->num_spheres; j++) {
 			struct sphere_s *sphere = s->spheres[j];
+			update_sphere_position_to_time(sphere, sim_data.elapsed_time);
 			int error = 0;
 			enum axis a;
 			for (a = X_AXIS; a <= Z_AXIS; a++) {
@@ -90,7 +109,7 @@ static void sanity_check() {
 			}
 			if (error) {
 				printf("Sphere not in correct sector!\n");
-				printf("Sphere is is %ld\n", sphere->id);
+				printf("Sphere is is %d\n", sphere->id);
 				printf("Sphere is in sector %d\n", s->id);
 				printf("Sphere has position: %.17g, %.17g, %.17g\n", sphere->pos.x, sphere->pos.y, sphere->pos.z);
 				printf("Sector starts at: %f, %f, %f\n", s->start.x, s->start.y, s->start.z);
@@ -108,13 +127,14 @@ static void do_simulation_iteration_dd(){
 	reset_event();
 	// Now find event + time of event
 	find_event_times_for_all_sectors();
+	if (sim_data.uses_windows && run_lookahead_window()) {
+		return;
+	}
 	//printf("Iteration: %d. Soonest time is %.17g from %d. Elapsed time is %.17g\n", sim_data.iteration_number, event_details.time, event_details.source_sector->id, sim_data.elapsed_time);
 	// Final event may take place after time limit, so cut it short
 	if (sim_data.uses_time_limit && sim_data.time_limit - sim_data.elapsed_time < event_details.time) {
 		event_details.time = sim_data.time_limit - sim_data.elapsed_time;
-		update_spheres();
 	} else {
-		update_spheres();
 		apply_event_dd();
 	}
 	//sanity_check();
@@ -130,15 +150,27 @@ static void do_simulation_iteration_no_dd(){
 	// Final event may take place after time limit, so cut it short
 	if (sim_data.uses_time_limit && sim_data.time_limit - sim_data.elapsed_time < event_details.time) {
 		event_details.time = sim_data.time_limit - sim_data.elapsed_time;
-		update_spheres();
 	} else {
-		update_spheres();
 		apply_event_no_dd();
 	}
 	sim_data.elapsed_time += event_details.time;
 }
 
-static bool is_simulation_finished(){
+// Same as do_simulation_iteration_no_dd() but the soonest event is taken from
+// the event queue rather than checking every pair of spheres.
+static void do_simulation_iteration_queue(){
+	reset_event();
+	find_event_time_from_queue();
+	if (sim_data.uses_time_limit && sim_data.time_limit - sim_data.elapsed_time < event_details.time) {
+		event_details.time = sim_data.time_limit - sim_data.elapsed_time;
+	} else {
+		apply_event_no_dd();
+		update_event_queue(sim_data.elapsed_time + event_details.time);
+	}
+	sim_data.elapsed_time += event_details.time;
+}
+
+bool is_simulation_finished(){
 	if(sim_data.uses_time_limit){
 		if(sim_data.elapsed_time >= sim_data.time_limit){
 			return true;
@@ -155,8 +187,10 @@ static bool is_simulation_finished(){
 void simulation_run() {
 	sim_data.iteration_number = 1; // start at 1 as 0 is iteration num for the initial state
 	while (1) {
-		if(sim_data.num_sectors > 1){
+		if(sim_data.uses_sectors){
 			do_simulation_iteration_dd();
+		} else if(sim_data.uses_event_queue){
+			do_simulation_iteration_queue();
 		} else {
 			do_simulation_iteration_no_dd();
 		}
@@ -164,22 +198,31 @@ void simulation_run() {
 			write_final_time_to_file();
 			break;
 		}
-		save_sphere_state_to_file(sim_data.iteration_number, sim_data.elapsed_time);
-		sim_data.iteration_number++;
+		save_event_to_file();
 	}
+	update_spheres();
 	write_final_state();
 	compare_results();
 }
 
 void simulation_cleanup() {
-	if (sim_data.num_sectors > 1) {
+	if (sim_data.uses_sectors) {
 		free(sim_data.sectors_flat);
 		int i;
 		for (i = 0; i < sim_data.sector_dims[X_AXIS]; i++) {
 			free(sim_data.sectors[i]);
 		}
 		free(sim_data.sectors);
+		free_sphere_events();
+		free_sector_event_tree();
+		free_windows();
+	}
+	if(sim_data.uses_event_queue){
+		free_event_queue();
 	}
+	free_collision_blocks();
+	free_tasks();
 	free(sim_data.spheres);
+	free_species();
 	close_data_file();
 }
@@ -16,14 +16,20 @@ struct simulation_s {
 	double time_limit;
 	int event_limit;
 	bool uses_time_limit; // if false use event_limit instead
+	bool uses_event_queue; // if true events are scheduled using a priority queue when domain decomposition is not used
+	bool checks_all_pairs; // if true a single sector run checks every pair of spheres after each event rather than using cells
+	bool uses_sectors; // if false there are no sectors and events are found by checking every pair or with the event queue
+	bool uses_morton_order; // if true spheres are kept in Morton order of their positions to improve locality
+	bool uses_windows; // if true sectors run ahead on their own in lookahead windows, see window.c
+	bool uses_optimistic_windows; // if true lookahead windows run ahead speculatively and roll back, see window.c
+	int num_threads; // threads used to find events, see threads.h
 	double elapsed_time;
-	bool xy_check_needed;
-	bool xz_check_needed;
-	bool yz_check_needed;
-	bool xyz_check_needed;
 	int64_t total_num_spheres;
 	int iteration_number;
 	struct sphere_s *spheres;
+	// Maps each sphere's id to the sphere, as spheres may be stored in a
+	// different order to the initial state file. Used for output.
+	struct sphere_s **spheres_by_id;
 };
 
 struct simulation_s sim_data;
@@ -33,10 +39,13 @@ struct stats_s {
 	int num_grid_collisions;
 	int num_sector_transfers;
 	int num_partial_crossings;
+	int num_cell_crossings;
+	int64_t num_pair_tests_skipped; // Pairs ruled out by distance without finding when they collide
 };
 
 struct stats_s stats;
 
 void simulation_init();
 void simulation_run();
+bool is_simulation_finished();
 void simulation_cleanup();
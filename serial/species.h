@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Radius and mass shared by every sphere of one kind.
+// Runs rarely have more than a handful of distinct radius/mass pairs, so
+// spheres hold a small index into this table rather than their own copies.
+struct species_s {
+	double radius;
+	double mass;
+};
+
+struct species_table_s {
+	struct species_s *species;
+	int32_t num_species;
+	int32_t max_species;
+	// Whether every species so far has the same radius, or the same mass, so
+	// that specialised versions of the pair kernel and bounce can be used.
+	bool uniform_radius;
+	bool uniform_mass;
+	// Open addressing hash of radius/mass to an index into species, -1 if the
+	// slot is empty. Only used while loading.
+	int32_t *slots;
+	int32_t num_slots;
+};
+
+struct species_table_s species_table;
+
+int32_t find_or_add_species(const double radius, const double mass);
+void free_species();
+
+static inline double get_species_radius(const int32_t species) {
+	return species_table.species[species].radius;
+}
+
+static inline double get_species_mass(const int32_t species) {
+	return species_table.species[species].mass;
+}
+
+static inline bool has_uniform_radius() {
+	return species_table.uniform_radius;
+}
+
+static inline bool has_uniform_mass() {
+	return species_table.uniform_mass;
+}
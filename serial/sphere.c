@@ -1,6 +1,6 @@
 #include <stdlib.h>
 
-#include "event.h"
+#include "morton.h"
 #include "simulation.h"
 #include "sphere.h"
 #include "wrapper.h"
@@ -16,33 +16,96 @@ void update_sphere_position(struct sphere_s *s, double t) {
 	s->pos.z = s->pos.z + (s->vel.z * t);
 }
 
+// Brings the sphere's position forward to the given simulation time.
+// Spheres are only moved when they are needed by an event, by event
+// prediction or by output, so each sphere records the time its position is for.
+void update_sphere_position_to_time(struct sphere_s *s, const double t) {
+	if (s->time != t) {
+		update_sphere_position(s, t - s->time);
+		s->time = t;
+	}
+}
+
+// Reorders the spheres into Morton order of their positions.
+// Must be done before anything holds a pointer to a sphere.
+static void sort_spheres_by_morton_order() {
+	struct morton_key_s *keys = malloc(sim_data.total_num_spheres * sizeof(struct morton_key_s));
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		keys[i].code = get_morton_code_for_position(&sim_data.spheres[i].pos, &sim_data.grid_size);
+		keys[i].index = i;
+	}
+	sort_morton_keys(keys, sim_data.total_num_spheres);
+	struct sphere_s *sorted = malloc(sim_data.total_num_spheres * sizeof(struct sphere_s));
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		sorted[i] = sim_data.spheres[keys[i].index];
+	}
+	free(sim_data.spheres);
+	sim_data.spheres = sorted;
+	free(keys);
+}
+
+// Output is written in order of id, so every id must be used exactly once.
+static void map_spheres_by_id() {
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		int64_t id = sim_data.spheres[i].id;
+		if (id < 0 || id >= sim_data.total_num_spheres || sim_data.spheres_by_id[id] != NULL) {
+			printf("Error: sphere ids must be unique and between 0 and the number of spheres\n");
+			exit(1);
+		}
+		sim_data.spheres_by_id[id] = &sim_data.spheres[i];
+	}
+}
+
 // Loads spheres from the specified inital state file
+// The spheres are only added to sectors once they have all been loaded, as
+// they may be reordered first.
 void load_spheres(FILE *initial_state_fp) {
 	fread_wrapper(&sim_data.total_num_spheres, sizeof(int64_t), 1, initial_state_fp);
+	if (sim_data.total_num_spheres > INT32_MAX) {
+		printf("Error: at most %d spheres are supported\n", INT32_MAX);
+		exit(1);
+	}
 	sim_data.spheres = calloc(sim_data.total_num_spheres, sizeof(struct sphere_s));
+	sim_data.spheres_by_id = calloc(sim_data.total_num_spheres, sizeof(struct sphere_s *));
 	int64_t i;
 	for(i = 0; i < sim_data.total_num_spheres; i++){
-		fread_wrapper(&sim_data.spheres[i].id, sizeof(int64_t), 1, initial_state_fp);
+		int64_t id;
+		double mass, radius;
+		fread_wrapper(&id, sizeof(int64_t), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].pos.x, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].pos.y, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].pos.z, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].vel.x, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].vel.y, sizeof(double), 1, initial_state_fp);
 		fread_wrapper(&sim_data.spheres[i].vel.z, sizeof(double), 1, initial_state_fp);
-		fread_wrapper(&sim_data.spheres[i].mass, sizeof(double), 1, initial_state_fp);
-		fread_wrapper(&sim_data.spheres[i].radius, sizeof(double), 1, initial_state_fp);
-		if (sim_data.num_sectors > 1) {
+		fread_wrapper(&mass, sizeof(double), 1, initial_state_fp);
+		fread_wrapper(&radius, sizeof(double), 1, initial_state_fp);
+		if (id < 0 || id >= sim_data.total_num_spheres) {
+			printf("Error: sphere ids must be unique and between 0 and the number of spheres\n");
+			exit(1);
+		}
+		sim_data.spheres[i].id = (int32_t)id;
+		sim_data.spheres[i].species = find_or_add_species(radius, mass);
+	}
+	if (sim_data.uses_morton_order) {
+		sort_spheres_by_morton_order();
+	}
+	map_spheres_by_id();
+	if (sim_data.uses_sectors) {
+		for (i = 0; i < sim_data.total_num_spheres; i++) {
 			add_sphere_to_correct_sector(&sim_data.spheres[i]);
 		}
 	}
 }
 
-// This updates the positions and velocities of each sphere once the next
-// event and the time it occurs are known.
+// Brings every sphere up to the current simulation time.
+// Only needed when the state of every sphere is read, such as for output.
 void update_spheres() {
 	int i;
 	for (i = 0; i < sim_data.total_num_spheres; i++) {
 		struct sphere_s *s = &(sim_data.spheres[i]);
-		update_sphere_position(s, event_details.time);
+		update_sphere_position_to_time(s, sim_data.elapsed_time);
 	}
 }
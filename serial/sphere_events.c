@@ -0,0 +1,277 @@
+#include <float.h>
+#include <stdlib.h>
+
+#include "collision.h"
+#include "event.h"
+#include "pair_kernel.h"
+#include "sector.h"
+#include "simulation.h"
+#include "sphere.h"
+#include "sphere_events.h"
+#include "threads.h"
+#include "vector_3.h"
+
+// Cache of the soonest event for each sphere, used when domain decomposition is used.
+// An entry holds the sooner of the sphere's collision with the grid, its crossing
+// into another sector or cell, and its collisions with spheres in the same or
+// adjacent cells. A sector's next event is the soonest of its spheres' entries,
+// so after an event only the spheres involved need to be predicted again rather
+// than every pair in the sector.
+// Times are absolute simulation times so that entries stay correct as the
+// simulation advances. An entry becomes stale if its partner takes part in a
+// later event, which is detected by recording the partner's collision count.
+struct sphere_event_s {
+	double time; // Simulation time the event happens at
+	enum event_type type;
+	struct sphere_s *partner; // Other sphere in a sphere on sphere collision, otherwise NULL
+	uint32_t partner_count; // Partner's collision count when the event was predicted
+	enum axis grid_axis;
+	struct sector_s *dest_sector; // Sector being moved to in a sector transfer
+	// Sector the sphere has crossed into while parked, otherwise NULL.
+	// See park_sphere_event().
+	struct sector_s *region;
+	bool valid; // False if the sphere has to be predicted again
+};
+
+// Offsets to the cells adjacent to a cell.
+static const int CELL_NEIGHBOUR_OFFSETS[26][3] = {
+	{ 1, -1, -1 }, { 1, -1, 0 }, { 1, -1, 1 },
+	{ 1, 0, -1 }, { 1, 0, 0 }, { 1, 0, 1 },
+	{ 1, 1, -1 }, { 1, 1, 0 }, { 1, 1, 1 },
+	{ 0, 1, -1 }, { 0, 1, 0 }, { 0, 1, 1 },
+	{ 0, 0, 1 },
+	{ -1, 1, 1 }, { -1, 1, 0 }, { -1, 1, -1 },
+	{ -1, 0, 1 }, { -1, 0, 0 }, { -1, 0, -1 },
+	{ -1, -1, 1 }, { -1, -1, 0 }, { -1, -1, -1 },
+	{ 0, -1, 1 }, { 0, -1, 0 }, { 0, -1, -1 },
+	{ 0, 0, -1 }
+};
+
+static struct sphere_event_s *entries; // indexed the same as sim_data.spheres
+// Spheres near the one being predicted, one block for each thread as sectors
+// may be predicted on different threads at once.
+static struct sphere_block_s *blocks;
+static int num_blocks;
+
+static struct sphere_event_s *get_entry(const struct sphere_s *s) {
+	return &entries[s - sim_data.spheres];
+}
+
+void init_sphere_events() {
+	entries = calloc(sim_data.total_num_spheres, sizeof(struct sphere_event_s));
+	int64_t i;
+	for (i = 0; i < sim_data.total_num_spheres; i++) {
+		entries[i].valid = false;
+		entries[i].region = NULL;
+	}
+	num_blocks = get_max_threads();
+	blocks = calloc(num_blocks, sizeof(struct sphere_block_s));
+}
+
+void free_sphere_events() {
+	free(entries);
+	int i;
+	for (i = 0; i < num_blocks; i++) {
+		free_sphere_block(&blocks[i]);
+	}
+	free(blocks);
+}
+
+// The sphere has moved to another cell or sector, so its own event has to be
+// found again. Its velocity has not changed so events predicted with it as the
+// partner are still correct.
+void invalidate_sphere_event(const struct sphere_s *s) {
+	get_entry(s)->valid = false;
+}
+
+// The sphere's velocity has changed or it has left the sector, so both its own
+// event and any events predicted with it as the partner are no longer correct.
+void invalidate_events_involving_sphere(struct sphere_s *s) {
+	s->collision_count++;
+	invalidate_sphere_event(s);
+}
+
+static bool is_entry_stale(const struct sphere_event_s *e) {
+	return !e->valid || (e->partner != NULL && e->partner->collision_count != e->partner_count);
+}
+
+// While a sector runs ahead of the others in a lookahead window, a sphere that
+// crosses into another sector stays in its own sector until the window ends,
+// see window.c. Nothing can reach it before then, or in an optimistic window
+// anything that does is found afterwards and rolled back, so until it is
+// unparked only its collisions with the grid and its crossings into further
+// sectors are predicted, going by the sector "region" it has crossed into.
+void park_sphere_event(const struct sphere_s *s, struct sector_s *region) {
+	struct sphere_event_s *e = get_entry(s);
+	e->region = region;
+	e->valid = false;
+}
+
+// Returns the sector the sphere had crossed into, and goes back to predicting
+// all of its events.
+struct sector_s *unpark_sphere_event(const struct sphere_s *s) {
+	struct sphere_event_s *e = get_entry(s);
+	struct sector_s *region = e->region;
+	e->region = NULL;
+	e->valid = false;
+	return region;
+}
+
+bool is_sphere_parked(const struct sphere_s *s) {
+	return get_entry(s)->region != NULL;
+}
+
+// Finds the sooner of the sphere's collision with the grid and its crossing
+// out of "sector".
+static double predict_grid_and_sector_events(struct sector_s *sector, const struct sphere_s *s) {
+	struct sphere_event_s *e = get_entry(s);
+	enum axis a;
+	double soonest = find_collision_time_grid(s, &a);
+	e->type = COL_SPHERE_WITH_GRID;
+	e->grid_axis = a;
+	e->partner = NULL;
+	e->dest_sector = NULL;
+	struct sector_s *dest = NULL;
+	double time = find_collision_time_sector(sector, s, &dest);
+	if (time < soonest) {
+		soonest = time;
+		e->type = COL_SPHERE_WITH_SECTOR;
+		e->grid_axis = AXIS_NONE;
+		e->dest_sector = dest;
+	}
+	return soonest;
+}
+
+static void set_entry_time(struct sphere_event_s *e, const double now, const double soonest) {
+	if (soonest == DBL_MAX) {
+		e->time = DBL_MAX;
+		e->type = COL_NONE;
+	} else {
+		e->time = now + soonest;
+	}
+	e->valid = true;
+}
+
+// Finds the soonest event for the sphere that does not involve another sphere.
+static void predict_boundary_events(struct sector_s *sector, const struct sphere_s *s) {
+	struct sphere_event_s *e = get_entry(s);
+	double soonest = predict_grid_and_sector_events(sector, s);
+	double time = find_collision_time_cell(sector, s);
+	if (time < soonest) {
+		soonest = time;
+		e->type = COL_SPHERE_WITH_CELL;
+		e->grid_axis = AXIS_NONE;
+		e->dest_sector = NULL;
+	}
+	set_entry_time(e, sector->time, soonest);
+}
+
+// Returns false if no sphere in the cell can reach "s" within "time", going by
+// the sector's largest radius and speed.
+// Spheres can be up to CELL_BOUNDARY_EPS of the cell's width outside of it, so
+// the cell is widened by twice that.
+static bool can_cell_reach_sphere(const struct sector_s *sector, const int64_t cell_id, const struct sphere_s *s, const double speed, const double time) {
+	union vector_3i cell_pos = get_cell_pos(sector, cell_id);
+	union vector_3d min, max;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		double margin = 2.0 * CELL_BOUNDARY_EPS * sector->cell_size.vals[a];
+		min.vals[a] = sector->start.vals[a] + (cell_pos.vals[a] * sector->cell_size.vals[a]) - margin;
+		max.vals[a] = min.vals[a] + sector->cell_size.vals[a] + (2.0 * margin);
+	}
+	double dist_squared = get_distance_squared_to_box(&s->pos, &min, &max);
+	return can_collide_within(dist_squared, get_sphere_radius(s) + sector->largest_radius, speed + sector->max_speed, time);
+}
+
+// Predicts the soonest event for a single sphere.
+// The spheres in its own and the adjacent cells are copied from the sector's
+// data into a block which is checked against the sphere in one go. A resting
+// sphere is only checked against the moving ones.
+// Only a collision sooner than the sphere's boundary event is kept, so adjacent
+// cells too far away for any of their spheres to reach it before then are not
+// copied or checked.
+static void predict_sphere_event(struct sector_s *sector, struct sphere_s *s) {
+	update_sphere_position_to_time(s, sector->time);
+	struct sphere_event_s *e = get_entry(s);
+	if (e->region != NULL) {
+		set_entry_time(e, sector->time, predict_grid_and_sector_events(e->region, s));
+		return;
+	}
+	predict_boundary_events(sector, s);
+	double cutoff = e->time - sector->time;
+	double speed = get_vector_3d_magnitude(&s->vel);
+	bool moving_only = is_sphere_resting(s);
+	struct sphere_block_s *block = &blocks[get_thread_num()];
+	clear_sphere_block(block);
+	add_cell_spheres_to_block(block, sector, s->cell_id, s, sector->time, moving_only);
+	union vector_3i cell_pos = get_cell_pos(sector, s->cell_id);
+	int n;
+	for (n = 0; n < 26; n++) {
+		int x = cell_pos.x + CELL_NEIGHBOUR_OFFSETS[n][X_AXIS];
+		int y = cell_pos.y + CELL_NEIGHBOUR_OFFSETS[n][Y_AXIS];
+		int z = cell_pos.z + CELL_NEIGHBOUR_OFFSETS[n][Z_AXIS];
+		if (x < 0 || y < 0 || z < 0 || x >= sector->cell_dims.x || y >= sector->cell_dims.y || z >= sector->cell_dims.z) {
+			continue;
+		}
+		int64_t cell_id = get_cell_index(sector, x, y, z);
+		if (!can_cell_reach_sphere(sector, cell_id, s, speed, cutoff)) {
+			#pragma omp atomic
+			stats.num_pair_tests_skipped += sector->cells[cell_id].num_spheres;
+			continue;
+		}
+		add_cell_spheres_to_block(block, sector, cell_id, s, sector->time, moving_only);
+	}
+	double time;
+	int64_t j = find_soonest_collision_in_block(s, block, 0, &time);
+	if (j == -1) {
+		return;
+	}
+	time += sector->time;
+	if (time < e->time) {
+		e->time = time;
+		e->type = COL_TWO_SPHERES;
+		e->partner = block->spheres[j];
+		e->partner_count = e->partner->collision_count;
+		e->grid_axis = AXIS_NONE;
+		e->dest_sector = NULL;
+	}
+}
+
+// Builds the sector's cells if they need to be built again, in which case
+// every sphere in it has to be predicted again.
+// This has to be done for each sector before its event is found.
+void prepare_sphere_events(struct sector_s *sector) {
+	if (sector->num_spheres == 0 || sector->cells_valid) {
+		return;
+	}
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		update_sphere_position_to_time(sector->spheres[i], sector->time);
+	}
+	build_cells_for_sector(sector);
+	for (i = 0; i < sector->num_spheres; i++) {
+		invalidate_sphere_event(sector->spheres[i]);
+	}
+}
+
+// Finds the sector's soonest event from its spheres' entries, first predicting
+// again any entries that are out of date.
+// Only the sector and its own spheres are changed, so different sectors can
+// be done on different threads at once. The event is merged into
+// event_details afterwards, see merge_sector_event().
+void find_event_times_from_sphere_events(struct sector_s *sector) {
+	if (sector->num_spheres == 0) {
+		return;
+	}
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		struct sphere_s *s = sector->spheres[i];
+		struct sphere_event_s *e = get_entry(s);
+		if (is_entry_stale(e)) {
+			predict_sphere_event(sector, s);
+		}
+		if (e->time != DBL_MAX) {
+			set_event_details_for_sector(e->time - sector->time, e->type, s, e->partner, e->grid_axis, sector, e->dest_sector);
+		}
+	}
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "sector.h"
+#include "sphere.h"
+
+void init_sphere_events();
+void free_sphere_events();
+void invalidate_sphere_event(const struct sphere_s *s);
+void invalidate_events_involving_sphere(struct sphere_s *s);
+void park_sphere_event(const struct sphere_s *s, struct sector_s *region);
+struct sector_s *unpark_sphere_event(const struct sphere_s *s);
+bool is_sphere_parked(const struct sphere_s *s);
+void prepare_sphere_events(struct sector_s *sector);
+void find_event_times_from_sphere_events(struct sector_s *sector);
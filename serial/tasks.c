@@ -0,0 +1,230 @@
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tasks.h"
+#include "threads.h"
+
+// Work stealing scheduler used to share work out between threads.
+// Work is split into tasks, such as finding a sector's event or checking one
+// tile of a pair scan. Each thread has a deque of tasks: it adds and takes
+// tasks at the back of its own deque, and when that is empty it steals from
+// the front of another thread's. The work done by different tasks can differ
+// a lot, as sectors can hold very different numbers of spheres, so threads
+// that finish early keep taking work from those that have not.
+// A task can call run_tasks() itself. Its tasks go on the back of its own
+// thread's deque, where idle threads can steal them, and it helps run them
+// until they are all finished.
+
+struct task_s {
+	task_func func;
+	void *arg;
+	int64_t index;
+	int64_t *num_pending; // Tasks from the same run_tasks() call not finished yet
+};
+
+struct task_deque_s {
+	struct task_s *tasks;
+	int64_t front;
+	int64_t back; // One past the last task
+	int64_t max_tasks;
+	thread_lock lock;
+};
+
+// Kept on separate cache lines as each thread updates its own all the time.
+struct thread_stats_s {
+	double busy; // Time spent running tasks, not counting waiting for tasks it added to be finished
+	double idle; // Time spent in run_tasks() not running tasks
+	int64_t num_run;
+	int64_t num_stolen;
+	int depth; // Number of tasks the thread is running inside each other
+} __attribute__((aligned(64)));
+
+static struct task_deque_s *deques;
+static struct thread_stats_s *thread_stats;
+static int num_deques;
+static bool running; // true while the team of threads is running tasks
+
+void init_tasks() {
+	num_deques = get_max_threads();
+	deques = calloc(num_deques, sizeof(struct task_deque_s));
+	thread_stats = aligned_alloc(64, num_deques * sizeof(struct thread_stats_s));
+	int i;
+	for (i = 0; i < num_deques; i++) {
+		init_thread_lock(&deques[i].lock);
+		thread_stats[i].busy = 0.0;
+		thread_stats[i].idle = 0.0;
+		thread_stats[i].num_run = 0;
+		thread_stats[i].num_stolen = 0;
+		thread_stats[i].depth = 0;
+	}
+}
+
+void free_tasks() {
+	int i;
+	for (i = 0; i < num_deques; i++) {
+		destroy_thread_lock(&deques[i].lock);
+		free(deques[i].tasks);
+	}
+	free(deques);
+	free(thread_stats);
+	num_deques = 0;
+}
+
+static void push_task(struct task_deque_s *d, const struct task_s *t) {
+	lock_thread_lock(&d->lock);
+	if (d->back >= d->max_tasks) {
+		d->max_tasks = d->max_tasks == 0 ? 64 : d->max_tasks * 2;
+		d->tasks = realloc(d->tasks, d->max_tasks * sizeof(struct task_s));
+	}
+	d->tasks[d->back++] = *t;
+	unlock_thread_lock(&d->lock);
+}
+
+// Takes the task at the back of the thread's own deque.
+// If "num_pending" is not NULL the task is only taken if it came from the
+// run_tasks() call it belongs to.
+static bool pop_task(struct task_deque_s *d, struct task_s *t, const int64_t *num_pending) {
+	bool found = false;
+	lock_thread_lock(&d->lock);
+	if (d->back > d->front && (num_pending == NULL || d->tasks[d->back - 1].num_pending == num_pending)) {
+		*t = d->tasks[--d->back];
+		found = true;
+	}
+	if (d->back == d->front) {
+		d->front = 0;
+		d->back = 0;
+	}
+	unlock_thread_lock(&d->lock);
+	return found;
+}
+
+// Takes the task at the front of another thread's deque, trying each of the
+// other threads in turn starting from the next one.
+static bool steal_task(const int me, struct task_s *t) {
+	int i;
+	for (i = 1; i < num_deques; i++) {
+		struct task_deque_s *d = &deques[(me + i) % num_deques];
+		bool found = false;
+		lock_thread_lock(&d->lock);
+		if (d->back > d->front) {
+			*t = d->tasks[d->front++];
+			found = true;
+		}
+		unlock_thread_lock(&d->lock);
+		if (found) {
+			thread_stats[me].num_stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void run_task(const int me, const struct task_s *t) {
+	struct thread_stats_s *s = &thread_stats[me];
+	double start = s->depth == 0 ? get_wall_time() : 0.0;
+	s->depth++;
+	t->func(t->arg, t->index);
+	s->depth--;
+	s->num_run++;
+	if (s->depth == 0) {
+		s->busy += get_wall_time() - start;
+	}
+	__atomic_fetch_sub(t->num_pending, 1, __ATOMIC_RELEASE);
+}
+
+static bool are_tasks_finished(const int64_t *num_pending) {
+	return __atomic_load_n(num_pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Run by every thread in the team until all of the tasks are finished.
+static void run_tasks_on_thread(const int64_t *num_pending) {
+	int me = get_thread_num();
+	struct thread_stats_s *s = &thread_stats[me];
+	double start = get_wall_time();
+	double busy = s->busy;
+	struct task_s t;
+	while (!are_tasks_finished(num_pending)) {
+		if (pop_task(&deques[me], &t, NULL) || steal_task(me, &t)) {
+			run_task(me, &t);
+		} else {
+			sched_yield();
+		}
+	}
+	s->idle += (get_wall_time() - start) - (s->busy - busy);
+}
+
+// Called from inside a task. Only the tasks added here are run while waiting
+// for them, as another task could need the thread's scratch space the calling
+// task is still using. Time spent waiting for tasks other threads have stolen
+// is counted as idle time.
+static void run_tasks_inside_task(const task_func func, void *arg, const int64_t num_tasks) {
+	int me = get_thread_num();
+	struct thread_stats_s *s = &thread_stats[me];
+	int64_t num_pending = num_tasks;
+	struct task_s t = { func, arg, 0, &num_pending };
+	int64_t i;
+	for (i = num_tasks - 1; i >= 0; i--) {
+		t.index = i;
+		push_task(&deques[me], &t);
+	}
+	while (pop_task(&deques[me], &t, &num_pending)) {
+		run_task(me, &t);
+	}
+	double start = get_wall_time();
+	while (!are_tasks_finished(&num_pending)) {
+		sched_yield();
+	}
+	double waited = get_wall_time() - start;
+	s->busy -= waited;
+	s->idle += waited;
+}
+
+// Runs func(arg, i) for each i from 0 to num_tasks - 1, sharing them out
+// between threads, and returns once they are all finished.
+// Tasks can be run in any order, so they should only change things that no
+// other task in the same call uses.
+// Each thread starts with an even share of the tasks, in order, and runs them
+// from the first.
+void run_tasks(const task_func func, void *arg, const int64_t num_tasks) {
+	if (num_tasks == 0) {
+		return;
+	}
+	if (num_deques <= 1 || num_tasks == 1) {
+		int64_t i;
+		for (i = 0; i < num_tasks; i++) {
+			func(arg, i);
+		}
+		return;
+	}
+	if (running) {
+		run_tasks_inside_task(func, arg, num_tasks);
+		return;
+	}
+	int64_t num_pending = num_tasks;
+	struct task_s t = { func, arg, 0, &num_pending };
+	int d;
+	for (d = 0; d < num_deques; d++) {
+		int64_t first = (num_tasks * d) / num_deques;
+		int64_t last = (num_tasks * (d + 1)) / num_deques;
+		int64_t i;
+		for (i = last - 1; i >= first; i--) {
+			t.index = i;
+			push_task(&deques[d], &t);
+		}
+	}
+	running = true;
+	#pragma omp parallel num_threads(num_deques)
+	run_tasks_on_thread(&num_pending);
+	running = false;
+}
+
+// So that the load balance can be checked.
+void print_task_stats() {
+	int i;
+	for (i = 0; i < num_deques; i++) {
+		struct thread_stats_s *s = &thread_stats[i];
+		printf("Thread %d: busy %f s, idle %f s, %ld tasks run, %ld stolen\n", i, s->busy, s->idle, s->num_run, s->num_stolen);
+	}
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Function run for a task, given the "arg" passed to run_tasks() and the
+// task's index.
+typedef void (*task_func)(void *arg, const int64_t index);
+
+void init_tasks();
+void free_tasks();
+void run_tasks(const task_func func, void *arg, const int64_t num_tasks);
+void print_task_stats();
@@ -1,12 +1,25 @@
 #include <float.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "collision.h"
+#include "io.h"
+#include "event.h"
+#include "event_queue.h"
 #include "grid.h"
+#include "morton.h"
+#include "params.h"
+#include "pair_kernel.h"
+#include "sector.h"
 #include "simulation.h"
 #include "sphere.h"
+#include "sphere_events.h"
+#include "tasks.h"
+#include "threads.h"
 #include "vector_3.h"
+#include "window.h"
 
 struct test_data_s {
 	struct sphere_s *s1;
@@ -57,8 +70,8 @@ static void test_harness(struct test_data_s *data){
 	if(!check_grid_collisions(data)){
 		return;
 	}
-	double momentum_before = (data->s1->vel.x * data->s1->mass) + (data->s2->vel.x * data->s2->mass);
-	double energy_before = (0.5 * (data->s1->vel.x * data->s1->vel.x) * data->s1->mass) + (0.5 * (data->s2->vel.x * data->s2->vel.x) * data->s2->mass);
+	double momentum_before = (data->s1->vel.x * get_sphere_mass(data->s1)) + (data->s2->vel.x * get_sphere_mass(data->s2));
+	double energy_before = (0.5 * (data->s1->vel.x * data->s1->vel.x) * get_sphere_mass(data->s1)) + (0.5 * (data->s2->vel.x * data->s2->vel.x) * get_sphere_mass(data->s2));
 	apply_event_for_test(data);
 	if (data->s1->vel.x != data->s1_vel_after.x || data->s1->vel.y != data->s1_vel_after.y || data->s1->vel.z != data->s1_vel_after.z) {
 		printf("%s: FAILED. Sphere one has incorrect velocity after collision\n", data->test_name);
@@ -68,8 +81,8 @@ static void test_harness(struct test_data_s *data){
 		printf("%s: FAILED. Sphere two has incorrect velocity after collision\n", data->test_name);
 		return;
 	}
-	double momentum_after = (data->s1->vel.x * data->s1->mass) + (data->s2->vel.x * data->s2->mass);
-	double energy_after = (0.5 * (data->s1->vel.x * data->s1->vel.x) * data->s1->mass) + (0.5 * (data->s2->vel.x * data->s2->vel.x) * data->s2->mass);
+	double momentum_after = (data->s1->vel.x * get_sphere_mass(data->s1)) + (data->s2->vel.x * get_sphere_mass(data->s2));
+	double energy_after = (0.5 * (data->s1->vel.x * data->s1->vel.x) * get_sphere_mass(data->s1)) + (0.5 * (data->s2->vel.x * data->s2->vel.x) * get_sphere_mass(data->s2));
 	if (momentum_before != momentum_after) {
 		printf("%s: FAILED. After collision momentum was not conserved\n", data->test_name);
 		return;
@@ -89,12 +102,12 @@ static void test_1() {
 	struct sphere_s s1;
 	s1.vel.x = 0.0; s1.vel.y = 0.0; s1.vel.z = 0.0;
 	s1.pos.x = 10.0; s1.pos.y = 10.0; s1.pos.z = 10.0;
-	s1.mass = 1.0; s1.radius = 1.0;
+	s1.species = find_or_add_species(1.0, 1.0);
 	// Set up second sphere
 	struct sphere_s s2;
 	s2.vel.x = -1.0; s2.vel.y = 0.0; s2.vel.z = 0.0;
 	s2.pos.x = 20.0; s2.pos.y = 10.0; s2.pos.z = 10.0;
-	s2.mass = 1.0; s2.radius = 1.0;
+	s2.species = find_or_add_species(1.0, 1.0);
 	// Set up grid boundaries
 	sim_data.grid_size.x = 100.0;
 	sim_data.grid_size.y = 100.0;
@@ -123,12 +136,12 @@ static void test_2() {
 	struct sphere_s s1;
 	s1.vel.x = 1.0; s1.vel.y = 0.0; s1.vel.z = 0.0;
 	s1.pos.x = 10.0; s1.pos.y = 10.0; s1.pos.z = 10.0;
-	s1.mass = 1.0; s1.radius = 1.0;
+	s1.species = find_or_add_species(1.0, 1.0);
 	// Set up second sphere
 	struct sphere_s s2;
 	s2.vel.x = -1.0; s2.vel.y = 0.0; s2.vel.z = 0.0;
 	s2.pos.x = 20.0; s2.pos.y = 10.0; s2.pos.z = 10.0;
-	s2.mass = 1.0; s2.radius = 1.0;
+	s2.species = find_or_add_species(1.0, 1.0);
 	// Set up grid boundaries
 	sim_data.grid_size.x = 50.0;
 	sim_data.grid_size.y = 50.0;
@@ -155,12 +168,12 @@ static void test_3() {
 	struct sphere_s s1;
 	s1.vel.x = 0.0; s1.vel.y = 1.0; s1.vel.z = 0.0;
 	s1.pos.x = 10.0; s1.pos.y = 10.0; s1.pos.z = 10.0;
-	s1.mass = 1.0; s1.radius = 1.0;
+	s1.species = find_or_add_species(1.0, 1.0);
 	// Set up second sphere
 	struct sphere_s s2;
 	s2.vel.x = 0.0; s2.vel.y = -1.0; s2.vel.z = 0.0;
 	s2.pos.x = 10.0; s2.pos.y = 20.0; s2.pos.z = 10.0;
-	s2.mass = 1.0; s2.radius = 1.0;
+	s2.species = find_or_add_species(1.0, 1.0);
 	// Set up grid boundaries
 	sim_data.grid_size.x = 50.0;
 	sim_data.grid_size.y = 50.0;
@@ -187,12 +200,12 @@ static void test_4() {
 	struct sphere_s s1;
 	s1.vel.x = 0.0; s1.vel.y = 0.0; s1.vel.z = 1.0;
 	s1.pos.x = 10.0; s1.pos.y = 10.0; s1.pos.z = 10.0;
-	s1.mass = 1.0; s1.radius = 1.0;
+	s1.species = find_or_add_species(1.0, 1.0);
 	// Set up second sphere
 	struct sphere_s s2;
 	s2.vel.x = 0.0; s2.vel.y = 0.0; s2.vel.z = -1.0;
 	s2.pos.x = 10.0; s2.pos.y = 10.0; s2.pos.z = 20.0;
-	s2.mass = 1.0; s2.radius = 1.0;
+	s2.species = find_or_add_species(1.0, 1.0);
 	// Set up grid boundaries
 	sim_data.grid_size.x = 50.0;
 	sim_data.grid_size.y = 50.0;
@@ -213,10 +226,1144 @@ static void test_4() {
 	test_harness(&data);
 }
 
+// Number of random pairs the collision time solvers are compared on.
+#define SOLVER_TEST_NUM_PAIRS 4000000
+// Spheres in each block given to the pair kernel when comparing it.
+#define SOLVER_TEST_BLOCK_SIZE 64
+// Radii are picked from this many random species, as a species per pair would
+// fill the species table with millions of entries.
+#define SOLVER_TEST_NUM_SPECIES 1024
+
+static int32_t solver_species[SOLVER_TEST_NUM_SPECIES];
+
+// The ways random pairs are set up, see set_random_pair.
+enum pair_kind {
+	PAIR_RANDOM = 0,
+	PAIR_HEAD_ON = 1,
+	PAIR_GRAZING = 2,
+	PAIR_TOUCHING = 3,
+	NUM_PAIR_KINDS = 4
+};
+
+static char *pair_kind_names[NUM_PAIR_KINDS] = { "random", "head on", "grazing", "touching" };
+
+struct solver_results_s {
+	char *name;
+	double seconds;
+	double max_rel_error[NUM_PAIR_KINDS];
+	double total_rel_error[NUM_PAIR_KINDS];
+	int64_t num_compared[NUM_PAIR_KINDS]; // pairs where both the solver and the reference found a collision
+	int64_t num_mismatched[NUM_PAIR_KINDS]; // pairs where only one of them found a collision
+};
+
+static double random_double(const double min, const double max) {
+	return min + ((max - min) * ((double)rand() / RAND_MAX));
+}
+
+static void set_random_vector(union vector_3d *v, const double min, const double max) {
+	v->x = random_double(min, max);
+	v->y = random_double(min, max);
+	v->z = random_double(min, max);
+}
+
+// Sets up the pair so the paths of the spheres pass within "closest_dist" of
+// each other, with the spheres "dist" apart and moving towards each other.
+static void set_pair_on_course(struct sphere_s *s1, struct sphere_s *s2, const double dist, const double closest_dist) {
+	union vector_3d dir;
+	set_random_vector(&dir, -1.0, 1.0);
+	normalise_vector_3d(&dir);
+	s2->pos.x = s1->pos.x + (dir.x * dist);
+	s2->pos.y = s1->pos.y + (dir.y * dist);
+	s2->pos.z = s1->pos.z + (dir.z * dist);
+	// Find a direction at right angles to dir
+	union vector_3d other;
+	set_random_vector(&other, -1.0, 1.0);
+	union vector_3d perp;
+	perp.x = (dir.y * other.z) - (dir.z * other.y);
+	perp.y = (dir.z * other.x) - (dir.x * other.z);
+	perp.z = (dir.x * other.y) - (dir.y * other.x);
+	normalise_vector_3d(&perp);
+	double k = closest_dist / sqrt((dist * dist) - (closest_dist * closest_dist));
+	double speed = random_double(0.1, 10.0);
+	set_random_vector(&s2->vel, -1.0, 1.0);
+	s1->vel.x = s2->vel.x + (speed * (dir.x + (k * perp.x)));
+	s1->vel.y = s2->vel.y + (speed * (dir.y + (k * perp.y)));
+	s1->vel.z = s2->vel.z + (speed * (dir.z + (k * perp.z)));
+}
+
+// Sets up a random pair of spheres.
+// Apart from pairs placed completely randomly, pairs are set up to hit head on,
+// to only just graze each other, and to start only just apart, as these are the
+// cases where the solvers are most likely to lose precision.
+static void set_random_pair(struct sphere_s *s1, struct sphere_s *s2, const enum pair_kind kind) {
+	s1->species = solver_species[rand() % SOLVER_TEST_NUM_SPECIES];
+	s2->species = solver_species[rand() % SOLVER_TEST_NUM_SPECIES];
+	set_random_vector(&s1->pos, 0.0, 100.0);
+	double r_total = get_sphere_radius(s1) + get_sphere_radius(s2);
+	double small = pow(10.0, -random_double(2.0, 12.0));
+	switch (kind) {
+	case PAIR_HEAD_ON:
+		set_pair_on_course(s1, s2, random_double(r_total, 50.0), r_total * small);
+		break;
+	case PAIR_GRAZING:
+		set_pair_on_course(s1, s2, random_double(r_total * 2.0, 50.0), r_total * (1.0 - small));
+		break;
+	case PAIR_TOUCHING:
+		set_pair_on_course(s1, s2, r_total * (1.0 + small), random_double(0.0, r_total));
+		break;
+	default:
+		set_random_vector(&s2->pos, 0.0, 100.0);
+		set_random_vector(&s1->vel, -10.0, 10.0);
+		set_random_vector(&s2->vel, -10.0, 10.0);
+		break;
+	}
+}
+
+// Finds the collision time in extended precision to compare the solvers against.
+// Returns DBL_MAX if the spheres will not collide.
+static long double find_reference_collision_time(const struct sphere_s *s1, const struct sphere_s *s2) {
+	long double px = (long double)s2->pos.x - s1->pos.x;
+	long double py = (long double)s2->pos.y - s1->pos.y;
+	long double pz = (long double)s2->pos.z - s1->pos.z;
+	long double vx = (long double)s1->vel.x - s2->vel.x;
+	long double vy = (long double)s1->vel.y - s2->vel.y;
+	long double vz = (long double)s1->vel.z - s2->vel.z;
+	long double r = (long double)get_sphere_radius(s1) + get_sphere_radius(s2);
+	long double pv = (px * vx) + (py * vy) + (pz * vz);
+	long double vv = (vx * vx) + (vy * vy) + (vz * vz);
+	long double c = (px * px) + (py * py) + (pz * pz) - (r * r);
+	long double disc = (pv * pv) - (vv * c);
+	if (pv <= 0.0L || disc < 0.0L) {
+		return DBL_MAX;
+	}
+	long double t = c / (pv + sqrtl(disc));
+	return t > 0.0L ? t : 0.0L;
+}
+
+// Pair i is of kind i % NUM_PAIR_KINDS.
+static void compare_with_reference(struct solver_results_s *results, const double *times, const long double *ref_times) {
+	int64_t i;
+	for (i = 0; i < SOLVER_TEST_NUM_PAIRS; i++) {
+		enum pair_kind kind = i % NUM_PAIR_KINDS;
+		bool hit = times[i] != DBL_MAX;
+		bool ref_hit = ref_times[i] != DBL_MAX;
+		if (hit != ref_hit) {
+			results->num_mismatched[kind]++;
+		} else if (hit && ref_times[i] > 0.0L) {
+			double err = (double)fabsl((times[i] - ref_times[i]) / ref_times[i]);
+			if (err > results->max_rel_error[kind]) {
+				results->max_rel_error[kind] = err;
+			}
+			results->total_rel_error[kind] += err;
+			results->num_compared[kind]++;
+		}
+	}
+}
+
+static double get_max_rel_error(const struct solver_results_s *results) {
+	double err = 0.0;
+	int kind;
+	for (kind = 0; kind < NUM_PAIR_KINDS; kind++) {
+		if (results->max_rel_error[kind] > err) {
+			err = results->max_rel_error[kind];
+		}
+	}
+	return err;
+}
+
+static int64_t get_num_mismatched(const struct solver_results_s *results) {
+	int64_t n = 0;
+	int kind;
+	for (kind = 0; kind < NUM_PAIR_KINDS; kind++) {
+		n += results->num_mismatched[kind];
+	}
+	return n;
+}
+
+static void run_solver(
+	struct solver_results_s *results, double (*solver)(const struct sphere_s *, const struct sphere_s *),
+	const struct sphere_s *s1, const struct sphere_s *s2, double *times
+){
+	clock_t start = clock();
+	int64_t i;
+	for (i = 0; i < SOLVER_TEST_NUM_PAIRS; i++) {
+		times[i] = solver(&s1[i], &s2[i]);
+	}
+	results->seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void print_solver_results(const struct solver_results_s *results) {
+	printf("%s: %.3f seconds, %.0f pairs/s\n", results->name, results->seconds, SOLVER_TEST_NUM_PAIRS / results->seconds);
+	int kind;
+	for (kind = 0; kind < NUM_PAIR_KINDS; kind++) {
+		printf("\t%-10s max rel err %-14.6g mean rel err %-14.6g mismatched %ld\n",
+			pair_kind_names[kind], results->max_rel_error[kind],
+			results->total_rel_error[kind] / results->num_compared[kind], results->num_mismatched[kind]
+		);
+	}
+}
+
+// Checks the pair kernel against the solver it is built to use.
+// The second spheres are split into blocks, and the first sphere of each
+// block's first pair is checked against the whole block, so every pair the
+// kernel checks is also timed.
+static bool test_pair_kernel(struct solver_results_s *results, const struct sphere_s *s1, struct sphere_s *s2) {
+	struct sphere_block_s block = {0};
+	bool passed = true;
+	results->seconds = 0.0;
+	int64_t i;
+	for (i = 0; i + SOLVER_TEST_BLOCK_SIZE <= SOLVER_TEST_NUM_PAIRS; i += SOLVER_TEST_BLOCK_SIZE) {
+		clear_sphere_block(&block);
+		int64_t j;
+		for (j = 0; j < SOLVER_TEST_BLOCK_SIZE; j++) {
+			add_sphere_to_block(&block, &s2[i + j]);
+		}
+		double time;
+		clock_t start = clock();
+		int64_t soonest = find_soonest_collision_in_block(&s1[i], &block, 0, &time);
+		results->seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+		double expected_time = DBL_MAX;
+		int64_t expected = -1;
+		for (j = 0; j < SOLVER_TEST_BLOCK_SIZE; j++) {
+			double t = find_collision_time_spheres(&s1[i], &s2[i + j]);
+			if (t < expected_time) {
+				expected_time = t;
+				expected = j;
+			}
+		}
+		if (soonest != expected || time != expected_time) {
+			passed = false;
+		}
+	}
+	free_sphere_block(&block);
+	return passed;
+}
+
+// Compares the trigonometry and quadratic solvers on a large number of random
+// pairs, timing them and measuring their error against an extended precision
+// reference. Also checks the pair kernel gives the same results as the
+// solver chosen at build time.
+// Neither solver can be exact when the spheres only just touch or graze, as
+// rounding the squared distance between them is then a large part of the
+// result, so the quadratic solver passes if it is no less accurate than the
+// trigonometry solver.
+static void test_solvers() {
+	struct sphere_s *s1 = malloc(SOLVER_TEST_NUM_PAIRS * sizeof(struct sphere_s));
+	struct sphere_s *s2 = malloc(SOLVER_TEST_NUM_PAIRS * sizeof(struct sphere_s));
+	double *times = malloc(SOLVER_TEST_NUM_PAIRS * sizeof(double));
+	long double *ref_times = malloc(SOLVER_TEST_NUM_PAIRS * sizeof(long double));
+	srand(1);
+	int64_t i;
+	for (i = 0; i < SOLVER_TEST_NUM_SPECIES; i++) {
+		solver_species[i] = find_or_add_species(random_double(0.5, 2.0), 1.0);
+	}
+	for (i = 0; i < SOLVER_TEST_NUM_PAIRS; i++) {
+		set_random_pair(&s1[i], &s2[i], i % NUM_PAIR_KINDS);
+		ref_times[i] = find_reference_collision_time(&s1[i], &s2[i]);
+	}
+	struct solver_results_s trig = { .name = "trig" };
+	run_solver(&trig, find_collision_time_spheres_trig, s1, s2, times);
+	compare_with_reference(&trig, times, ref_times);
+	struct solver_results_s quadratic = { .name = "quadratic" };
+	run_solver(&quadratic, find_collision_time_spheres_quadratic, s1, s2, times);
+	compare_with_reference(&quadratic, times, ref_times);
+	struct solver_results_s kernel = { .name = "kernel" };
+	init_pair_kernel();
+	bool kernel_passed = test_pair_kernel(&kernel, s1, s2);
+	printf("Compared solvers on %d random pairs\n", SOLVER_TEST_NUM_PAIRS);
+	print_solver_results(&trig);
+	print_solver_results(&quadratic);
+	printf("%s: %.3f seconds, %.0f pairs/s using %s\n", kernel.name, kernel.seconds, SOLVER_TEST_NUM_PAIRS / kernel.seconds, get_pair_kernel_name());
+	if (get_max_rel_error(&quadratic) > get_max_rel_error(&trig) || get_num_mismatched(&quadratic) > get_num_mismatched(&trig)) {
+		printf("Solver test: FAILED. Quadratic solver is less accurate than the trigonometry solver\n");
+	} else if (!kernel_passed) {
+		printf("Solver test: FAILED. Pair kernel does not match find_collision_time_spheres\n");
+	} else {
+		printf("Solver test: PASSED.\n");
+	}
+	free(s1);
+	free(s2);
+	free(times);
+	free(ref_times);
+}
+
+// Sector populations the pair loops are timed at.
+static const int64_t PAIR_BENCHMARK_NUM_SPHERES[] = { 1000, 10000, 100000, 1000000 };
+#define PAIR_BENCHMARK_NUM_SIZES 4
+// Number of spheres checked against every sphere in the sector.
+#define PAIR_BENCHMARK_NUM_CHECKED 1024
+// Cutoff given to the pruned pair loop. Spheres are around 10 apart and move at
+// up to sqrt(3), so most pairs are too far apart to collide before it.
+#define PAIR_BENCHMARK_CUTOFF 2.0
+
+// Times checking PAIR_BENCHMARK_NUM_CHECKED spheres against every sphere in a
+// sector of each size in PAIR_BENCHMARK_NUM_SPHERES, both by checking each
+// sphere against the whole sector in turn and with
+// find_soonest_collisions_between_blocks, which splits the sector into tiles
+// that fit in cache. The tiled loop is also timed with a cutoff of
+// PAIR_BENCHMARK_CUTOFF, where pairs that are too far apart are skipped.
+// Also checks that all of them give the same soonest partner for every sphere,
+// ignoring partners after the cutoff for the pruned loop.
+static void benchmark_pair_loops() {
+	printf("Pair tests per second checking %d spheres against a sector using %s\n", PAIR_BENCHMARK_NUM_CHECKED, get_pair_kernel_name());
+	printf("%10s %16s %16s %16s %10s\n", "spheres", "untiled", "tiled", "pruned", "skipped");
+	struct sphere_s *checked = malloc(PAIR_BENCHMARK_NUM_CHECKED * sizeof(struct sphere_s));
+	int64_t *indices = malloc(PAIR_BENCHMARK_NUM_CHECKED * sizeof(int64_t));
+	double *times = malloc(PAIR_BENCHMARK_NUM_CHECKED * sizeof(double));
+	int64_t *pruned_indices = malloc(PAIR_BENCHMARK_NUM_CHECKED * sizeof(int64_t));
+	double *pruned_times = malloc(PAIR_BENCHMARK_NUM_CHECKED * sizeof(double));
+	struct sphere_block_s checked_block = {0};
+	struct sphere_block_s sector_block = {0};
+	bool passed = true;
+	int n;
+	for (n = 0; n < PAIR_BENCHMARK_NUM_SIZES; n++) {
+		int64_t num_spheres = PAIR_BENCHMARK_NUM_SPHERES[n];
+		struct sphere_s *spheres = malloc(num_spheres * sizeof(struct sphere_s));
+		// Keep the same density of spheres at each size.
+		// Like the config generator, spheres are laid out in order on a
+		// lattice, here with a random offset within each lattice cell.
+		int64_t side = (int64_t)ceil(cbrt(num_spheres));
+		double size = side * 10.0;
+		srand(1);
+		clear_sphere_block(&sector_block);
+		int64_t i;
+		for (i = 0; i < num_spheres; i++) {
+			set_random_vector(&spheres[i].pos, 1.0, 9.0);
+			spheres[i].pos.x += (i / (side * side)) * 10.0;
+			spheres[i].pos.y += ((i / side) % side) * 10.0;
+			spheres[i].pos.z += (i % side) * 10.0;
+			set_random_vector(&spheres[i].vel, -1.0, 1.0);
+			spheres[i].species = find_or_add_species(1.0, 1.0);
+			add_sphere_to_block(&sector_block, &spheres[i]);
+		}
+		clear_sphere_block(&checked_block);
+		for (i = 0; i < PAIR_BENCHMARK_NUM_CHECKED; i++) {
+			set_random_vector(&checked[i].pos, 0.0, size);
+			set_random_vector(&checked[i].vel, -1.0, 1.0);
+			checked[i].species = find_or_add_species(1.0, 1.0);
+			add_sphere_to_block(&checked_block, &checked[i]);
+		}
+		double num_pairs = (double)num_spheres * PAIR_BENCHMARK_NUM_CHECKED;
+		for (i = 0; i < PAIR_BENCHMARK_NUM_CHECKED; i++) {
+			times[i] = DBL_MAX;
+			pruned_times[i] = PAIR_BENCHMARK_CUTOFF;
+		}
+		clock_t start = clock();
+		find_soonest_collisions_between_blocks(&checked_block, &sector_block, indices, times);
+		double tiled_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		start = clock();
+		int64_t num_skipped = find_soonest_collisions_between_blocks(&checked_block, &sector_block, pruned_indices, pruned_times);
+		double pruned_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		for (i = 0; i < PAIR_BENCHMARK_NUM_CHECKED; i++) {
+			int64_t expected = times[i] < PAIR_BENCHMARK_CUTOFF ? indices[i] : -1;
+			if (pruned_indices[i] != expected || (expected != -1 && pruned_times[i] != times[i])) {
+				passed = false;
+			}
+		}
+		start = clock();
+		for (i = 0; i < PAIR_BENCHMARK_NUM_CHECKED; i++) {
+			double time;
+			int64_t j = find_soonest_collision_in_block(&checked[i], &sector_block, 0, &time);
+			if (j != indices[i] || time != times[i]) {
+				passed = false;
+			}
+		}
+		double untiled_seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("%10ld %16.0f %16.0f %16.0f %9.1f%%\n", num_spheres, num_pairs / untiled_seconds, num_pairs / tiled_seconds, num_pairs / pruned_seconds, 100.0 * num_skipped / num_pairs);
+		free(spheres);
+	}
+	free_sphere_block(&checked_block);
+	free_sphere_block(&sector_block);
+	free(checked);
+	free(indices);
+	free(times);
+	free(pruned_indices);
+	free(pruned_times);
+	if (passed) {
+		printf("Pair loop test: PASSED.\n");
+	} else {
+		printf("Pair loop test: FAILED. Untiled, tiled and pruned pair loops found different partners\n");
+	}
+}
+
+// Number of spheres, nearly all with their own radius, added to a sector and
+// removed again in a random order by the largest radius test.
+#define RADIUS_TEST_NUM_SPHERES 2000
+
+// Adds spheres with nearly every radius different to a sector, as with a
+// continuous size distribution, then removes them in a random order checking
+// the sector's largest radius against the largest left after each removal.
+static bool check_largest_radius_polydisperse() {
+	struct sphere_s *spheres = calloc(RADIUS_TEST_NUM_SPHERES, sizeof(struct sphere_s));
+	int *order = malloc(RADIUS_TEST_NUM_SPHERES * sizeof(int));
+	bool *removed = calloc(RADIUS_TEST_NUM_SPHERES, sizeof(bool));
+	struct sector_s sector = { 0 };
+	bool passed = true;
+	srand(1);
+	int i, j;
+	for (i = 0; i < RADIUS_TEST_NUM_SPHERES; i++) {
+		// Every tenth sphere shares a radius so some counts go above one
+		double radius = i % 10 == 0 ? 1.0 : random_double(0.5, 2.0);
+		spheres[i].species = find_or_add_species(radius, 1.0);
+		add_sphere_to_sector(&sector, &spheres[i]);
+		order[i] = i;
+	}
+	for (i = RADIUS_TEST_NUM_SPHERES - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		int tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < RADIUS_TEST_NUM_SPHERES; i++) {
+		remove_sphere_from_sector(&sector, &spheres[order[i]]);
+		removed[order[i]] = true;
+		double expected = 0.0;
+		for (j = 0; j < RADIUS_TEST_NUM_SPHERES; j++) {
+			if (!removed[j]) {
+				expected = fmax(expected, get_sphere_radius(&spheres[j]));
+			}
+		}
+		if (sector.largest_radius != expected) {
+			passed = false;
+		}
+	}
+	free(sector.spheres);
+	free(sector.radii);
+	free(sector.radius_slots);
+	free(spheres);
+	free(order);
+	free(removed);
+	return passed;
+}
+
+// Spheres of several radii are added to a sector and removed again in an order
+// that makes the largest radius unique, shared and then gone, checking the
+// sector's largest radius after every step.
+static void test_largest_radius() {
+	static const double radii[] = { 1.0, 3.0, 2.0, 3.0, 0.5 };
+	static const int removal_order[] = { 1, 3, 0, 2, 4 };
+	// Largest radius expected after each removal
+	static const double expected[] = { 3.0, 2.0, 2.0, 0.5, 0.0 };
+	const int num = sizeof(radii) / sizeof(radii[0]);
+	struct sphere_s spheres[sizeof(radii) / sizeof(radii[0])] = { 0 };
+	struct sector_s sector = { 0 };
+	bool passed = true;
+	int i;
+	for (i = 0; i < num; i++) {
+		spheres[i].species = find_or_add_species(radii[i], 1.0);
+		add_sphere_to_sector(&sector, &spheres[i]);
+	}
+	if (sector.largest_radius != 3.0) {
+		passed = false;
+	}
+	for (i = 0; i < num; i++) {
+		remove_sphere_from_sector(&sector, &spheres[removal_order[i]]);
+		if (sector.largest_radius != expected[i]) {
+			passed = false;
+		}
+	}
+	if (!check_largest_radius_polydisperse()) {
+		passed = false;
+	}
+	if (passed) {
+		printf("Largest radius test: PASSED.\n");
+	} else {
+		printf("Largest radius test: FAILED. Sector's largest radius was wrong after adding or removing a sphere\n");
+	}
+	free(sector.spheres);
+	free(sector.radii);
+	free(sector.radius_slots);
+}
+
+// Spheres are added to a sector, some of them resting, then set moving or
+// resting and removed, checking the sector's count of resting spheres.
+static void test_resting_count() {
+	struct sphere_s spheres[4] = { 0 };
+	struct sector_s sector = { 0 };
+	int32_t species = find_or_add_species(1.0, 1.0);
+	int i;
+	for (i = 0; i < 4; i++) {
+		spheres[i].species = species;
+		spheres[i].vel.x = i % 2 == 0 ? 0.0 : 1.0;
+		add_sphere_to_sector(&sector, &spheres[i]);
+	}
+	bool passed = sector.num_resting == 2;
+	spheres[0].vel.y = -1.0;
+	set_sector_sphere_data(&sector, &spheres[0]);
+	passed = passed && sector.num_resting == 1;
+	spheres[1].vel.x = 0.0;
+	set_sector_sphere_data(&sector, &spheres[1]);
+	passed = passed && sector.num_resting == 2;
+	// Removing the first sphere moves the last, resting, one into its place
+	remove_sphere_from_sector(&sector, &spheres[0]);
+	passed = passed && sector.num_resting == 2;
+	remove_sphere_from_sector(&sector, &spheres[2]);
+	passed = passed && sector.num_resting == 1;
+	if (passed) {
+		printf("Resting count test: PASSED.\n");
+	} else {
+		printf("Resting count test: FAILED. Sector's number of resting spheres was wrong\n");
+	}
+	free(sector.spheres);
+	free(sector.radii);
+	free(sector.radius_slots);
+}
+
+// Compares get_morton_code against interleaving the bits one at a time.
+static void test_morton_codes() {
+	const int32_t max = (1 << MORTON_BITS_PER_AXIS) - 1;
+	bool passed = true;
+	int i;
+	for (i = 0; i < 1000; i++) {
+		union vector_3i pos;
+		pos.x = i == 0 ? max : rand() & max;
+		pos.y = i == 0 ? max : rand() & max;
+		pos.z = i == 0 ? max : rand() & max;
+		uint64_t expected = 0;
+		int b;
+		for (b = 0; b < MORTON_BITS_PER_AXIS; b++) {
+			expected |= (uint64_t)((pos.x >> b) & 1) << (3 * b);
+			expected |= (uint64_t)((pos.y >> b) & 1) << ((3 * b) + 1);
+			expected |= (uint64_t)((pos.z >> b) & 1) << ((3 * b) + 2);
+		}
+		if (get_morton_code(&pos) != expected) {
+			passed = false;
+		}
+	}
+	if (passed) {
+		printf("Morton code test: PASSED.\n");
+	} else {
+		printf("Morton code test: FAILED. Bits of the coordinates were not interleaved correctly\n");
+	}
+}
+
+// Spheres with the same radius and mass should share a species, and any
+// difference should give a new one.
+static void test_species() {
+	int32_t a = find_or_add_species(1.5, 2.0);
+	int32_t b = find_or_add_species(1.5, 3.0);
+	int32_t c = find_or_add_species(2.0, 2.0);
+	bool passed = a != b && a != c && b != c;
+	// Enough new species to make the table grow
+	int i;
+	for (i = 0; i < 100; i++) {
+		find_or_add_species(10.0 + i, 1.0);
+	}
+	if (find_or_add_species(1.5, 2.0) != a || find_or_add_species(1.5, 3.0) != b || find_or_add_species(2.0, 2.0) != c) {
+		passed = false;
+	}
+	if (get_species_radius(b) != 1.5 || get_species_mass(b) != 3.0) {
+		passed = false;
+	}
+	if (passed) {
+		printf("Species test: PASSED.\n");
+	} else {
+		printf("Species test: FAILED. Radius and mass pairs were not given consistent species\n");
+	}
+}
+
+// Number of spheres in each sector of the sector block test.
+#define SECTOR_BLOCK_TEST_NUM_SPHERES 200
+// Time the sector blocks are filled at. Each sphere was last brought up to date
+// at a random time before it.
+#define SECTOR_BLOCK_TEST_TIME 1.0
+
+// Fills the sector with spheres of several radii whose records are behind
+// SECTOR_BLOCK_TEST_TIME, and copies them into "now" brought up to date.
+static void fill_test_sector(struct sector_s *sector, struct sphere_s *spheres, struct sphere_s *now) {
+	int i;
+	for (i = 0; i < SECTOR_BLOCK_TEST_NUM_SPHERES; i++) {
+		set_random_vector(&spheres[i].pos, 0.0, 30.0);
+		set_random_vector(&spheres[i].vel, -1.0, 1.0);
+		spheres[i].time = random_double(0.0, SECTOR_BLOCK_TEST_TIME);
+		spheres[i].species = find_or_add_species(0.5 + (0.25 * (i % 4)), 1.0);
+		add_sphere_to_sector(sector, &spheres[i]);
+		now[i] = spheres[i];
+		update_sphere_position_to_time(&now[i], SECTOR_BLOCK_TEST_TIME);
+	}
+}
+
+// Checks the soonest partner and time found for each sphere in "now" against
+// checking each pair in turn with find_collision_time_spheres.
+static bool check_soonest_partners(const struct sphere_s *now, const struct sphere_s *other_now, const int64_t *indices, const double *times) {
+	bool passed = true;
+	int i, j;
+	for (i = 0; i < SECTOR_BLOCK_TEST_NUM_SPHERES; i++) {
+		double expected_time = DBL_MAX;
+		int64_t expected = -1;
+		for (j = 0; j < SECTOR_BLOCK_TEST_NUM_SPHERES; j++) {
+			double t = find_collision_time_spheres(&now[i], &other_now[j]);
+			if (t < expected_time) {
+				expected_time = t;
+				expected = j;
+			}
+		}
+		if (indices[i] != expected || times[i] != expected_time) {
+			passed = false;
+		}
+	}
+	return passed;
+}
+
+// Blocks filled from a sector hold positions brought forward to the time they
+// are filled at, while the sphere records behind them are left at the time of
+// their last event. Checks the pair kernel, and the tiled loop scanned from
+// either sector, only use the block's copy by comparing them with the per-pair
+// solver on up to date copies of the spheres. A pair found from both sides
+// should be given the same time.
+static void test_sector_blocks() {
+	struct sphere_s *a_spheres = malloc(SECTOR_BLOCK_TEST_NUM_SPHERES * sizeof(struct sphere_s));
+	struct sphere_s *b_spheres = malloc(SECTOR_BLOCK_TEST_NUM_SPHERES * sizeof(struct sphere_s));
+	struct sphere_s *a_now = malloc(SECTOR_BLOCK_TEST_NUM_SPHERES * sizeof(struct sphere_s));
+	struct sphere_s *b_now = malloc(SECTOR_BLOCK_TEST_NUM_SPHERES * sizeof(struct sphere_s));
+	int64_t ab_indices[SECTOR_BLOCK_TEST_NUM_SPHERES], ba_indices[SECTOR_BLOCK_TEST_NUM_SPHERES];
+	double ab_times[SECTOR_BLOCK_TEST_NUM_SPHERES], ba_times[SECTOR_BLOCK_TEST_NUM_SPHERES];
+	struct sector_s a = { 0 };
+	struct sector_s b = { 0 };
+	struct sphere_block_s a_block = {0};
+	struct sphere_block_s b_block = {0};
+	srand(1);
+	fill_test_sector(&a, a_spheres, a_now);
+	fill_test_sector(&b, b_spheres, b_now);
+	add_sector_spheres_to_block(&a_block, &a, SECTOR_BLOCK_TEST_TIME, false);
+	add_sector_spheres_to_block(&b_block, &b, SECTOR_BLOCK_TEST_TIME, false);
+	init_pair_kernel();
+	int i;
+	for (i = 0; i < SECTOR_BLOCK_TEST_NUM_SPHERES; i++) {
+		ab_indices[i] = find_soonest_collision_in_block(&a_now[i], &b_block, 0, &ab_times[i]);
+	}
+	bool kernel_passed = check_soonest_partners(a_now, b_now, ab_indices, ab_times);
+	for (i = 0; i < SECTOR_BLOCK_TEST_NUM_SPHERES; i++) {
+		ab_times[i] = DBL_MAX;
+		ba_times[i] = DBL_MAX;
+	}
+	find_soonest_collisions_between_blocks(&a_block, &b_block, ab_indices, ab_times);
+	find_soonest_collisions_between_blocks(&b_block, &a_block, ba_indices, ba_times);
+	bool tiled_passed = check_soonest_partners(a_now, b_now, ab_indices, ab_times) && check_soonest_partners(b_now, a_now, ba_indices, ba_times);
+	bool symmetric = true;
+	for (i = 0; i < SECTOR_BLOCK_TEST_NUM_SPHERES; i++) {
+		int64_t j = ab_indices[i];
+		if (j != -1 && ba_indices[j] == i && ba_times[j] != ab_times[i]) {
+			symmetric = false;
+		}
+	}
+	if (!kernel_passed) {
+		printf("Sector block test: FAILED. Pair kernel does not match find_collision_time_spheres on up to date spheres\n");
+	} else if (!tiled_passed) {
+		printf("Sector block test: FAILED. Tiled pair loop does not match find_collision_time_spheres on up to date spheres\n");
+	} else if (!symmetric) {
+		printf("Sector block test: FAILED. A pair was given different times depending on which sector it was scanned from\n");
+	} else {
+		printf("Sector block test: PASSED.\n");
+	}
+	free_sphere_block(&a_block);
+	free_sphere_block(&b_block);
+	free(a.spheres);
+	free(a.radii);
+	free(a.radius_slots);
+	free(b.spheres);
+	free(b.radii);
+	free(b.radius_slots);
+	free(a_spheres);
+	free(b_spheres);
+	free(a_now);
+	free(b_now);
+}
+
+// Number of sectors in the sector event tree test. Not a power of two, so
+// some of the tree's leaves are empty.
+#define EVENT_TREE_TEST_NUM_SECTORS 7
+#define EVENT_TREE_TEST_NUM_ROUNDS 1000
+
+// Gives the sector a new event at a time drawn from a few values, so that
+// sectors often tie for the soonest event, and records its simulation time.
+static void set_test_sector_event(struct sector_s *sectors, double *times, const int i) {
+	double time = rand() % 5;
+	reset_sector_event(i);
+	set_event_details_for_sector(time, COL_SPHERE_WITH_GRID, NULL, NULL, AXIS_NONE, &sectors[i], NULL);
+	merge_sector_event(i);
+	times[i] = sectors[i].time + time;
+}
+
+// Lowest id of the sectors with the soonest event.
+static int find_soonest_test_sector(const double *times) {
+	int soonest = 0;
+	int i;
+	for (i = 1; i < EVENT_TREE_TEST_NUM_SECTORS; i++) {
+		if (times[i] < times[soonest]) {
+			soonest = i;
+		}
+	}
+	return soonest;
+}
+
+// The tournament tree over sector_events should give the sector with the
+// soonest event, the lowest id winning a tie, once every sector's event is
+// set and after changing the events of one and then two sectors at a time.
+// The sectors are at different times, as they are in a lookahead window.
+static void test_sector_event_tree() {
+	int saved_num_sectors = sim_data.num_sectors;
+	sim_data.num_sectors = EVENT_TREE_TEST_NUM_SECTORS;
+	struct sector_s *sectors = calloc(EVENT_TREE_TEST_NUM_SECTORS, sizeof(struct sector_s));
+	double times[EVENT_TREE_TEST_NUM_SECTORS];
+	sector_events = calloc(EVENT_TREE_TEST_NUM_SECTORS, sizeof(struct event_s));
+	init_sector_event_tree();
+	reset_event();
+	srand(1);
+	int i;
+	for (i = 0; i < EVENT_TREE_TEST_NUM_SECTORS; i++) {
+		sectors[i].id = i;
+		sectors[i].time = rand() % 3;
+		set_test_sector_event(sectors, times, i);
+	}
+	bool passed = get_soonest_sector_id() == find_soonest_test_sector(times);
+	for (i = 0; i < EVENT_TREE_TEST_NUM_ROUNDS; i++) {
+		set_test_sector_event(sectors, times, rand() % EVENT_TREE_TEST_NUM_SECTORS);
+		if (get_soonest_sector_id() != find_soonest_test_sector(times)) {
+			passed = false;
+		}
+		set_test_sector_event(sectors, times, rand() % EVENT_TREE_TEST_NUM_SECTORS);
+		set_test_sector_event(sectors, times, rand() % EVENT_TREE_TEST_NUM_SECTORS);
+		if (get_soonest_sector_id() != find_soonest_test_sector(times)) {
+			passed = false;
+		}
+	}
+	if (passed) {
+		printf("Sector event tree test: PASSED.\n");
+	} else {
+		printf("Sector event tree test: FAILED. Tree did not give the sector with the soonest event\n");
+	}
+	reset_event();
+	free_sector_event_tree();
+	free(sector_events);
+	sector_events = NULL;
+	free(sectors);
+	sim_data.num_sectors = saved_num_sectors;
+}
+
+// Spheres in the event queue test are on a lattice with this many on each
+// side, close enough together that most events are collisions between them.
+#define QUEUE_TEST_SIDE 6
+#define QUEUE_TEST_SPACING 6.0
+#define QUEUE_TEST_NUM_EVENTS 1000
+
+// Whether two events are the same one, allowing for the time being found from
+// a different point. The spheres in a collision can be either way round.
+static bool is_same_test_event(const struct event_s *a, const struct event_s *b) {
+	if (a->type != b->type || fabs(a->time - b->time) > 1e-9 * (1.0 + b->time)) {
+		return false;
+	}
+	if (a->type == COL_SPHERE_WITH_GRID) {
+		return a->sphere_1 == b->sphere_1 && a->grid_axis == b->grid_axis;
+	}
+	return (a->sphere_1 == b->sphere_1 && a->sphere_2 == b->sphere_2) || (a->sphere_1 == b->sphere_2 && a->sphere_2 == b->sphere_1);
+}
+
+// Runs the event queue used by -q on crowded spheres, where each collision
+// makes the entries of other spheres that predicted one with its spheres
+// stale. Rescheduling a sphere moves its entry up or down the heap, and stale
+// entries reaching the top are taken off and predicted again. Each event the
+// queue gives should be the one checking every pair finds, and the heap should
+// stay ordered after every event.
+static void test_event_queue() {
+	const int64_t num_spheres = QUEUE_TEST_SIDE * QUEUE_TEST_SIDE * QUEUE_TEST_SIDE;
+	struct sphere_s *saved_spheres = sim_data.spheres;
+	int64_t saved_num_spheres = sim_data.total_num_spheres;
+	union vector_3d saved_grid_size = sim_data.grid_size;
+	struct sphere_s *spheres = calloc(num_spheres, sizeof(struct sphere_s));
+	int32_t species = find_or_add_species(1.0, 1.0);
+	srand(1);
+	int64_t i;
+	for (i = 0; i < num_spheres; i++) {
+		union vector_3d jitter;
+		set_random_vector(&jitter, -1.0, 1.0);
+		spheres[i].pos.x = (QUEUE_TEST_SPACING * ((i % QUEUE_TEST_SIDE) + 0.5)) + jitter.x;
+		spheres[i].pos.y = (QUEUE_TEST_SPACING * (((i / QUEUE_TEST_SIDE) % QUEUE_TEST_SIDE) + 0.5)) + jitter.y;
+		spheres[i].pos.z = (QUEUE_TEST_SPACING * ((i / (QUEUE_TEST_SIDE * QUEUE_TEST_SIDE)) + 0.5)) + jitter.z;
+		set_random_vector(&spheres[i].vel, -1.0, 1.0);
+		spheres[i].species = species;
+		spheres[i].id = i;
+	}
+	sim_data.spheres = spheres;
+	sim_data.total_num_spheres = num_spheres;
+	sim_data.grid_size.x = QUEUE_TEST_SPACING * QUEUE_TEST_SIDE;
+	sim_data.grid_size.y = QUEUE_TEST_SPACING * QUEUE_TEST_SIDE;
+	sim_data.grid_size.z = QUEUE_TEST_SPACING * QUEUE_TEST_SIDE;
+	sim_data.elapsed_time = 0.0;
+	init_collision_blocks();
+	init_event_queue();
+	bool ordered = is_event_queue_ordered();
+	bool matched = true;
+	for (i = 0; i < QUEUE_TEST_NUM_EVENTS && ordered && matched; i++) {
+		reset_event();
+		find_event_times_no_dd();
+		struct event_s expected = event_details;
+		reset_event();
+		find_event_time_from_queue();
+		matched = is_same_test_event(&event_details, &expected);
+		apply_event_no_dd();
+		update_event_queue(sim_data.elapsed_time + event_details.time);
+		sim_data.elapsed_time += event_details.time;
+		ordered = is_event_queue_ordered();
+	}
+	if (!matched) {
+		printf("Event queue test: FAILED. Event %ld from the queue was not the soonest event\n", i - 1);
+	} else if (!ordered) {
+		printf("Event queue test: FAILED. Heap was out of order after event %ld\n", i - 1);
+	} else {
+		printf("Event queue test: PASSED.\n");
+	}
+	free_event_queue();
+	free_collision_blocks();
+	free(spheres);
+	sim_data.spheres = saved_spheres;
+	sim_data.total_num_spheres = saved_num_spheres;
+	sim_data.grid_size = saved_grid_size;
+	sim_data.elapsed_time = 0.0;
+	reset_event();
+}
+
+// Sets the simulation up to run the given spheres with sectors, as
+// simulation_init() does once it has read them from a file.
+static void init_test_simulation(struct sphere_s *spheres, const int64_t num_spheres, const int num_sectors_x) {
+	sim_data.spheres = spheres;
+	sim_data.total_num_spheres = num_spheres;
+	sim_data.spheres_by_id = malloc(num_spheres * sizeof(struct sphere_s *));
+	int64_t i;
+	for (i = 0; i < num_spheres; i++) {
+		sim_data.spheres_by_id[spheres[i].id] = &spheres[i];
+	}
+	sim_data.sector_dims[X_AXIS] = num_sectors_x;
+	sim_data.sector_dims[Y_AXIS] = 1;
+	sim_data.sector_dims[Z_AXIS] = 1;
+	sim_data.elapsed_time = 0.0;
+	sim_data.iteration_number = 1;
+	stats.num_two_sphere_collisions = 0;
+	stats.num_grid_collisions = 0;
+	stats.num_sector_transfers = 0;
+	stats.num_partial_crossings = 0;
+	stats.num_cell_crossings = 0;
+	init_sectors();
+	for (i = 0; i < num_spheres; i++) {
+		add_sphere_to_correct_sector(&spheres[i]);
+	}
+	init_pair_kernel();
+	init_collision_blocks();
+	init_sphere_events();
+	init_windows();
+}
+
+static void free_test_simulation() {
+	free(sim_data.sectors_flat);
+	int i;
+	for (i = 0; i < sim_data.sector_dims[X_AXIS]; i++) {
+		free(sim_data.sectors[i]);
+	}
+	free(sim_data.sectors);
+	free_sphere_events();
+	free_sector_event_tree();
+	free_windows();
+	free_collision_blocks();
+	free(sim_data.spheres_by_id);
+	sim_data.spheres = NULL;
+	sim_data.spheres_by_id = NULL;
+	sim_data.total_num_spheres = 0;
+	sim_data.elapsed_time = 0.0;
+}
+
+// Runs iterations as do_simulation_iteration_dd() does until one is not a
+// sphere moving into another cell, leaving it in event_details.
+static void run_test_event() {
+	do {
+		reset_event();
+		find_event_times_for_all_sectors();
+		apply_event_dd();
+		sim_data.elapsed_time += event_details.time;
+	} while (event_details.type == COL_SPHERE_WITH_CELL);
+}
+
+// Sphere A is on course to hit sphere B, which is resting, but before it can
+// sphere C knocks B out of A's way. A's cached event still names B, so it has
+// to be found to be stale from B's collision count, otherwise A would hit B
+// where it no longer is. B should bounce off the grid next instead.
+static void test_sphere_event_staleness() {
+	struct sphere_s spheres[3] = { 0 };
+	union vector_3d saved_grid_size = sim_data.grid_size;
+	int32_t species = find_or_add_species(1.0, 1.0);
+	int i;
+	for (i = 0; i < 3; i++) {
+		spheres[i].id = i;
+		spheres[i].species = species;
+		spheres[i].pos.x = 20.0;
+		spheres[i].pos.y = 20.0;
+		spheres[i].pos.z = 20.0;
+	}
+	struct sphere_s *a = &spheres[0];
+	struct sphere_s *b = &spheres[1];
+	struct sphere_s *c = &spheres[2];
+	// A is a little below B so it passes clear of C once C has stopped
+	a->pos.x = 10.0;
+	a->pos.y = 19.5;
+	a->vel.x = 1.0; // Hits B at about time 8 if it stays where it is
+	c->pos.y = 30.0;
+	c->vel.y = -2.0; // Hits B at time 4 and stops, B going on at its speed
+	sim_data.grid_size.x = 40.0;
+	sim_data.grid_size.y = 40.0;
+	sim_data.grid_size.z = 40.0;
+	init_test_simulation(spheres, 3, 1);
+	run_test_event();
+	bool passed = event_details.type == COL_TWO_SPHERES && sim_data.elapsed_time == 4.0;
+	if (!passed) {
+		printf("Sphere event staleness test: FAILED. B and C did not collide first\n");
+	} else {
+		run_test_event();
+		// B has 19 to go to the grid at a speed of 2
+		passed = event_details.type == COL_SPHERE_WITH_GRID && event_details.sphere_1 == b && fabs(sim_data.elapsed_time - 13.5) < 1e-12;
+		if (passed) {
+			printf("Sphere event staleness test: PASSED.\n");
+		} else {
+			printf("Sphere event staleness test: FAILED. A's event with B was used after B had collided with C\n");
+		}
+	}
+	free_test_simulation();
+	sim_data.grid_size = saved_grid_size;
+	reset_event();
+}
+
+// Threads in the task scheduler test, fewer than there are tasks.
+#define TASK_TEST_NUM_THREADS 4
+#define TASK_TEST_NUM_TASKS 1000
+// Most tasks each task starts itself in the nested part of the test. Task i
+// starts i % (TASK_TEST_MAX_INNER + 1), so some start none or only one.
+#define TASK_TEST_MAX_INNER 8
+
+struct task_test_s {
+	int *counts; // Number of times each task ran
+	int *inner_counts; // TASK_TEST_MAX_INNER for each task, for the tasks it started
+};
+
+// Work that differs a lot between tasks, so that threads finish their share
+// at different times and steal from each other.
+static void do_uneven_work(const int64_t index) {
+	volatile double x = 0.0;
+	int64_t i;
+	for (i = 0; i < (index % 13) * 1000; i++) {
+		x += 1.0;
+	}
+}
+
+static void count_task(void *arg, const int64_t index) {
+	int *counts = arg;
+	do_uneven_work(index);
+	__atomic_fetch_add(&counts[index], 1, __ATOMIC_RELAXED);
+}
+
+static void nested_count_task(void *arg, const int64_t index) {
+	struct task_test_s *t = arg;
+	do_uneven_work(index);
+	__atomic_fetch_add(&t->counts[index], 1, __ATOMIC_RELAXED);
+	run_tasks(count_task, &t->inner_counts[index * TASK_TEST_MAX_INNER], index % (TASK_TEST_MAX_INNER + 1));
+}
+
+// Runs far more tasks than threads, with very different amounts of work, and
+// then tasks that each run a different number of tasks of their own, checking
+// every task ran exactly once.
+static void test_tasks() {
+	int *counts = calloc(TASK_TEST_NUM_TASKS, sizeof(int));
+	int *inner_counts = calloc(TASK_TEST_NUM_TASKS * TASK_TEST_MAX_INNER, sizeof(int));
+	struct task_test_s t = { counts, inner_counts };
+	set_num_threads(TASK_TEST_NUM_THREADS);
+	init_tasks();
+	run_tasks(count_task, counts, TASK_TEST_NUM_TASKS);
+	bool flat_passed = true;
+	int64_t i, j;
+	for (i = 0; i < TASK_TEST_NUM_TASKS; i++) {
+		if (counts[i] != 1) {
+			flat_passed = false;
+		}
+		counts[i] = 0;
+	}
+	run_tasks(nested_count_task, &t, TASK_TEST_NUM_TASKS);
+	bool nested_passed = true;
+	for (i = 0; i < TASK_TEST_NUM_TASKS; i++) {
+		if (counts[i] != 1) {
+			nested_passed = false;
+		}
+		for (j = 0; j < TASK_TEST_MAX_INNER; j++) {
+			int expected = j < i % (TASK_TEST_MAX_INNER + 1) ? 1 : 0;
+			if (inner_counts[(i * TASK_TEST_MAX_INNER) + j] != expected) {
+				nested_passed = false;
+			}
+		}
+	}
+	if (!flat_passed) {
+		printf("Task test: FAILED. A task was not run exactly once\n");
+	} else if (!nested_passed) {
+		printf("Task test: FAILED. A task started inside another task was not run exactly once\n");
+	} else {
+		printf("Task test: PASSED. Using %d threads\n", get_max_threads());
+	}
+	free_tasks();
+	set_num_threads(sim_data.num_threads);
+	free(counts);
+	free(inner_counts);
+}
+
+#define WINDOW_TEST_NUM_SPHERES 5
+// Number of events run in the window rollback test.
+#define WINDOW_TEST_NUM_EVENTS 12
+
+// Two sectors side by side along x. The first sphere crosses from the first
+// sector into the second and hits the second sphere there. The others bounce
+// off the grid, the last after that collision but before the first window
+// ends.
+static void set_window_test_spheres(struct sphere_s *spheres) {
+	static const double pos[WINDOW_TEST_NUM_SPHERES][3] = { { 10.0, 10.0, 10.0 }, { 25.0, 10.0, 10.0 }, { 5.0, 10.0, 10.0 }, { 35.0, 10.0, 10.0 }, { 35.0, 5.0, 15.0 } };
+	static const double vel[WINDOW_TEST_NUM_SPHERES][3] = { { 2.0, 0.0, 0.0 }, { -0.5, 0.0, 0.0 }, { 0.0, 0.0, 3.0 }, { 0.0, 2.5, 0.0 }, { 0.0, -0.75, 0.0 } };
+	int32_t species = find_or_add_species(1.0, 1.0);
+	int i;
+	for (i = 0; i < WINDOW_TEST_NUM_SPHERES; i++) {
+		spheres[i] = (struct sphere_s){ 0 };
+		spheres[i].id = i;
+		spheres[i].species = species;
+		spheres[i].pos.x = pos[i][0];
+		spheres[i].pos.y = pos[i][1];
+		spheres[i].pos.z = pos[i][2];
+		spheres[i].vel.x = vel[i][0];
+		spheres[i].vel.y = vel[i][1];
+		spheres[i].vel.z = vel[i][2];
+	}
+}
+
+// Runs the window test spheres for WINDOW_TEST_NUM_EVENTS events the way
+// simulation_run() does, and leaves them at the end.
+static void run_window_test_simulation(struct sphere_s *spheres) {
+	set_window_test_spheres(spheres);
+	init_test_simulation(spheres, WINDOW_TEST_NUM_SPHERES, 2);
+	init_binary_file();
+	while (1) {
+		reset_event();
+		find_event_times_for_all_sectors();
+		if (!sim_data.uses_windows || !run_lookahead_window()) {
+			apply_event_dd();
+			sim_data.elapsed_time += event_details.time;
+		}
+		if (is_simulation_finished()) {
+			break;
+		}
+		save_event_to_file();
+	}
+	update_spheres();
+	close_data_file();
+	free_test_simulation();
+}
+
+// The first sphere hits the second at 5.2, inside the first optimistic window,
+// which runs to 6, twice the time of the first event. The sectors each go
+// through their own events without seeing it, so it has to be found as a
+// straggler and the last sphere's bounce at about 5.3 rolled back. The spheres
+// should end where they do without windows.
+static void test_window_rollback() {
+	struct sphere_s expected[WINDOW_TEST_NUM_SPHERES], spheres[WINDOW_TEST_NUM_SPHERES];
+	union vector_3d saved_grid_size = sim_data.grid_size;
+	char *saved_output_file = output_file;
+	int saved_event_limit = sim_data.event_limit;
+	sim_data.grid_size.x = 40.0;
+	sim_data.grid_size.y = 20.0;
+	sim_data.grid_size.z = 20.0;
+	output_file = "/dev/null";
+	sim_data.event_limit = WINDOW_TEST_NUM_EVENTS;
+	run_window_test_simulation(expected);
+	sim_data.uses_windows = true;
+	sim_data.uses_optimistic_windows = true;
+	run_window_test_simulation(spheres);
+	sim_data.uses_windows = false;
+	sim_data.uses_optimistic_windows = false;
+	bool same = true;
+	int i, a;
+	for (i = 0; i < WINDOW_TEST_NUM_SPHERES; i++) {
+		for (a = 0; a < 3; a++) {
+			if (fabs(spheres[i].pos.vals[a] - expected[i].pos.vals[a]) > 1e-9 || fabs(spheres[i].vel.vals[a] - expected[i].vel.vals[a]) > 1e-9) {
+				same = false;
+			}
+		}
+	}
+	if (get_num_rollbacks() == 0) {
+		printf("Window rollback test: FAILED. The window was not rolled back\n");
+	} else if (!same) {
+		printf("Window rollback test: FAILED. Spheres did not end where they do without windows\n");
+	} else {
+		printf("Window rollback test: PASSED.\n");
+	}
+	sim_data.grid_size = saved_grid_size;
+	output_file = saved_output_file;
+	sim_data.event_limit = saved_event_limit;
+	reset_event();
+}
+
+// With a single species, init_pair_kernel picks the uniform radius version of
+// the pair kernel, which should find the same partner at the same time as
+// checking each pair in turn.
+// Clears the species table, so must run after every other test using it.
+static void test_uniform_pair_kernel() {
+	const int num_spheres = 1000;
+	const int num_checked = 100;
+	free_species();
+	int32_t species = find_or_add_species(1.0, 1.0);
+	struct sphere_s *spheres = malloc(num_spheres * sizeof(struct sphere_s));
+	struct sphere_block_s block = {0};
+	srand(1);
+	int i, j;
+	for (i = 0; i < num_spheres; i++) {
+		set_random_vector(&spheres[i].pos, 0.0, 100.0);
+		set_random_vector(&spheres[i].vel, -1.0, 1.0);
+		spheres[i].species = species;
+		add_sphere_to_block(&block, &spheres[i]);
+	}
+	init_pair_kernel();
+	bool passed = has_uniform_radius() && has_uniform_mass();
+	for (i = 0; i < num_checked; i++) {
+		double time;
+		int64_t index = find_soonest_collision_in_block(&spheres[i], &block, i + 1, &time);
+		double expected_time = DBL_MAX;
+		int64_t expected_index = -1;
+		for (j = i + 1; j < num_spheres; j++) {
+			double t = find_collision_time_spheres(&spheres[i], &spheres[j]);
+			if (t < expected_time) {
+				expected_time = t;
+				expected_index = j;
+			}
+		}
+		if (index != expected_index || time != expected_time) {
+			passed = false;
+		}
+	}
+	if (passed) {
+		printf("Uniform pair kernel test: PASSED. Using %s\n", get_pair_kernel_name());
+	} else {
+		printf("Uniform pair kernel test: FAILED. Found a different partner or time to checking each pair\n");
+	}
+	free_sphere_block(&block);
+	free(spheres);
+	free_species();
+}
 
 void run_tests() {
 	test_1();
 	test_2();
 	test_3();
 	test_4();
+	test_largest_radius();
+	test_resting_count();
+	test_morton_codes();
+	test_species();
+	test_solvers();
+	benchmark_pair_loops();
+	test_sector_blocks();
+	test_sector_event_tree();
+	test_event_queue();
+	test_sphere_event_staleness();
+	test_tasks();
+	test_window_rollback();
+	test_uniform_pair_kernel();
 }
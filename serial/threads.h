@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+// Event prediction can be shared between threads using OpenMP.
+// When built without OpenMP everything runs on the one thread, and the
+// pragmas are ignored.
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static inline bool has_thread_support() {
+#ifdef _OPENMP
+	return true;
+#else
+	return false;
+#endif
+}
+
+static inline void set_num_threads(const int num_threads) {
+#ifdef _OPENMP
+	omp_set_num_threads(num_threads);
+#else
+	(void)num_threads;
+#endif
+}
+
+// Number of threads parallel regions will use, so per thread scratch space
+// can be allocated for each of them.
+static inline int get_max_threads() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+static inline int get_thread_num() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+// Lock for data shared between threads. Does nothing without OpenMP.
+#ifdef _OPENMP
+typedef omp_lock_t thread_lock;
+#else
+typedef int thread_lock;
+#endif
+
+static inline void init_thread_lock(thread_lock *l) {
+#ifdef _OPENMP
+	omp_init_lock(l);
+#else
+	(void)l;
+#endif
+}
+
+static inline void destroy_thread_lock(thread_lock *l) {
+#ifdef _OPENMP
+	omp_destroy_lock(l);
+#else
+	(void)l;
+#endif
+}
+
+static inline void lock_thread_lock(thread_lock *l) {
+#ifdef _OPENMP
+	omp_set_lock(l);
+#else
+	(void)l;
+#endif
+}
+
+static inline void unlock_thread_lock(thread_lock *l) {
+#ifdef _OPENMP
+	omp_unset_lock(l);
+#else
+	(void)l;
+#endif
+}
+
+// Wall clock time in seconds, for timing work done on several threads.
+static inline double get_wall_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + ((double)t.tv_nsec * 1e-9);
+}
@@ -0,0 +1,1063 @@
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "collision.h"
+#include "event.h"
+#include "io.h"
+#include "sector.h"
+#include "simulation.h"
+#include "sphere.h"
+#include "sphere_events.h"
+#include "tasks.h"
+#include "vector_3.h"
+#include "window.h"
+
+// Lookahead windows, see -w.
+// Spheres only affect spheres in other sectors by colliding with them. If no
+// sphere can touch a sphere of another sector before some time, the horizon,
+// then each sector's events up to then only depend on its own spheres. Each
+// sector then goes through its own events up to the horizon with its own time,
+// as a task, rather than every event being found over all sectors one at a
+// time. Afterwards the events are put back in time order, counted and written
+// out as if they had been found one at a time.
+//
+// The horizon comes from how far spheres can move. A sphere keeps its speed
+// until it first touches another, as bouncing off the grid does not change it,
+// and no sphere can be faster than if it had all of its sector's kinetic
+// energy. So a sphere moves at most its own speed times the time until it
+// could first touch another sphere, and at the sector's limit after that.
+// The horizon is the soonest that either
+//  - a sphere could have moved half the gap to the nearest sphere of another
+//    sector, so no two spheres of different sectors can have touched,
+//  - or a sphere could have crossed into another sector after it could have
+//    touched another sphere.
+// So a sphere that crosses into another sector during the window cannot touch
+// anything before the horizon. It stays with its own sector, parked (see
+// park_sphere_event()), and is moved to the sector it ended up in once the
+// window is over.
+//
+// Optimistic windows, see -W, do not wait for a horizon that is certain.
+// Sectors run ahead to a speculative horizon, and afterwards their spheres'
+// paths are checked for the first time two spheres touched that the sectors
+// could not see, the first straggler: two spheres of different sectors, or a
+// parked sphere and any other. The earlier of that and the speculative horizon
+// is the global virtual time. Events before it are kept and written out, and
+// the rest are rolled back from the copies of their spheres. Their sectors
+// then go on from the last event kept, one event at a time as usual, so the
+// straggler is found as an ordinary event. The speculative horizon is pushed
+// out after a window with no straggler and brought in after one with.
+
+// Horizons are brought in by this fraction of their length, and speed limits
+// raised by it, to allow for rounding.
+#define WINDOW_MARGIN 1e-6
+// Sectors go through at most this many events for each of their spheres in a
+// window, so that optimistic windows do not run far past their first
+// straggler, and the spheres' paths stay short enough to check cheaply.
+#define WINDOW_MAX_EVENTS_PER_SPHERE 1.0
+// Speculative horizons are this many times further out after a window with no
+// straggler. After one with they are brought in to the first straggler.
+#define WINDOW_SPECULATION_GROWTH 2.0
+// Spheres per bin when looking for gaps between spheres, see bin_spheres().
+#define WINDOW_BIN_SPHERES 2.0
+// After a window that would have held no events, or fewer than there are
+// sectors, the next one is only tried after skipping 1, 2, 4 and so on
+// iterations, up to this many, so that looking for horizons costs little when
+// they are too short to be worth it.
+#define WINDOW_MAX_SKIP 64
+
+// An event a sector went through in a window, with its spheres as they were
+// before it, to undo it, and after it, to write out.
+struct window_event_s {
+	double time;
+	enum event_type type;
+	int sector_id;
+	int64_t index; // Order the sector went through its events in
+	struct sphere_s *spheres[2]; // The second is NULL unless two spheres collided
+	struct sector_s *dest_sector; // Sector crossed into if the sphere crossed out of one
+	struct sphere_s before[2];
+	struct sphere_s after[2];
+};
+
+// Each sector's own record of the window, so sectors can be run on different
+// threads at once.
+struct sector_window_s {
+	struct window_event_s *events;
+	int64_t num_events;
+	int64_t max_events;
+	struct sphere_s **parked; // Spheres that crossed into another sector
+	int64_t num_parked;
+	int64_t max_parked;
+	double speed_limit; // No sphere in the sector can be faster than this
+	double horizon;
+	// Time up to which all of the sector's events in the window are known, the
+	// end of the window unless it stopped at its most events.
+	double reached;
+	double straggler_time; // First time one of the sector's spheres touched one it could not see
+};
+
+// Where a sphere went in a window, for optimistic windows.
+struct window_sphere_s {
+	// First of the sphere's events in the window, as its index in "merged"
+	// times two plus which of the event's spheres it is, or -1 if it had none.
+	int64_t first_ref;
+	int sector_id; // Sector it belonged to during the window
+	bool parked; // Whether it crossed into another sector at any point
+	// Whether it came near enough to another sector to touch its spheres
+	bool near_other_sectors;
+	// Box its centre stayed in, and the first bin of that box
+	union vector_3d low;
+	union vector_3d high;
+	union vector_3i low_bin;
+};
+
+// Part of a sphere's path in a window, from its event before it, or the start
+// of the window, until "end".
+struct segment_s {
+	const struct sphere_s *state;
+	double end;
+	int64_t ref; // Event that ends the segment, as in window_sphere_s, or -1
+	bool parked;
+};
+
+static struct sector_window_s *windows;
+// Every sector's events in the order they happened in.
+static struct window_event_s *merged;
+static int64_t max_merged;
+static double window_end;
+static double window_reached; // Soonest time any sector's events are known up to
+static int64_t max_counted_events; // Events left before the event limit
+static double largest_radius; // Largest radius in any sector
+static int num_to_skip;
+static int last_skip;
+
+// Spheres are binned by where they are at the start of each window, so the
+// gaps around a sphere can be found without looking through whole cells,
+// which are often several mean free paths wide.
+static union vector_3i bin_dims;
+static union vector_3d bin_size;
+static int64_t num_bins;
+static int64_t *bin_starts;
+static struct sphere_s **binned_spheres;
+static int *binned_sector_ids; // Sector each binned sphere is in
+static int64_t max_binned;
+static int64_t *sphere_bins; // Bin of each sphere, in sector order
+
+static struct window_sphere_s *window_spheres; // Indexed the same as sim_data.spheres
+static int64_t *next_refs; // Next event of the same sphere for each event sphere in "merged", or -1
+static double speculative_length;
+
+static int64_t num_windows;
+static int64_t num_window_events;
+static int64_t num_rollbacks;
+static int64_t num_rolled_back_events;
+
+void init_windows() {
+	windows = calloc(sim_data.num_sectors, sizeof(struct sector_window_s));
+	speculative_length = 0.0;
+	num_to_skip = 0;
+	last_skip = 0;
+}
+
+void free_windows() {
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		free(windows[i].events);
+		free(windows[i].parked);
+	}
+	free(windows);
+	free(merged);
+	free(bin_starts);
+	free(binned_spheres);
+	free(binned_sector_ids);
+	free(sphere_bins);
+	free(window_spheres);
+	free(next_refs);
+	// So that windows can be set up again, as the tests do
+	merged = NULL;
+	max_merged = 0;
+	bin_starts = NULL;
+	binned_spheres = NULL;
+	binned_sector_ids = NULL;
+	max_binned = 0;
+	sphere_bins = NULL;
+	window_spheres = NULL;
+	next_refs = NULL;
+}
+
+void print_window_stats() {
+	printf("Number of lookahead windows: %ld\n", num_windows);
+	printf("Number of events in lookahead windows: %ld\n", num_window_events);
+	if (sim_data.uses_optimistic_windows) {
+		printf("Number of rollbacks: %ld\n", num_rollbacks);
+	}
+	printf("Number of events rolled back: %ld\n", num_rolled_back_events);
+}
+
+// Used by the tests.
+int64_t get_num_rollbacks() {
+	return num_rollbacks;
+}
+
+static union vector_3d get_position_at(const struct sphere_s *s, const double t) {
+	union vector_3d pos;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		pos.vals[a] = s->pos.vals[a] + (s->vel.vals[a] * (t - s->time));
+	}
+	return pos;
+}
+
+static double get_gap(const struct sphere_s *s, const union vector_3d *pos, const struct sphere_s *other, const double t) {
+	union vector_3d other_pos = get_position_at(other, t);
+	union vector_3d diff;
+	diff.x = other_pos.x - pos->x;
+	diff.y = other_pos.y - pos->y;
+	diff.z = other_pos.z - pos->z;
+	return get_vector_3d_magnitude(&diff) - get_sphere_radius(s) - get_sphere_radius(other);
+}
+
+static int64_t get_bin_index(const int x, const int y, const int z) {
+	return ((((int64_t)x * bin_dims.y) + y) * bin_dims.z) + z;
+}
+
+static union vector_3i get_bin_pos(const union vector_3d *pos) {
+	union vector_3i b;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		b.vals[a] = (int)fmin(fmax(floor(pos->vals[a] / bin_size.vals[a]), 0.0), bin_dims.vals[a] - 1.0);
+	}
+	return b;
+}
+
+static int64_t get_bin_of_position(const union vector_3d *pos) {
+	union vector_3i b = get_bin_pos(pos);
+	return get_bin_index(b.x, b.y, b.z);
+}
+
+// Bins are sized to hold about WINDOW_BIN_SPHERES spheres each, but are never
+// narrower than twice the largest diameter.
+static void set_bin_sizes() {
+	double volume = sim_data.grid_size.x * sim_data.grid_size.y * sim_data.grid_size.z;
+	double width = fmax(cbrt(volume * WINDOW_BIN_SPHERES / (double)sim_data.total_num_spheres), 4.0 * largest_radius);
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		bin_dims.vals[a] = (int)fmax(floor(sim_data.grid_size.vals[a] / width), 1.0);
+		bin_size.vals[a] = sim_data.grid_size.vals[a] / bin_dims.vals[a];
+	}
+	num_bins = (int64_t)bin_dims.x * bin_dims.y * bin_dims.z;
+	bin_starts = malloc((num_bins + 1) * sizeof(int64_t));
+	sphere_bins = malloc(sim_data.total_num_spheres * sizeof(int64_t));
+}
+
+static void reserve_binned(const int64_t num) {
+	if (num > max_binned) {
+		max_binned = num;
+		binned_spheres = realloc(binned_spheres, max_binned * sizeof(struct sphere_s *));
+		binned_sector_ids = realloc(binned_sector_ids, max_binned * sizeof(int));
+	}
+}
+
+// Each start is moved on to the next bin's start while the bins are filled,
+// so they are put back afterwards.
+static void shift_bin_starts() {
+	int64_t b;
+	for (b = num_bins; b > 0; b--) {
+		bin_starts[b] = bin_starts[b - 1];
+	}
+	bin_starts[0] = 0;
+}
+
+// Counting sort of every sphere by the bin it is in at time "t".
+static void bin_spheres(const double t) {
+	if (bin_starts == NULL) {
+		set_bin_sizes();
+	}
+	reserve_binned(sim_data.total_num_spheres);
+	memset(bin_starts, 0, (num_bins + 1) * sizeof(int64_t));
+	int64_t j = 0;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		const struct sector_s *sector = &sim_data.sectors_flat[i];
+		int64_t k;
+		for (k = 0; k < sector->num_spheres; k++) {
+			union vector_3d pos = get_position_at(sector->spheres[k], t);
+			sphere_bins[j] = get_bin_of_position(&pos);
+			bin_starts[sphere_bins[j] + 1]++;
+			j++;
+		}
+	}
+	int64_t b;
+	for (b = 0; b < num_bins; b++) {
+		bin_starts[b + 1] += bin_starts[b];
+	}
+	j = 0;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		const struct sector_s *sector = &sim_data.sectors_flat[i];
+		int64_t k;
+		for (k = 0; k < sector->num_spheres; k++) {
+			int64_t slot = bin_starts[sphere_bins[j]]++;
+			binned_spheres[slot] = sector->spheres[k];
+			binned_sector_ids[slot] = i;
+			j++;
+		}
+	}
+	shift_bin_starts();
+}
+
+// Finds the smallest gaps between "s", which is at "pos" at time "t", and the
+// other spheres whose centres were binned within "reach" of it on every axis,
+// both to any of them and to those of other sectors than "sector_id". Gaps are
+// DBL_MAX if there are no such spheres.
+static void find_smallest_gaps(const int sector_id, const struct sphere_s *s, const union vector_3d *pos, const double reach, const double t, double *gap, double *other_sector_gap) {
+	*gap = DBL_MAX;
+	*other_sector_gap = DBL_MAX;
+	int low[3], high[3];
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		low[a] = (int)fmax(floor((pos->vals[a] - reach) / bin_size.vals[a]), 0.0);
+		high[a] = (int)fmin(floor((pos->vals[a] + reach) / bin_size.vals[a]), bin_dims.vals[a] - 1.0);
+	}
+	int x, y, z;
+	for (x = low[X_AXIS]; x <= high[X_AXIS]; x++) {
+		for (y = low[Y_AXIS]; y <= high[Y_AXIS]; y++) {
+			for (z = low[Z_AXIS]; z <= high[Z_AXIS]; z++) {
+				int64_t bin = get_bin_index(x, y, z);
+				int64_t i;
+				for (i = bin_starts[bin]; i < bin_starts[bin + 1]; i++) {
+					const struct sphere_s *other = binned_spheres[i];
+					if (other == s) {
+						continue;
+					}
+					double g = get_gap(s, pos, other, t);
+					*gap = fmin(*gap, g);
+					if (binned_sector_ids[i] != sector_id) {
+						*other_sector_gap = fmin(*other_sector_gap, g);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Distance from "pos" to the nearest side of the sector that has another
+// sector beyond it.
+static double get_distance_to_other_sectors(const struct sector_s *sector, const union vector_3d *pos) {
+	double dist = DBL_MAX;
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		if (sector->neighbours[get_face_neighbour_index(a, DIR_POSITIVE)] != NULL) {
+			dist = fmin(dist, sector->end.vals[a] - pos->vals[a]);
+		}
+		if (sector->neighbours[get_face_neighbour_index(a, DIR_NEGATIVE)] != NULL) {
+			dist = fmin(dist, pos->vals[a] - sector->start.vals[a]);
+		}
+	}
+	return fmax(dist, 0.0);
+}
+
+// Soonest time after "t" at which a sphere moving at "speed" until
+// "contact_time", and at up to "speed_limit" after it, could have moved "dist".
+static double get_time_to_move(const double dist, const double t, const double speed, const double contact_time, const double speed_limit) {
+	if (dist <= 0.0) {
+		return t;
+	}
+	if (contact_time == DBL_MAX) {
+		return speed > 0.0 ? t + (dist / speed) : DBL_MAX;
+	}
+	double before_contact = speed * (contact_time - t);
+	if (dist <= before_contact) {
+		return t + (dist / speed);
+	}
+	return speed_limit > 0.0 ? contact_time + ((dist - before_contact) / speed_limit) : DBL_MAX;
+}
+
+// Twice the largest kinetic energy any one sphere in the sector can have,
+// divided by the smallest mass, gives the speed limit.
+static void find_speed_limit_task(void *arg, const int64_t index) {
+	(void)arg;
+	const struct sector_s *sector = &sim_data.sectors_flat[index];
+	double energy = 0.0;
+	double min_mass = DBL_MAX;
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		const struct sphere_s *s = sector->spheres[i];
+		energy += get_sphere_mass(s) * get_vector_3d_dot_product(&s->vel, &s->vel);
+		min_mass = fmin(min_mass, get_sphere_mass(s));
+	}
+	windows[index].speed_limit = sector->num_spheres == 0 ? 0.0 : sqrt(energy / min_mass) * (1.0 + WINDOW_MARGIN);
+}
+
+// Finds the soonest horizon given by any sphere in the sector, see the top of
+// this file.
+// A sphere can be no nearer to a sphere of another sector than its clearance,
+// and cannot move half of that before its clearance over twice the speed
+// limit, so spheres that cannot bring the horizon in are skipped before their
+// gaps are looked for. Spheres with no clearance are done first as they
+// usually give the soonest horizon. Gaps are only looked for within the width
+// of a bin, as the horizon only gets later the further apart spheres are.
+static void find_horizon_task(void *arg, const int64_t index) {
+	(void)arg;
+	const struct sector_s *sector = &sim_data.sectors_flat[index];
+	struct sector_window_s *w = &windows[index];
+	const double t = sim_data.elapsed_time;
+	w->horizon = DBL_MAX;
+	if (sector->num_spheres == 0 || w->speed_limit == 0.0) {
+		return;
+	}
+	double nearby_speed_limit = w->speed_limit;
+	int n;
+	for (n = 0; n < NUM_SECTOR_NEIGHBOURS; n++) {
+		if (sector->neighbours[n] != NULL) {
+			nearby_speed_limit = fmax(nearby_speed_limit, windows[sector->neighbours[n]->id].speed_limit);
+		}
+	}
+	double reach = fmin(fmin(bin_size.x, bin_size.y), bin_size.z);
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		int64_t i;
+		for (i = 0; i < sector->num_spheres; i++) {
+			const struct sphere_s *s = sector->spheres[i];
+			union vector_3d pos = get_position_at(s, t);
+			double radius = get_sphere_radius(s);
+			double face_dist = get_distance_to_other_sectors(sector, &pos);
+			double clearance = face_dist - radius - largest_radius;
+			if ((clearance > 0.0) != (pass == 1)) {
+				continue;
+			}
+			if (clearance > 0.0 && t + (clearance / (2.0 * w->speed_limit)) >= w->horizon) {
+				continue;
+			}
+			double gap, other_sector_gap;
+			find_smallest_gaps(sector->id, s, &pos, reach, t, &gap, &other_sector_gap);
+			// No sphere outside of the bins looked in is nearer than this
+			double unseen_gap = reach - radius - largest_radius;
+			gap = fmin(gap, unseen_gap);
+			other_sector_gap = fmax(fmin(other_sector_gap, unseen_gap), clearance);
+			double speed = get_vector_3d_magnitude(&s->vel);
+			double contact_time = t + (fmax(gap, 0.0) / (speed + nearby_speed_limit));
+			double horizon = get_time_to_move(other_sector_gap / 2.0, t, speed, contact_time, w->speed_limit);
+			double cross_time = get_time_to_move(face_dist, t, speed, contact_time, w->speed_limit);
+			horizon = fmin(horizon, fmax(cross_time, contact_time));
+			w->horizon = fmin(w->horizon, horizon);
+		}
+	}
+}
+
+static void find_largest_radius() {
+	largest_radius = 0.0;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		largest_radius = fmax(largest_radius, sim_data.sectors_flat[i].largest_radius);
+	}
+}
+
+static double find_horizon() {
+	find_largest_radius();
+	int i;
+	bin_spheres(sim_data.elapsed_time);
+	run_tasks(find_speed_limit_task, NULL, sim_data.num_sectors);
+	run_tasks(find_horizon_task, NULL, sim_data.num_sectors);
+	double horizon = DBL_MAX;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		horizon = fmin(horizon, windows[i].horizon);
+	}
+	if (horizon != DBL_MAX) {
+		horizon -= (horizon - sim_data.elapsed_time) * WINDOW_MARGIN;
+	}
+	if (sim_data.uses_time_limit) {
+		horizon = fmin(horizon, sim_data.time_limit);
+	}
+	return horizon;
+}
+
+static struct window_event_s *add_window_event(struct sector_window_s *w) {
+	if (w->num_events >= w->max_events) {
+		w->max_events = w->max_events == 0 ? 64 : w->max_events * 2;
+		w->events = realloc(w->events, w->max_events * sizeof(struct window_event_s));
+	}
+	return &w->events[w->num_events++];
+}
+
+static void copy_event_spheres(struct sphere_s *copies, const struct window_event_s *we) {
+	int i;
+	for (i = 0; i < 2 && we->spheres[i] != NULL; i++) {
+		copies[i] = *we->spheres[i];
+	}
+}
+
+// A sphere crossing out of the sector it was in, either its own or one it had
+// already crossed into, into "dest".
+static void move_sphere_between_sectors(struct sector_s *sector, struct sector_window_s *w, struct sphere_s *s, struct sector_s *dest) {
+	if (dest == sector) {
+		unpark_sphere_event(s);
+		move_sphere_to_correct_cell(sector, s);
+		return;
+	}
+	if (w->num_parked >= w->max_parked) {
+		w->max_parked = w->max_parked == 0 ? 16 : w->max_parked * 2;
+		w->parked = realloc(w->parked, w->max_parked * sizeof(struct sphere_s *));
+	}
+	w->parked[w->num_parked++] = s;
+	park_sphere_event(s, dest);
+}
+
+// Goes through the sector's events until the end of the window.
+// Only the sector and its own spheres are changed, as with
+// find_event_times_from_sphere_events().
+static void run_sector_window_task(void *arg, const int64_t index) {
+	(void)arg;
+	struct sector_s *sector = &sim_data.sectors_flat[index];
+	struct sector_window_s *w = &windows[index];
+	w->num_events = 0;
+	w->num_parked = 0;
+	w->reached = window_end;
+	sector->time = sim_data.elapsed_time;
+	int64_t max_events = (int64_t)fmin(fmax(sector->num_spheres * WINDOW_MAX_EVENTS_PER_SPHERE, 1.0), max_counted_events);
+	while (sector->num_spheres > 0) {
+		reset_sector_event(sector->id);
+		find_event_times_from_sphere_events(sector);
+		struct event_s *e = &sector_events[sector->id];
+		if (e->type == COL_NONE || e->time >= window_end) {
+			break;
+		}
+		if (w->num_events >= max_events) {
+			w->reached = e->time;
+			break;
+		}
+		struct window_event_s *we = add_window_event(w);
+		we->time = e->time;
+		we->type = e->type;
+		we->sector_id = sector->id;
+		we->index = w->num_events - 1;
+		we->spheres[0] = e->sphere_1;
+		we->spheres[1] = e->sphere_2;
+		we->dest_sector = e->dest_sector;
+		copy_event_spheres(we->before, we);
+		update_sphere_position_to_time(e->sphere_1, e->time);
+		if (e->sphere_2 != NULL) {
+			update_sphere_position_to_time(e->sphere_2, e->time);
+		}
+		if (e->type == COL_SPHERE_WITH_SECTOR) {
+			move_sphere_between_sectors(sector, w, e->sphere_1, e->dest_sector);
+		} else {
+			// A parked sphere has crossed into another sector, so hitting it
+			// is a partial crossing, as it would be had it been moved there.
+			if (e->type == COL_TWO_SPHERES && (is_sphere_parked(e->sphere_1) || is_sphere_parked(e->sphere_2))) {
+				we->type = COL_TWO_SPHERES_PARTIAL_CROSSING;
+			}
+			apply_sector_event(e);
+		}
+		sector->time = e->time;
+		copy_event_spheres(we->after, we);
+	}
+}
+
+static int compare_window_events(const void *a, const void *b) {
+	const struct window_event_s *ea = a;
+	const struct window_event_s *eb = b;
+	if (ea->time != eb->time) {
+		return ea->time < eb->time ? -1 : 1;
+	}
+	if (ea->sector_id != eb->sector_id) {
+		return ea->sector_id < eb->sector_id ? -1 : 1;
+	}
+	if (ea->index != eb->index) {
+		return ea->index < eb->index ? -1 : 1;
+	}
+	return 0;
+}
+
+// Puts every sector's events into one array in the order they happened in.
+// Events at the same time are taken from the sector with the lowest id first,
+// as the tournament tree over sector events does.
+static int64_t merge_window_events() {
+	int64_t num = 0;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		num += windows[i].num_events;
+	}
+	if (num > max_merged) {
+		max_merged = num;
+		merged = realloc(merged, max_merged * sizeof(struct window_event_s));
+	}
+	int64_t j = 0;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		memcpy(&merged[j], windows[i].events, windows[i].num_events * sizeof(struct window_event_s));
+		j += windows[i].num_events;
+	}
+	qsort(merged, num, sizeof(struct window_event_s), compare_window_events);
+	return num;
+}
+
+static void count_window_event(const struct window_event_s *we) {
+	if (we->type == COL_SPHERE_WITH_GRID) {
+		stats.num_grid_collisions++;
+	} else if (we->type == COL_TWO_SPHERES) {
+		stats.num_two_sphere_collisions++;
+	} else if (we->type == COL_SPHERE_WITH_SECTOR) {
+		stats.num_sector_transfers++;
+	} else if (we->type == COL_SPHERE_WITH_CELL) {
+		stats.num_cell_crossings++;
+	} else if (we->type == COL_TWO_SPHERES_PARTIAL_CROSSING) {
+		stats.num_partial_crossings++;
+	}
+}
+
+// Points event_details at the copies of the event's spheres, so that it is
+// written out the same way as an event found one at a time.
+static void set_event_details_from_window_event(struct window_event_s *we) {
+	reset_event();
+	event_details.time = 0.0;
+	event_details.type = we->type;
+	event_details.sphere_1 = &we->after[0];
+	event_details.sphere_2 = we->spheres[1] != NULL ? &we->after[1] : NULL;
+}
+
+// Speculative horizons start out twice as far as the soonest event over all
+// sectors, and grow from there.
+static double find_speculative_horizon() {
+	if (speculative_length == 0.0) {
+		speculative_length = event_details.time * WINDOW_SPECULATION_GROWTH;
+	}
+	double horizon = sim_data.elapsed_time + speculative_length;
+	if (sim_data.uses_time_limit) {
+		horizon = fmin(horizon, sim_data.time_limit);
+	}
+	return horizon;
+}
+
+static struct window_sphere_s *get_window_sphere(const struct sphere_s *s) {
+	return &window_spheres[s - sim_data.spheres];
+}
+
+static void start_segment(struct segment_s *seg, const struct sphere_s *s) {
+	seg->ref = get_window_sphere(s)->first_ref;
+	seg->parked = false;
+	if (seg->ref < 0) {
+		seg->state = s;
+		seg->end = window_end;
+	} else {
+		seg->state = &merged[seg->ref / 2].before[seg->ref % 2];
+		seg->end = merged[seg->ref / 2].time;
+	}
+}
+
+static void next_segment(struct segment_s *seg, const int sector_id) {
+	const struct window_event_s *we = &merged[seg->ref / 2];
+	seg->state = &we->after[seg->ref % 2];
+	if (we->type == COL_SPHERE_WITH_SECTOR) {
+		seg->parked = we->dest_sector->id != sector_id;
+	}
+	seg->ref = next_refs[seg->ref];
+	seg->end = seg->ref < 0 ? window_end : merged[seg->ref / 2].time;
+}
+
+// Links each sphere's events in the window together in time order.
+static void link_window_events(const int64_t num) {
+	if (window_spheres == NULL) {
+		window_spheres = malloc(sim_data.total_num_spheres * sizeof(struct window_sphere_s));
+	}
+	next_refs = realloc(next_refs, 2 * max_merged * sizeof(int64_t));
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		const struct sector_s *sector = &sim_data.sectors_flat[i];
+		int64_t j;
+		for (j = 0; j < sector->num_spheres; j++) {
+			struct window_sphere_s *ws = get_window_sphere(sector->spheres[j]);
+			ws->first_ref = -1;
+			ws->sector_id = i;
+		}
+	}
+	int64_t k;
+	for (k = num - 1; k >= 0; k--) {
+		int j;
+		for (j = 0; j < 2 && merged[k].spheres[j] != NULL; j++) {
+			struct window_sphere_s *ws = get_window_sphere(merged[k].spheres[j]);
+			next_refs[(2 * k) + j] = ws->first_ref;
+			ws->first_ref = (2 * k) + j;
+		}
+	}
+}
+
+static void add_to_box(union vector_3d *low, union vector_3d *high, const union vector_3d *pos) {
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		low->vals[a] = fmin(low->vals[a], pos->vals[a]);
+		high->vals[a] = fmax(high->vals[a], pos->vals[a]);
+	}
+}
+
+// Finds the box each of the sector's spheres stayed in, and whether it came
+// near enough to another sector to touch one of its spheres.
+static void set_window_spheres_task(void *arg, const int64_t index) {
+	(void)arg;
+	const struct sector_s *sector = &sim_data.sectors_flat[index];
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		const struct sphere_s *s = sector->spheres[i];
+		struct window_sphere_s *ws = get_window_sphere(s);
+		ws->low.x = ws->low.y = ws->low.z = DBL_MAX;
+		ws->high.x = ws->high.y = ws->high.z = -DBL_MAX;
+		ws->parked = false;
+		struct segment_s seg;
+		start_segment(&seg, s);
+		double start = sim_data.elapsed_time;
+		while (true) {
+			union vector_3d pos = get_position_at(seg.state, start);
+			add_to_box(&ws->low, &ws->high, &pos);
+			pos = get_position_at(seg.state, seg.end);
+			add_to_box(&ws->low, &ws->high, &pos);
+			ws->parked = ws->parked || seg.parked;
+			if (seg.ref < 0) {
+				break;
+			}
+			start = seg.end;
+			next_segment(&seg, ws->sector_id);
+		}
+		ws->low_bin = get_bin_pos(&ws->low);
+		double reach = get_sphere_radius(s) + largest_radius;
+		ws->near_other_sectors = ws->parked;
+		enum axis a;
+		for (a = X_AXIS; a <= Z_AXIS; a++) {
+			if (sector->neighbours[get_face_neighbour_index(a, DIR_POSITIVE)] != NULL && ws->high.vals[a] + reach > sector->end.vals[a]) {
+				ws->near_other_sectors = true;
+			}
+			if (sector->neighbours[get_face_neighbour_index(a, DIR_NEGATIVE)] != NULL && ws->low.vals[a] - reach < sector->start.vals[a]) {
+				ws->near_other_sectors = true;
+			}
+		}
+	}
+}
+
+// Puts each sphere in every bin its box in the window overlaps.
+static void bin_window_spheres() {
+	memset(bin_starts, 0, (num_bins + 1) * sizeof(int64_t));
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		int i;
+		for (i = 0; i < sim_data.num_sectors; i++) {
+			const struct sector_s *sector = &sim_data.sectors_flat[i];
+			int64_t j;
+			for (j = 0; j < sector->num_spheres; j++) {
+				const struct window_sphere_s *ws = get_window_sphere(sector->spheres[j]);
+				union vector_3i high = get_bin_pos(&ws->high);
+				int x, y, z;
+				for (x = ws->low_bin.x; x <= high.x; x++) {
+					for (y = ws->low_bin.y; y <= high.y; y++) {
+						for (z = ws->low_bin.z; z <= high.z; z++) {
+							int64_t bin = get_bin_index(x, y, z);
+							if (pass == 0) {
+								bin_starts[bin + 1]++;
+							} else {
+								int64_t slot = bin_starts[bin]++;
+								binned_spheres[slot] = sector->spheres[j];
+								binned_sector_ids[slot] = i;
+							}
+						}
+					}
+				}
+			}
+		}
+		if (pass == 0) {
+			int64_t b;
+			for (b = 0; b < num_bins; b++) {
+				bin_starts[b + 1] += bin_starts[b];
+			}
+			reserve_binned(bin_starts[num_bins]);
+		}
+	}
+	shift_bin_starts();
+}
+
+// First time before "before" that "s1" and "s2" touched in the window when
+// their sectors could not have seen it, either as they are in different
+// sectors or as one of them was parked. DBL_MAX if there is none.
+static double find_unseen_contact(const struct sphere_s *s1, const struct sphere_s *s2, const double before) {
+	const struct window_sphere_s *ws1 = get_window_sphere(s1);
+	const struct window_sphere_s *ws2 = get_window_sphere(s2);
+	struct segment_s seg1, seg2;
+	start_segment(&seg1, s1);
+	start_segment(&seg2, s2);
+	double start = sim_data.elapsed_time;
+	while (start < before) {
+		double end = fmin(fmin(seg1.end, seg2.end), before);
+		if (end > start && (ws1->sector_id != ws2->sector_id || seg1.parked || seg2.parked)) {
+			struct sphere_s c1 = *seg1.state;
+			struct sphere_s c2 = *seg2.state;
+			update_sphere_position_to_time(&c1, start);
+			update_sphere_position_to_time(&c2, start);
+			double t = find_collision_time_spheres(&c1, &c2);
+			if (t != DBL_MAX && start + t < end) {
+				return start + t;
+			}
+		}
+		if (seg1.ref < 0 && seg2.ref < 0) {
+			break;
+		}
+		if (seg1.end == end && seg1.ref >= 0) {
+			next_segment(&seg1, ws1->sector_id);
+		}
+		if (seg2.end == end && seg2.ref >= 0) {
+			next_segment(&seg2, ws2->sector_id);
+		}
+		start = end;
+	}
+	return DBL_MAX;
+}
+
+static bool do_boxes_overlap(const union vector_3d *low_1, const union vector_3d *high_1, const union vector_3d *low_2, const union vector_3d *high_2) {
+	enum axis a;
+	for (a = X_AXIS; a <= Z_AXIS; a++) {
+		if (low_1->vals[a] > high_2->vals[a] || low_2->vals[a] > high_1->vals[a]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Finds the first straggler involving the sector's spheres that came near
+// other sectors. Each pair is only checked once: by the sphere that comes
+// first in memory if both came near other sectors, and only in the first bin
+// both of their boxes are in.
+static void find_stragglers_task(void *arg, const int64_t index) {
+	(void)arg;
+	const struct sector_s *sector = &sim_data.sectors_flat[index];
+	struct sector_window_s *w = &windows[index];
+	w->straggler_time = window_reached;
+	int64_t i;
+	for (i = 0; i < sector->num_spheres; i++) {
+		const struct sphere_s *s = sector->spheres[i];
+		const struct window_sphere_s *ws = get_window_sphere(s);
+		if (!ws->near_other_sectors) {
+			continue;
+		}
+		double reach = get_sphere_radius(s) + largest_radius;
+		union vector_3d low, high;
+		enum axis a;
+		for (a = X_AXIS; a <= Z_AXIS; a++) {
+			low.vals[a] = ws->low.vals[a] - reach;
+			high.vals[a] = ws->high.vals[a] + reach;
+		}
+		union vector_3i low_bin = get_bin_pos(&low);
+		union vector_3i high_bin = get_bin_pos(&high);
+		int x, y, z;
+		for (x = low_bin.x; x <= high_bin.x; x++) {
+			for (y = low_bin.y; y <= high_bin.y; y++) {
+				for (z = low_bin.z; z <= high_bin.z; z++) {
+					int64_t bin = get_bin_index(x, y, z);
+					int64_t j;
+					for (j = bin_starts[bin]; j < bin_starts[bin + 1]; j++) {
+						const struct sphere_s *other = binned_spheres[j];
+						const struct window_sphere_s *wo = get_window_sphere(other);
+						if (other == s || (wo->near_other_sectors && other < s)) {
+							continue;
+						}
+						if (binned_sector_ids[j] == index && !ws->parked && !wo->parked) {
+							continue;
+						}
+						if (x != (int)fmax(low_bin.x, wo->low_bin.x) || y != (int)fmax(low_bin.y, wo->low_bin.y) || z != (int)fmax(low_bin.z, wo->low_bin.z)) {
+							continue;
+						}
+						if (!do_boxes_overlap(&low, &high, &wo->low, &wo->high)) {
+							continue;
+						}
+						w->straggler_time = fmin(w->straggler_time, find_unseen_contact(s, other, w->straggler_time));
+					}
+				}
+			}
+		}
+	}
+}
+
+// Finds the first straggler in an optimistic window, or "window_reached" if
+// there is none before it.
+static double find_first_straggler(const int64_t num) {
+	find_largest_radius();
+	if (bin_starts == NULL) {
+		set_bin_sizes();
+	}
+	link_window_events(num);
+	run_tasks(set_window_spheres_task, NULL, sim_data.num_sectors);
+	bin_window_spheres();
+	run_tasks(find_stragglers_task, NULL, sim_data.num_sectors);
+	double straggler_time = window_reached;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		straggler_time = fmin(straggler_time, windows[i].straggler_time);
+	}
+	return straggler_time;
+}
+
+// Puts the spheres of events from "first" on back as they were before them,
+// latest first. Only where the spheres were and how they were moving is put
+// back, as the sectors may have sorted them since, and spheres are moved back
+// to the cells they were in. Each sphere put back is predicted again, and
+// anything predicted with it as the partner goes out of date. Predictions for
+// spheres with no events rolled back stay correct, as any event they would
+// have had with the spheres put back is found from the other side.
+static void roll_back_window_events(const int64_t first, const int64_t num) {
+	int64_t i;
+	for (i = num - 1; i >= first; i--) {
+		struct sector_s *sector = &sim_data.sectors_flat[merged[i].sector_id];
+		int j;
+		for (j = 0; j < 2 && merged[i].spheres[j] != NULL; j++) {
+			struct sphere_s *s = merged[i].spheres[j];
+			const struct sphere_s *before = &merged[i].before[j];
+			s->pos = before->pos;
+			s->vel = before->vel;
+			s->time = before->time;
+			if (merged[i].type == COL_SPHERE_WITH_CELL) {
+				move_sphere_to_correct_cell(sector, s);
+			}
+			set_sector_sphere_data(sector, s);
+			update_max_speed(sector, s);
+			invalidate_events_involving_sphere(s);
+		}
+	}
+}
+
+// Parks the spheres that had crossed out of their own sector as of the last
+// event kept, and unparks the rest, once later events have been rolled back.
+static void repark_window_spheres(const int64_t num_kept) {
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		int64_t j;
+		for (j = 0; j < windows[i].num_parked; j++) {
+			unpark_sphere_event(windows[i].parked[j]);
+		}
+	}
+	int64_t k;
+	for (k = 0; k < num_kept; k++) {
+		const struct window_event_s *we = &merged[k];
+		if (we->type != COL_SPHERE_WITH_SECTOR) {
+			continue;
+		}
+		if (we->dest_sector->id == we->sector_id) {
+			unpark_sphere_event(we->spheres[0]);
+		} else {
+			park_sphere_event(we->spheres[0], we->dest_sector);
+		}
+	}
+}
+
+// Finds the global virtual time, before which all of the window's events are
+// known and correct, and returns how many of the events came before it. Any
+// after it are rolled back.
+static int64_t find_global_virtual_time(const int64_t num) {
+	window_reached = window_end;
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		window_reached = fmin(window_reached, windows[i].reached);
+	}
+	double gvt = window_reached;
+	if (sim_data.uses_optimistic_windows) {
+		gvt = find_first_straggler(num);
+		if (gvt < window_reached) {
+			num_rollbacks++;
+			speculative_length = gvt - sim_data.elapsed_time;
+		} else if (window_reached == window_end) {
+			speculative_length *= WINDOW_SPECULATION_GROWTH;
+		}
+	}
+	int64_t num_kept = 0;
+	while (num_kept < num && merged[num_kept].time < gvt) {
+		num_kept++;
+	}
+	if (num_kept < num) {
+		roll_back_window_events(num_kept, num);
+		repark_window_spheres(num_kept);
+		num_rolled_back_events += num - num_kept;
+	}
+	return num_kept;
+}
+
+static void invalidate_window_sectors() {
+	int i;
+	for (i = 0; i < sim_data.num_sectors; i++) {
+		struct sector_s *sector = &sim_data.sectors_flat[i];
+		struct sector_window_s *w = &windows[i];
+		if (w->num_events > 0) {
+			invalidate_sector(sector);
+		}
+		int64_t j;
+		for (j = 0; j < w->num_parked; j++) {
+			struct sphere_s *s = w->parked[j];
+			// NULL if the sphere came back, or if it is in the list twice
+			struct sector_s *region = unpark_sphere_event(s);
+			if (region == NULL) {
+				continue;
+			}
+			remove_sphere_from_sector(sector, s);
+			add_sphere_to_sector(region, s);
+			invalidate_events_involving_sphere(s);
+			invalidate_sector(region);
+		}
+	}
+}
+
+static void skip_windows() {
+	last_skip = last_skip == 0 ? 1 : (int)fmin(2.0 * last_skip, WINDOW_MAX_SKIP);
+	num_to_skip = last_skip;
+}
+
+// Called once the soonest event over all sectors has been found. If the
+// horizon is after it every sector goes through its events up to the horizon,
+// and these are written out as iterations up to the last one, which is left
+// in event_details for the caller to finish as usual. In an optimistic window
+// only the events before the global virtual time are kept. Returns false if
+// no events were kept, in which case the event found should be applied as
+// normal.
+bool run_lookahead_window() {
+	if (num_to_skip > 0) {
+		num_to_skip--;
+		return false;
+	}
+	// Spheres of different sectors touching is only found over all sectors,
+	// so no window could get past it.
+	if (event_details.type == COL_TWO_SPHERES_PARTIAL_CROSSING) {
+		return false;
+	}
+	window_end = sim_data.uses_optimistic_windows ? find_speculative_horizon() : find_horizon();
+	if (window_end <= sim_data.elapsed_time + event_details.time) {
+		skip_windows();
+		return false;
+	}
+	max_counted_events = INT64_MAX;
+	if (!sim_data.uses_time_limit) {
+		max_counted_events = sim_data.event_limit - (stats.num_two_sphere_collisions + stats.num_grid_collisions + stats.num_partial_crossings);
+	}
+	run_tasks(run_sector_window_task, NULL, sim_data.num_sectors);
+	int64_t num = merge_window_events();
+	int64_t num_kept = find_global_virtual_time(num);
+	if (num_kept < sim_data.num_sectors) {
+		skip_windows();
+	} else {
+		last_skip = 0;
+	}
+	if (num_kept == 0) {
+		invalidate_window_sectors();
+		return false;
+	}
+	num_windows++;
+	num_window_events += num_kept;
+	int64_t i;
+	for (i = 0; i < num_kept; i++) {
+		count_window_event(&merged[i]);
+		sim_data.elapsed_time = merged[i].time;
+		set_event_details_from_window_event(&merged[i]);
+		if (i == num_kept - 1 || is_simulation_finished()) {
+			break;
+		}
+		save_event_to_file();
+		printf("Iteration: %d\n", sim_data.iteration_number);
+	}
+	if (i < num_kept - 1) {
+		roll_back_window_events(i + 1, num_kept);
+	} else {
+		invalidate_window_sectors();
+	}
+	return true;
+}
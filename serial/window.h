@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void init_windows();
+void free_windows();
+bool run_lookahead_window();
+void print_window_stats();
+int64_t get_num_rollbacks();